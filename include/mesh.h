@@ -6,18 +6,37 @@
 
 #define MAC_SIZE 6
 
+//buckets in MeshStats::RXLatency
+#define MESH_RX_LATENCY_BUCKETS 10
+
+//uncomment to build the on-device benchmarks, call MeshBenchmark() after the mesh is initialized
+//and the results are printed to Serial
+//#define MESH_BENCHMARK
+
 typedef void (*MessageCallbackFunc)(const uint8_t *From_MAC, const uint8_t *Data, unsigned int DataLen);
 typedef void (*ConnectedCallbackFunc)(const uint8_t *MAC, const char *Name, int Succeeded);
 typedef void (*SendFailedCallbackFunc)(const uint8_t *MAC);
 typedef void (*SendMessageFunc)(const uint8_t *Data, unsigned int DataLen);
 
+//piece of a frame handed to SendFrameCallback, the pieces are sent back to back
+typedef struct MeshIOVec
+{
+    const void *Data;
+    unsigned int Len;
+} MeshIOVec;
+typedef void (*SendFrameFunc)(const MeshIOVec *Vec, unsigned int VecCount);
+typedef void (*WriteCompleteCallbackFunc)(const uint8_t *MAC, unsigned int Handle, int Succeeded);
+
 typedef class MeshNetwork
 {
     public:
         //potential error returns from attempting to initialize the mesh network
         typedef enum MeshInitErrors
         {
-            AlreadyInitialized = -6,
+            InvalidRXDropPolicy = -9,
+            FailedMemoryInit,
+            InvalidCipherSuite,
+            AlreadyInitialized,
             FailedToGetMac,
             FailedDiffieHelmanInit,
             FailedBroadcastLFSRInit,
@@ -29,14 +48,42 @@ typedef class MeshNetwork
 
         typedef enum MeshWriteErrors
         {
-            OutOfMemory = -6,
+            QueueFull = -7,                             //WriteAsync queue for the device is full
+            OutOfMemory,
             MeshNotInitialized,
             DataTooLarge,
             DeviceDoesNotExist,
             ResettingConnection,
-            PreviousWriteNotComplete
+            PreviousWriteNotComplete                    //the last message or a full send window is still waiting on acks
         } MeshWriteErrors;
 
+        //ciphers packets can be encrypted with, the LFSR is the original and always available
+        typedef enum MeshCipherSuites
+        {
+            CipherLFSR = 0,
+            CipherChaCha20,
+            CipherSuiteCount
+        } MeshCipherSuites;
+
+        //received frames are queued by class, control frames are handled first then unicast is favored
+        //over broadcast, see the RXClass counters in MeshStats
+        typedef enum MeshRXClasses
+        {
+            RXClassControl = 0,                         //connection handshakes, acks, pings and disconnects
+            RXClassUnicast,                             //messages to this device
+            RXClassBroadcast,                           //broadcast messages
+            RXClassCount
+        } MeshRXClasses;
+
+        //what to do when a receive queue is full
+        typedef enum MeshRXDropPolicies
+        {
+            RXDropNewest = 0,                           //drop the frame that did not fit
+            RXDropOldestBroadcast,                      //as RXDropNewest but a full broadcast queue discards it's oldest broadcast
+                                                        //to fit the new one, counted in RXDroppedOldest
+            RXDropPolicyCount
+        } MeshRXDropPolicies;
+
         //Value to use for MAC when broadcasting via Write()
         const uint8_t BroadcastMAC[MAC_SIZE] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
         
@@ -49,22 +96,97 @@ typedef class MeshNetwork
             unsigned long long DiffieHellman_P;             //must be prime
             unsigned long long  DiffieHellman_G;            //must be non-zero and smaller than P, preferably prime
             MessageCallbackFunc ReceiveMessageCallback;     //function to call when receiving a message from a known/connected device
-                                                            //DataSize = 0          - Acknowledgement of direct message sent to a MAC
+                                                            //DataSize = 0          - Acknowledgement of direct message sent to a MAC,
+                                                            //                        once all fragments of a fragmented message are acked
             MessageCallbackFunc PingCallback;               //function to call when pinged from a device
             MessageCallbackFunc BroadcastMessageCallback;   //function to call when a broadcast message is seen
             ConnectedCallbackFunc ConnectedCallback;        //function to call when a new connection is completed
                                                             //Succeeded = 1         - Connection succeeded
                                                             //Succeeded = 0         - Connection failed
                                                             //Succeeded = -1        - Connection was disconnected
-            SendFailedCallbackFunc SendFailedCallback;      //function to call when a direct message fails to be ack'd
+            SendFailedCallbackFunc SendFailedCallback;      //function to call when a direct message fails to be ack'd, once per fragmented message
             SendMessageFunc SendMessageCallback;            //If filled in then this function will be called each time there is a message to send
+            SendFrameFunc SendFrameCallback;                //if filled in this is called instead of SendMessageCallback with each frame as binary,
+                                                            //the 802.11 header then the payload. frames are handed to ProcessFrame on the other side
+            WriteCompleteCallbackFunc WriteCompleteCallback;//function to call when a message from WriteAsync is acked or fails, with the handle
+                                                            //WriteAsync returned. SendFailedCallback and the ack to ReceiveMessageCallback
+                                                            //are only called for messages from Write
             bool BroadcastFlag;                             //Set the default state for broadcasting
+            uint8_t DHPoolDepth;                            //number of diffie hellman challenges to keep precomputed, 0 for default
+            uint8_t DHPoolPriority;                         //task priority of the thread filling the challenge pool, 0 for default
+            uint8_t CipherSuite;                            //MeshCipherSuites value to ask for when connecting, falls back to CipherLFSR if the other side lacks it
+            uint8_t BroadcastCipherSuite;                   //MeshCipherSuites value for broadcasts, must be the same on every device
+            bool StrictCipherSuite;                         //refuse connections that would use CipherLFSR when both sides have CipherChaCha20,
+                                                            //version 1 devices say nothing about their suites so they are refused too
+            uint8_t RXQueueFrames[RXClassCount];            //frames that can be queued per MeshRXClasses value, rounded down to a power of 2,
+                                                            //0 for default. each frame takes about 1KB that is allocated during init
+            uint8_t RXDropPolicy;                           //MeshRXDropPolicies value
+            uint16_t RXMaxAge;                              //milliseconds a frame can be queued before it is discarded unhandled, 0 for default
+            uint8_t SendWindow;                             //messages to a device that can be waiting on an ack at once, up to 32, 0 for default.
+                                                            //1 sends one at a time, devices without window support are always sent one at a time
+            uint16_t MaxMessageSize;                        //largest message Write accepts and that is put back together when received, 0 for default.
+                                                            //messages larger than a frame are split into fragments, unicast needs a send window with the device
+            uint16_t CoalesceDelay;                         //milliseconds a small message can be held to go out in one frame with later messages
+                                                            //to the same device, 0 to send each on it's own. needs a send window with the device
+            uint16_t RTOMin;                                //shortest milliseconds an ack is waited on before resending, 0 for default
+            uint16_t RTOMax;                                //longest milliseconds an ack is waited on before resending, 0 for default.
+                                                            //the wait is worked out per device from how long acks take and doubles on each resend
+            uint8_t WriteQueueDepth;                        //messages WriteAsync can hold per device waiting to be sent, 0 for default
         } MeshNetworkData;
 
+        //running counters, see GetStats
+        typedef struct MeshStats
+        {
+            unsigned int DHPoolHits;                        //connections that used a precomputed diffie hellman challenge
+            unsigned int DHPoolMisses;                      //connections that had to calculate a challenge as the pool was empty
+            unsigned int RXFrames;                          //mesh frames queued for processing
+            unsigned int RXRepeats;                         //frames seen again while the first copy was still queued
+            unsigned int RXQueueFull;                       //frames dropped as the rx queue was full
+            unsigned int RXDroppedOldest;                   //queued broadcasts discarded to make room, see RXDropOldestBroadcast
+            unsigned int RXExpired;                         //queued frames discarded for waiting longer than RXMaxAge
+            unsigned int RXTooLarge;                        //frames dropped for being larger than MAX_PACKET_SIZE
+            unsigned int RXBusy;                            //frames dropped from the wifi callback while ProcessMessage was adding one
+            unsigned int RXSeen;                            //broadcast copies dropped before queueing as they were already handled
+            unsigned int RebroadcastsSent;                  //broadcasts from others repeated
+            unsigned int RebroadcastsCancelled;             //repeats skipped as enough other devices repeated it while waiting
+            unsigned int RebroadcastsDropped;               //repeats skipped as the queue was full
+            unsigned int FragmentedSent;                    //messages sent in fragments
+            unsigned int Reassembled;                       //fragmented messages received
+            unsigned int ReassemblyTimeouts;                //fragmented messages discarded as the rest did not show up in time
+            unsigned int ReassemblyDropped;                 //fragments dropped as they were invalid, too large or all buffers were busy
+            unsigned int CoalescedFrames;                   //frames sent with more than one message in them, see CoalesceDelay
+            unsigned int CoalescedMessages;                 //messages sent in those frames
+            unsigned int RXClassFrames[RXClassCount];       //frames handled per MeshRXClasses value
+            unsigned int RXClassDepth[RXClassCount];        //frames queued when GetStats was called
+            unsigned int RXClassMaxDepth[RXClassCount];     //most frames queued at once
+            unsigned long long RXClassWait[RXClassCount];   //total microseconds frames waited, divide by RXClassFrames for the average
+            unsigned int RXClassMaxWait[RXClassCount];      //longest microseconds a frame waited
+            unsigned int RXLatency[MESH_RX_LATENCY_BUCKETS];//time from a frame being queued to it being handled, bucket n counts frames
+                                                            //under 64 << n microseconds, the last bucket counts anything slower
+        } MeshStats;
+
+        //per device counters, see GetPeerStats
+        typedef struct MeshPeerStats
+        {
+            unsigned int SRTT;                              //smoothed microseconds for a message to be acked, 0 until the first ack is timed
+            unsigned int RTTVar;                            //how much the ack time varies in microseconds
+            unsigned int RTO;                               //microseconds an ack is waited on before resending
+            unsigned int Retransmits;                       //messages resent after waiting RTO
+            unsigned int FastRetransmits;                   //messages resent early as later messages were acked
+            unsigned int Timeouts;                          //messages given up on
+        } MeshPeerStats;
+
         //write data to a specific mac on the mesh network, returns the length written
         //See MeshWriteErrors for potential error values
         virtual int Write(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen);
 
+        //queue data for a known device and return a handle above 0, WriteCompleteCallback is called with it once
+        //the message is acked or fails. messages go out in order as earlier ones are acked and are held while the
+        //connection is reset, a reset is started if needed. messages still queued or waiting on an ack when the
+        //device is disconnected are dropped without a callback. broadcasts use Write
+        //See MeshWriteErrors for potential error values
+        virtual int WriteAsync(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen);
+
         //establish a connection a device, this only needs to be done once per device we talk to
         //ConnectedCallback will be triggered with the mac once a connection is established
         //or when a requested connection fails
@@ -103,11 +225,25 @@ typedef class MeshNetwork
         //Call this function if there is a chunk of data to process when not broadcasting itself
         virtual void ProcessMessage(const uint8_t *Data, uint16_t Len);
 
+        //same as ProcessMessage for a frame from SendFrameCallback, the pieces put back together without base64
+        virtual void ProcessFrame(const uint8_t *Data, uint16_t Len);
+
         //set if broadcasting should be done
         virtual void SetBroadcastFlag(bool BroadcastFlag);
+
+        //get a copy of the running counters
+        virtual void GetStats(MeshStats *Stats);
+
+        //get a copy of the counters for a known device, returns 0 or -1 if the device is not known
+        virtual int GetPeerStats(const uint8_t MAC[MAC_SIZE], MeshPeerStats *Stats);
 } MeshNetwork;
 
 //Mesh network initialization
 MeshNetwork *NewMeshNetwork(MeshNetwork::MeshNetworkData *InitData, MeshNetwork::MeshInitErrors *Initialized);
 
+#ifdef MESH_BENCHMARK
+//run the benchmarks against the initialized mesh network
+void MeshBenchmark();
+#endif
+
 #endif
\ No newline at end of file
@@ -252,8 +252,14 @@ int MeshNetworkInternal::RemoveKnownDevice(KnownDeviceStruct *Device)
             else
                 this->KnownDeviceTable[Index] = CurDevice->Next;
             
-            if(CurDevice->LastOutMessage)
-                free(CurDevice->LastOutMessage);
+            //report a message still waiting to go out one at a time as failed, the window and queue report their own
+            if(CurDevice->LastOutMessage || CurDevice->LastOutFrame)
+            {
+                this->LastOutFree(CurDevice);
+                this->SendDone(CurDevice, CurDevice->LastOutMessageHandle, 0);
+            }
+            this->FreeWindow(CurDevice);
+            this->TimerCancel(CurDevice);
             free(CurDevice);
             break;
         }
@@ -81,9 +81,10 @@ unsigned long long MeshNetworkInternal::DHMod128(unsigned long long a[2], unsign
     return atemp[0];
 }
 
-unsigned long long MeshNetworkInternal::DHPowMod(unsigned long long g, unsigned long long pr)
+unsigned long long MeshNetworkInternal::DHPowModLegacy(unsigned long long g, unsigned long long pr)
 {
-    //do a 64bit pow/mod, (g**pr) % m
+    //do a 64bit pow/mod, (g**pr) % m with a long division for every step
+    //only used if P is even as montgomery form requires an odd modulus
     unsigned long long result[2];
     unsigned long long gl[2];
     unsigned long long ml;
@@ -115,10 +116,103 @@ unsigned long long MeshNetworkInternal::DHPowMod(unsigned long long g, unsigned
     return result[0];
 }
 
-//return our value and set the provided value to what the other side is given
-unsigned long long MeshNetworkInternal::DHCreateChallenge(unsigned long long *challenge)
+unsigned long long MeshNetworkInternal::DHMontMul(unsigned long long a, unsigned long long b)
+{
+    //montgomery multiply, returns (a * b) / 2^64 % P for a and b below P
+    //m is picked so the low 64 bits of a * b and m * P are identical, the difference of the
+    //high halves is then the result give or take P
+    unsigned long long m;
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 t;
+    unsigned long long u;
+
+    t = (unsigned __int128)a * b;
+    m = (unsigned long long)t * this->DH_PInv;
+    u = (unsigned long long)(((unsigned __int128)m * this->DH_P) >> 64);
+    a = (unsigned long long)(t >> 64);
+    return (a >= u) ? (a - u) : (a - u + this->DH_P);
+#else
+    unsigned long long t[2];
+    unsigned long long u[2];
+
+    this->DHMul64(a, b, t);
+    m = t[0] * this->DH_PInv;
+    this->DHMul64(m, this->DH_P, u);
+    return (t[1] >= u[1]) ? (t[1] - u[1]) : (t[1] - u[1] + this->DH_P);
+#endif
+}
+
+unsigned long long MeshNetworkInternal::DHPowMod(unsigned long long g, unsigned long long pr)
+{
+    //do a 64bit pow/mod, (g**pr) % m
+    unsigned long long result;
+    unsigned long long gl;
+
+    if(!(this->DH_P & 1))
+        return this->DHPowModLegacy(g, pr);
+
+    //move into montgomery form, 1 is 2^64 % P and g is g * 2^64 % P
+    result = this->DH_R1;
+    gl = this->DHMontMul(g % this->DH_P, this->DH_R2);
+    while(pr)
+    {
+        //if set then do a multiple and modulus
+        if(pr & 1)
+            result = this->DHMontMul(result, gl);
+
+        //bit shift
+        pr >>= 1;
+        gl = this->DHMontMul(gl, gl);
+    };
+
+    //multiplying by 1 takes it back out of montgomery form
+    return this->DHMontMul(result, 1);
+}
+
+//fill a table of G^(digit << (window * Bits)) in montgomery form, one row of 2^Bits - 1 entries per window
+void MeshNetworkInternal::DHBuildFixedBase(unsigned long long *Table, unsigned int Bits)
+{
+    unsigned int Window, Digit;
+    unsigned int Digits = DH_FIXED_BASE_DIGITS(Bits);
+    unsigned long long Base;
+
+    Base = this->DHMontMul(this->DH_G % this->DH_P, this->DH_R2);
+    for(Window = 0; Window < DH_FIXED_BASE_WINDOWS(Bits); Window++)
+    {
+        Table[0] = Base;
+        for(Digit = 1; Digit < Digits; Digit++)
+            Table[Digit] = this->DHMontMul(Table[Digit - 1], Base);
+
+        //the base for the next window is one past the last digit of this one
+        Base = this->DHMontMul(Table[Digits - 1], Base);
+        Table += Digits;
+    }
+}
+
+//G^pr % P from a table built by DHBuildFixedBase, one multiply per non zero digit and no squaring
+unsigned long long MeshNetworkInternal::DHPowFixedBase(const unsigned long long *Table, unsigned int Bits, unsigned long long pr)
+{
+    unsigned long long result;
+    unsigned int Digits = DH_FIXED_BASE_DIGITS(Bits);
+    unsigned int Digit;
+
+    result = this->DH_R1;
+    while(pr)
+    {
+        Digit = pr & Digits;
+        if(Digit)
+            result = this->DHMontMul(result, Table[Digit - 1]);
+
+        pr >>= Bits;
+        Table += Digits;
+    };
+
+    return this->DHMontMul(result, 1);
+}
+
+//select a random private value and calculate the challenge for it
+unsigned long long MeshNetworkInternal::DHCreatePriv(unsigned long long *challenge)
 {
-    //select a random value
     union
     {
         unsigned int priv[2];
@@ -127,7 +221,42 @@ unsigned long long MeshNetworkInternal::DHCreateChallenge(unsigned long long *ch
     priv[0] = esp_random();
     priv[1] = esp_random();
 
+#if DH_FIXED_BASE_BITS
+    if(this->DH_P & 1)
+    {
+        *challenge = this->DHPowFixedBase(this->DH_GTable, DH_FIXED_BASE_BITS, priv64);
+        return priv64;
+    }
+#endif
+
     *challenge = this->DHPowMod(this->DH_G, priv64);
+    return priv64;
+}
+
+//return our value and set the provided value to what the other side is given
+unsigned long long MeshNetworkInternal::DHCreateChallenge(unsigned long long *challenge)
+{
+    unsigned long long priv64;
+
+    //use a precomputed challenge if one is available and wake the pool thread to replace it
+    pthread_mutex_lock(&this->DHPoolLock);
+    if(this->DHPoolCount)
+    {
+        this->DHPoolCount--;
+        priv64 = this->DHPool[this->DHPoolCount].Priv;
+        *challenge = this->DHPool[this->DHPoolCount].Challenge;
+        this->Stats.DHPoolHits++;
+        pthread_cond_signal(&this->DHPoolCond);
+        pthread_mutex_unlock(&this->DHPoolLock);
+    }
+    else
+    {
+        this->Stats.DHPoolMisses++;
+        pthread_cond_signal(&this->DHPoolCond);
+        pthread_mutex_unlock(&this->DHPoolLock);
+        priv64 = this->DHCreatePriv(challenge);
+    }
+
     DEBUG_WRITE("DHCreateChallenge priv ");
     DEBUG_WRITEHEXVAL64(priv64);
     DEBUG_WRITE(", challenge ");
@@ -136,6 +265,62 @@ unsigned long long MeshNetworkInternal::DHCreateChallenge(unsigned long long *ch
     return priv64;
 }
 
+void *Static_DHPoolThread(void *)
+{
+    if(_GlobalMesh)
+        _GlobalMesh->DHPoolThread();
+
+    return 0;
+}
+
+void MeshNetworkInternal::DHPoolThread()
+{
+    unsigned long long priv, challenge;
+    unsigned int Generation;
+
+    while(1)
+    {
+        //wait until there is room in the pool
+        pthread_mutex_lock(&this->DHPoolLock);
+        while((this->DHPoolCount >= this->DHPoolDepth) || this->DHPoolPaused)
+            pthread_cond_wait(&this->DHPoolCond, &this->DHPoolLock);
+        Generation = this->DHPoolGeneration;
+        this->DHPoolBusy = 1;
+        pthread_mutex_unlock(&this->DHPoolLock);
+
+        //do the expensive part without holding the lock
+        priv = this->DHCreatePriv(&challenge);
+
+        //only keep it if P and G did not change while calculating, wake anyone waiting for us to be idle
+        pthread_mutex_lock(&this->DHPoolLock);
+        this->DHPoolBusy = 0;
+        pthread_cond_broadcast(&this->DHPoolCond);
+        if((Generation == this->DHPoolGeneration) && (this->DHPoolCount < this->DHPoolDepth))
+        {
+            this->DHPool[this->DHPoolCount].Priv = priv;
+            this->DHPool[this->DHPoolCount].Challenge = challenge;
+            this->DHPoolCount++;
+        }
+        pthread_mutex_unlock(&this->DHPoolLock);
+    };
+}
+
+//stop the pool thread from starting another challenge and wait for the one it is on, DHInit can then
+//change DH_P and DH_G without the pool thread reading them half way through
+void MeshNetworkInternal::DHPoolPause(int Pause)
+{
+    pthread_mutex_lock(&this->DHPoolLock);
+    this->DHPoolPaused = Pause;
+    if(Pause)
+    {
+        while(this->DHPoolBusy)
+            pthread_cond_wait(&this->DHPoolCond, &this->DHPoolLock);
+    }
+    else
+        pthread_cond_broadcast(&this->DHPoolCond);
+    pthread_mutex_unlock(&this->DHPoolLock);
+}
+
 unsigned long long MeshNetworkInternal::DHFinishChallenge(unsigned long long priv, unsigned long long challenge)
 {
     unsigned long long ret;
@@ -159,9 +344,34 @@ int MeshNetworkInternal::DHInit(unsigned long long P, unsigned long long G)
     if(G > P)
         return -1;
 
+    //anything already in the pool was calculated against the old values
+    pthread_mutex_lock(&this->DHPoolLock);
+    this->DHPoolCount = 0;
+    this->DHPoolGeneration++;
+
     this->DH_P = P;
     this->DH_G = G;
 
+    //montgomery constants, inverse of P mod 2^64 by newton iteration (each pass doubles the correct bits,
+    //P is it's own inverse for the first 3 bits), 2^64 % P and 2^128 % P
+    if(P & 1)
+    {
+        this->DH_PInv = P;
+        for(int i = 0; i < 5; i++)
+            this->DH_PInv *= 2 - (P * this->DH_PInv);
+
+        unsigned long long R[2];
+        this->DH_R1 = (0 - P) % P;
+        this->DHMul64(this->DH_R1, this->DH_R1, R);
+        this->DH_R2 = this->DHMod128(R, P);
+
+#if DH_FIXED_BASE_BITS
+        this->DHBuildFixedBase(this->DH_GTable, DH_FIXED_BASE_BITS);
+#endif
+    }
+    pthread_cond_signal(&this->DHPoolCond);
+    pthread_mutex_unlock(&this->DHPoolLock);
+
     DEBUG_WRITE("DHInit P ");
     DEBUG_WRITEHEXVAL64(P);
     DEBUG_WRITE(", G ");
@@ -0,0 +1,154 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+#include "mesh.h"
+#include "debug.h"
+#include <pthread.h>
+#include <string.h>
+
+//WriteAsync queues messages per device instead of failing while earlier ones wait on an ack or the connection
+//is being reset. the queue is handed to the send path in order as acks make room and once the reset handshake
+//finishes, each message is reported to WriteCompleteCallback by the handle WriteAsync returned
+
+int MeshNetworkInternal::WriteAsync(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen)
+{
+    KnownDeviceStruct *Device;
+    AsyncMessageStruct *Entry;
+    int Handle;
+
+    if(!this->Initialized)
+        return MeshWriteErrors::MeshNotInitialized;
+
+    //messages larger than a frame are split into fragments, up to MaxMessageSize
+    if(DataLen > this->MaxMessageSize)
+        return MeshWriteErrors::DataTooLarge;
+
+    //broadcasts are never acked so there is nothing to report
+    if(memcmp(MAC, this->BroadcastMAC, MAC_SIZE) == 0)
+        return MeshWriteErrors::DeviceDoesNotExist;
+
+    Device = this->FindKnownDevice(MAC);
+    if(!Device)
+        return MeshWriteErrors::DeviceDoesNotExist;
+
+    //if we are in reset mode then tell the other side we want to reconnect
+    if(Device->ConnectState == ConnectStateEnum::CS_Reset)
+        this->Connect(Device->MAC);
+
+    pthread_mutex_lock(&this->WindowLock);
+    if(Device->AsyncCount >= this->AsyncQueueDepth)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::QueueFull;
+    }
+
+    Entry = (AsyncMessageStruct *)malloc(sizeof(AsyncMessageStruct) + DataLen);
+    if(!Entry)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::OutOfMemory;
+    }
+
+    //handles stay above 0 so they can't be mistaken for an error
+    this->AsyncHandle++;
+    if(!this->AsyncHandle || (this->AsyncHandle > 0x7fffffff))
+        this->AsyncHandle = 1;
+    Handle = this->AsyncHandle;
+
+    Entry->Handle = Handle;
+    Entry->Len = DataLen;
+    Entry->Next = 0;
+    memcpy(Entry->Data, Data, DataLen);
+    if(Device->AsyncTail)
+        Device->AsyncTail->Next = Entry;
+    else
+        Device->AsyncHead = Entry;
+    Device->AsyncTail = Entry;
+    Device->AsyncCount++;
+
+    //anything not connected waits, the resend thread fails the queue if the connection doesn't finish
+    if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+        this->AsyncDrain(Device);
+    else
+        this->TimerSchedule(Device, esp_timer_get_time());
+    pthread_mutex_unlock(&this->WindowLock);
+
+    return Handle;
+}
+
+void MeshNetworkInternal::AsyncDrain(KnownDeviceStruct *Device)
+{
+    AsyncMessageStruct *Entry;
+    int Ret;
+
+    //hand queued messages to the send path in order while it takes them, the rest wait for an ack
+    pthread_mutex_lock(&this->WindowLock);
+    if(Device->AsyncDraining)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return;
+    }
+
+    Device->AsyncDraining = 1;
+    while(Device->AsyncHead && (Device->ConnectState == ConnectStateEnum::CS_Connected))
+    {
+        Entry = Device->AsyncHead;
+        Ret = this->WriteDevice(Device, Entry->Data, Entry->Len, Entry->Handle);
+        if(Ret == MeshWriteErrors::PreviousWriteNotComplete)
+            break;
+
+        Device->AsyncHead = Entry->Next;
+        if(!Device->AsyncHead)
+            Device->AsyncTail = 0;
+        Device->AsyncCount--;
+
+        //anything else was taken and is reported once it is acked or given up on
+        if((Ret == MeshWriteErrors::OutOfMemory) || (Ret == MeshWriteErrors::DataTooLarge))
+            this->SendDone(Device, Entry->Handle, 0);
+        free(Entry);
+    }
+
+    if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+        Device->AsyncCheck = 0;
+    Device->AsyncDraining = 0;
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+void MeshNetworkInternal::AsyncFail(KnownDeviceStruct *Device)
+{
+    AsyncMessageStruct *Entry;
+    AsyncMessageStruct *NextEntry;
+
+    //report everything queued as failed, the queue is taken first so callbacks can queue again
+    pthread_mutex_lock(&this->WindowLock);
+    Entry = Device->AsyncHead;
+    Device->AsyncHead = 0;
+    Device->AsyncTail = 0;
+    Device->AsyncCount = 0;
+    Device->AsyncCheck = 0;
+
+    while(Entry)
+    {
+        NextEntry = Entry->Next;
+        this->SendDone(Device, Entry->Handle, 0);
+        free(Entry);
+        Entry = NextEntry;
+    }
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+void MeshNetworkInternal::SendDone(KnownDeviceStruct *Device, unsigned int Handle, int Succeeded)
+{
+    //messages from WriteAsync are reported by handle, ones from Write the way they always were
+    if(Handle)
+    {
+        if(this->WriteCompleteCallback)
+            this->WriteCompleteCallback(Device->MAC, Handle, Succeeded);
+    }
+    else if(Succeeded)
+    {
+        if(this->ReceiveMessageCallback)
+            this->ReceiveMessageCallback(Device->MAC, 0, 0);
+    }
+    else if(this->SendFailedCallback)
+        this->SendFailedCallback(Device->MAC);
+}
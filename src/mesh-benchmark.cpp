@@ -0,0 +1,766 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+
+#ifdef MESH_BENCHMARK
+
+#define BENCHMARK_DATA_SIZE 960
+#define BENCHMARK_ROUNDS 200
+#define BENCHMARK_STREAMS 32
+
+void MeshBenchmark()
+{
+    if(_GlobalMesh)
+        _GlobalMesh->Benchmark();
+}
+
+static void BenchmarkReport(const char *Name, unsigned long long Bytes, int64_t Time)
+{
+    //print bytes per second for the test
+    if(Time <= 0)
+        Time = 1;
+
+    Serial.printf("%-32s %10lu bytes/s\n", Name, (unsigned long)((Bytes * 1000000ULL) / (unsigned long long)Time));
+}
+
+static void BenchmarkReportEach(const char *Name, unsigned long Count, int64_t Time)
+{
+    //print nanoseconds for each run of the test
+    Serial.printf("%-32s %10lu ns\n", Name, (unsigned long)(((unsigned long long)Time * 1000ULL) / Count));
+}
+
+static void BenchmarkFill(uint8_t *Data, unsigned int DataLen)
+{
+    unsigned int i;
+
+    for(i = 0; i < DataLen; i++)
+        Data[i] = esp_random() & 0xff;
+}
+
+//bit serial crc that was used before the table driven version, kept to compare against
+static uint8_t BenchmarkCRCBitwise(const void *Data, unsigned int DataLen, uint8_t StartCRC)
+{
+    unsigned int Count;
+    uint16_t CRC;
+    uint8_t *InData = (uint8_t *)Data;
+    uint8_t BitPos;
+
+    CRC = StartCRC;
+    for(Count = 0; Count < DataLen; Count++)
+    {
+        CRC ^= (uint16_t)InData[Count] << 8;
+        for(BitPos = 8; BitPos; BitPos--) {
+            if(CRC & 0x8000)
+                CRC ^= 0x8380;
+            CRC <<=1;
+        }
+    }
+
+    return (CRC >> 8);
+}
+
+//key derivation as PermuteBroadcastLFSR did it before the MAC part was cached, returns the new LFSRRot
+static unsigned int BenchmarkPermuteReference(const uint8_t *MAC, unsigned int ID, unsigned int LFSR, unsigned int LFSRRot)
+{
+    uint8_t Data[4];
+    unsigned int Ret;
+    int Byte;
+
+    //the LFSR half was calculated and then thrown away, it is kept so the cost matches
+    for(Byte = 0; Byte < 4; Byte++)
+    {
+        Data[Byte] = BenchmarkCRCBitwise(MAC, 6, (Byte ? Data[Byte - 1] : 0) ^ ((LFSR >> (Byte * 8)) & 0xff));
+        Data[Byte] = BenchmarkCRCBitwise(&ID, 4, Data[Byte]);
+    }
+
+    Ret = 0;
+    for(Byte = 0; Byte < 4; Byte++)
+    {
+        Data[Byte] = BenchmarkCRCBitwise(MAC, 6, (Byte ? Data[Byte - 1] : 0) ^ ((LFSRRot >> (Byte * 8)) & 0xff));
+        Data[Byte] = BenchmarkCRCBitwise(&ID, 4, Data[Byte]);
+        Ret |= (unsigned int)Data[Byte] << (Byte * 8);
+    }
+
+    return Ret;
+}
+
+void MeshNetworkInternal::Benchmark()
+{
+    Serial.println("Mesh benchmarks");
+    Serial.println("---------------");
+    this->BenchmarkCRC();
+    this->BenchmarkLFSR();
+    this->BenchmarkBatch();
+    this->BenchmarkBroadcast();
+    this->BenchmarkDH();
+    this->BenchmarkCipherSuites();
+    this->BenchmarkWindowReset();
+}
+
+void MeshNetworkInternal::BenchmarkCRC()
+{
+    uint8_t *Data;
+    uint8_t *Out;
+    LFSRStruct LFSR;
+    unsigned int Len;
+    int Round;
+    int Failed;
+    int64_t Start;
+    uint8_t CRC;
+    volatile uint8_t Result;
+
+    Data = (uint8_t *)malloc(BENCHMARK_DATA_SIZE);
+    Out = (uint8_t *)malloc(BENCHMARK_DATA_SIZE);
+    if(!Data || !Out)
+    {
+        free(Data);
+        free(Out);
+        return;
+    }
+
+    BenchmarkFill(Data, BENCHMARK_DATA_SIZE);
+
+    //make sure the table version matches the bit serial version for all lengths and start values
+    Failed = 0;
+    for(Len = 0; Len < 64; Len++)
+    {
+        for(Round = 0; Round < 256; Round++)
+        {
+            if(this->CalculateCRC(&Data[Len], Len, Round) != BenchmarkCRCBitwise(&Data[Len], Len, Round))
+                Failed++;
+        }
+    }
+    if(this->CalculateCRC(Data, BENCHMARK_DATA_SIZE, 0x5a) != BenchmarkCRCBitwise(Data, BENCHMARK_DATA_SIZE, 0x5a))
+        Failed++;
+    Serial.printf("CRC table check: %s\n", Failed ? "FAILED" : "passed");
+
+    Start = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        Result = BenchmarkCRCBitwise(Data, BENCHMARK_DATA_SIZE, Round);
+    BenchmarkReport("CRC bit serial", BENCHMARK_DATA_SIZE * BENCHMARK_ROUNDS, esp_timer_get_time() - Start);
+
+    Start = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        Result = this->CalculateCRC(Data, BENCHMARK_DATA_SIZE, Round);
+    BenchmarkReport("CRC table", BENCHMARK_DATA_SIZE * BENCHMARK_ROUNDS, esp_timer_get_time() - Start);
+
+    //decrypt followed by a crc pass compared to the fused single pass
+    LFSR = this->LFSR_Broadcast;
+    Start = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 10); Round++)
+    {
+        this->Decrypt(Data, Out, BENCHMARK_DATA_SIZE, &LFSR);
+        Result = BenchmarkCRCBitwise(Out, BENCHMARK_DATA_SIZE, Round);
+    }
+    BenchmarkReport("Decrypt then bit serial CRC", BENCHMARK_DATA_SIZE * (BENCHMARK_ROUNDS / 10), esp_timer_get_time() - Start);
+
+    LFSR = this->LFSR_Broadcast;
+    Start = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 10); Round++)
+    {
+        CRC = Round;
+        this->DecryptCRC(Data, Out, BENCHMARK_DATA_SIZE, &LFSR, &CRC);
+        Result = CRC;
+    }
+    BenchmarkReport("Fused decrypt and CRC", BENCHMARK_DATA_SIZE * (BENCHMARK_ROUNDS / 10), esp_timer_get_time() - Start);
+
+    //confirm the fused version gives the same answer
+    LFSR = this->LFSR_Broadcast;
+    this->Decrypt(Data, Out, BENCHMARK_DATA_SIZE, &LFSR);
+    CRC = 0x33;
+    LFSR = this->LFSR_Broadcast;
+    this->DecryptCRC(Data, Data, BENCHMARK_DATA_SIZE, &LFSR, &CRC);
+    Failed = (memcmp(Data, Out, BENCHMARK_DATA_SIZE) != 0) || (CRC != BenchmarkCRCBitwise(Out, BENCHMARK_DATA_SIZE, 0x33));
+    Serial.printf("Fused decrypt check: %s\n", Failed ? "FAILED" : "passed");
+
+    (void)Result;
+    free(Data);
+    free(Out);
+}
+
+void MeshNetworkInternal::BenchmarkLFSR()
+{
+    uint8_t *Data;
+    uint8_t *Out[2];
+    LFSRStruct Start;
+    LFSRStruct LFSR[2];
+    LFSRScheduleStruct *Schedule;
+    int Round;
+    int Failed;
+    int64_t Time;
+
+    Data = (uint8_t *)malloc(BENCHMARK_DATA_SIZE);
+    Out[0] = (uint8_t *)malloc(BENCHMARK_DATA_SIZE);
+    Out[1] = (uint8_t *)malloc(BENCHMARK_DATA_SIZE);
+    Schedule = (LFSRScheduleStruct *)malloc(sizeof(LFSRScheduleStruct));
+    if(!Data || !Out[0] || !Out[1] || !Schedule)
+    {
+        free(Data);
+        free(Out[0]);
+        free(Out[1]);
+        free(Schedule);
+        return;
+    }
+
+    BenchmarkFill(Data, BENCHMARK_DATA_SIZE);
+
+    //the jump tables must give the same ciphertext and final LFSR as stepping a bit at a time
+    //half of the masks are generated normally and half are random values a peer could send
+    Failed = 0;
+    for(Round = 0; Round < 64; Round++)
+    {
+        Start.LFSR = esp_random();
+        Start.LFSRRot = esp_random();
+        Start.LFSRMask = (Round & 1) ? esp_random() : this->CreateLFSRMask();
+        Start.LFSRRotMask = (Round & 1) ? esp_random() : this->CreateLFSRMask();
+        Schedule->Valid = 0;
+        this->BuildLFSRSchedule(Schedule, &Start);
+
+        LFSR[0] = Start;
+        LFSR[1] = Start;
+        this->Encrypt(Data, Out[0], 200, &LFSR[0]);
+        this->Encrypt(Data, Out[1], 200, &LFSR[1], Schedule);
+        if(memcmp(Out[0], Out[1], 200) || memcmp(&LFSR[0], &LFSR[1], sizeof(LFSRStruct)))
+            Failed++;
+
+        LFSR[0] = Start;
+        LFSR[1] = Start;
+        this->Decrypt(Out[0], Out[0], 200, &LFSR[0]);
+        this->Decrypt(Out[1], Out[1], 200, &LFSR[1], Schedule);
+        if(memcmp(Out[0], Data, 200) || memcmp(Out[1], Data, 200) || memcmp(&LFSR[0], &LFSR[1], sizeof(LFSRStruct)))
+            Failed++;
+    }
+    Serial.printf("LFSR schedule check: %s\n", Failed ? "FAILED" : "passed");
+
+    Start = this->LFSR_Broadcast;
+    LFSR[0] = Start;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 10); Round++)
+        this->Encrypt(Data, Out[0], BENCHMARK_DATA_SIZE, &LFSR[0]);
+    BenchmarkReport("Encrypt bit stepped", BENCHMARK_DATA_SIZE * (BENCHMARK_ROUNDS / 10), esp_timer_get_time() - Time);
+
+    LFSR[0] = Start;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        this->Encrypt(Data, Out[0], BENCHMARK_DATA_SIZE, &LFSR[0], &this->Schedule_Broadcast);
+    BenchmarkReport("Encrypt jump tables", BENCHMARK_DATA_SIZE * BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+
+    LFSR[0] = Start;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        this->Decrypt(Data, Out[0], BENCHMARK_DATA_SIZE, &LFSR[0], &this->Schedule_Broadcast);
+    BenchmarkReport("Decrypt jump tables", BENCHMARK_DATA_SIZE * BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+    {
+        Schedule->Valid = 0;
+        this->BuildLFSRSchedule(Schedule, &Start);
+    }
+    Serial.printf("%-32s %10lu us\n", "Schedule build", (unsigned long)((esp_timer_get_time() - Time) / BENCHMARK_ROUNDS));
+
+    free(Data);
+    free(Out[0]);
+    free(Out[1]);
+    free(Schedule);
+}
+
+void MeshNetworkInternal::BenchmarkBatch()
+{
+    uint8_t *Data;
+    uint8_t *Out[2];
+    LFSRStruct *Start;
+    LFSRStruct *LFSR[2];
+    LFSRScheduleStruct *Schedule;
+    LFSRBatchJobStruct Jobs[BENCHMARK_STREAMS];
+    unsigned int StreamLen;
+    const char *ModeName[] = {"scalar", "SSE2", "AVX2"};
+    char Name[48];
+    uint8_t BatchMode;
+    uint8_t Mode;
+    int Stream;
+    int Round;
+    int Failed;
+    int64_t Time;
+
+    //each stream gets it's own section of the buffers
+    StreamLen = BENCHMARK_DATA_SIZE / 4;
+    Data = (uint8_t *)malloc(StreamLen * BENCHMARK_STREAMS);
+    Out[0] = (uint8_t *)malloc(StreamLen * BENCHMARK_STREAMS);
+    Out[1] = (uint8_t *)malloc(StreamLen * BENCHMARK_STREAMS);
+    Start = (LFSRStruct *)malloc(sizeof(LFSRStruct) * BENCHMARK_STREAMS);
+    LFSR[0] = (LFSRStruct *)malloc(sizeof(LFSRStruct) * BENCHMARK_STREAMS);
+    LFSR[1] = (LFSRStruct *)malloc(sizeof(LFSRStruct) * BENCHMARK_STREAMS);
+    Schedule = (LFSRScheduleStruct *)malloc(sizeof(LFSRScheduleStruct) * BENCHMARK_STREAMS);
+    if(!Data || !Out[0] || !Out[1] || !Start || !LFSR[0] || !LFSR[1] || !Schedule)
+        goto BenchmarkBatchDone;
+
+    BenchmarkFill(Data, StreamLen * BENCHMARK_STREAMS);
+    for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+    {
+        Start[Stream].LFSR = esp_random();
+        Start[Stream].LFSRRot = esp_random();
+        Start[Stream].LFSRMask = (Stream & 1) ? esp_random() : this->CreateLFSRMask();
+        Start[Stream].LFSRRotMask = (Stream & 1) ? esp_random() : this->CreateLFSRMask();
+        Schedule[Stream].Valid = 0;
+        this->BuildLFSRSchedule(&Schedule[Stream], &Start[Stream]);
+    }
+
+    //random lengths and a few streams without a schedule, the batch must match the single stream
+    //version byte for byte including the final LFSR values. every lane mode the cpu has is checked
+    BatchMode = this->BatchMode;
+    for(Mode = LFSR_BATCH_SCALAR; Mode <= BatchMode; Mode++)
+    {
+        this->BatchMode = Mode;
+        Failed = 0;
+        for(Round = 0; Round < 16; Round++)
+        {
+            for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+            {
+                LFSR[0][Stream] = Start[Stream];
+                LFSR[1][Stream] = Start[Stream];
+                Jobs[Stream].InData = &Data[Stream * StreamLen];
+                Jobs[Stream].OutData = &Out[1][Stream * StreamLen];
+                Jobs[Stream].DataLen = esp_random() % (StreamLen + 1);
+                Jobs[Stream].LFSR = &LFSR[1][Stream];
+                Jobs[Stream].Schedule = ((Stream % 7) == Round % 7) ? 0 : &Schedule[Stream];
+                this->Encrypt(Jobs[Stream].InData, &Out[0][Stream * StreamLen], Jobs[Stream].DataLen, &LFSR[0][Stream]);
+            }
+            this->EncryptBatch(Jobs, BENCHMARK_STREAMS);
+            for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+            {
+                if(memcmp(&Out[0][Stream * StreamLen], &Out[1][Stream * StreamLen], Jobs[Stream].DataLen) ||
+                   memcmp(&LFSR[0][Stream], &LFSR[1][Stream], sizeof(LFSRStruct)))
+                    Failed++;
+
+                //decrypt in place
+                LFSR[1][Stream] = Start[Stream];
+                Jobs[Stream].InData = Jobs[Stream].OutData;
+            }
+            this->DecryptBatch(Jobs, BENCHMARK_STREAMS);
+            for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+            {
+                if(memcmp(&Data[Stream * StreamLen], &Out[1][Stream * StreamLen], Jobs[Stream].DataLen) ||
+                   memcmp(&LFSR[0][Stream], &LFSR[1][Stream], sizeof(LFSRStruct)))
+                    Failed++;
+            }
+        }
+        Serial.printf("LFSR batch %s check: %s\n", ModeName[Mode], Failed ? "FAILED" : "passed");
+    }
+
+    for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+    {
+        LFSR[0][Stream] = Start[Stream];
+        Jobs[Stream].InData = &Data[Stream * StreamLen];
+        Jobs[Stream].OutData = &Out[0][Stream * StreamLen];
+        Jobs[Stream].DataLen = StreamLen;
+        Jobs[Stream].LFSR = &LFSR[0][Stream];
+        Jobs[Stream].Schedule = &Schedule[Stream];
+    }
+
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 4); Round++)
+    {
+        for(Stream = 0; Stream < BENCHMARK_STREAMS; Stream++)
+            this->Encrypt(Jobs[Stream].InData, Jobs[Stream].OutData, StreamLen, Jobs[Stream].LFSR, Jobs[Stream].Schedule);
+    }
+    BenchmarkReport("Encrypt streams one at a time", StreamLen * BENCHMARK_STREAMS * (BENCHMARK_ROUNDS / 4), esp_timer_get_time() - Time);
+
+    for(Mode = LFSR_BATCH_SCALAR; Mode <= BatchMode; Mode++)
+    {
+        this->BatchMode = Mode;
+        snprintf(Name, sizeof(Name), "Encrypt streams batched %s", ModeName[Mode]);
+        Time = esp_timer_get_time();
+        for(Round = 0; Round < (BENCHMARK_ROUNDS / 4); Round++)
+            this->EncryptBatch(Jobs, BENCHMARK_STREAMS);
+        BenchmarkReport(Name, StreamLen * BENCHMARK_STREAMS * (BENCHMARK_ROUNDS / 4), esp_timer_get_time() - Time);
+    }
+    this->BatchMode = BatchMode;
+
+BenchmarkBatchDone:
+    free(Data);
+    free(Out[0]);
+    free(Out[1]);
+    free(Start);
+    free(LFSR[0]);
+    free(LFSR[1]);
+    free(Schedule);
+}
+
+void MeshNetworkInternal::BenchmarkBroadcast()
+{
+    uint8_t Data[32];
+    TXFrameStruct *Frame;
+    uint8_t *Decrypted;
+    unsigned short PacketLen;
+    unsigned short DecryptedLen;
+    UnknownDeviceStruct Device;
+    LFSRStruct LFSR;
+    CipherStateStruct State;
+    unsigned int ID;
+    int Round;
+    int Failed;
+    int64_t Time;
+    volatile unsigned int Result;
+
+    //the cached derivation must match the original chain of crcs for any sender and ID
+    Failed = 0;
+    for(Round = 0; Round < 256; Round++)
+    {
+        BenchmarkFill(Device.MAC, MAC_SIZE);
+        ID = esp_random();
+        this->PermuteBroadcastLFSR(this->CalculateBroadcastMACCRC(Device.MAC), ID, &LFSR);
+        if((LFSR.LFSR != this->LFSR_Broadcast.LFSR) ||
+           (LFSR.LFSRRot != BenchmarkPermuteReference(Device.MAC, ID, this->LFSR_Broadcast.LFSR, this->LFSR_Broadcast.LFSRRot)))
+            Failed++;
+    }
+    Serial.printf("Broadcast key check: %s\n", Failed ? "FAILED" : "passed");
+
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS * 10; Round++)
+        Result = BenchmarkPermuteReference(Device.MAC, Round, this->LFSR_Broadcast.LFSR, this->LFSR_Broadcast.LFSRRot);
+    BenchmarkReportEach("Broadcast key original", BENCHMARK_ROUNDS * 10, esp_timer_get_time() - Time);
+
+    Device.MACCRC = this->CalculateBroadcastMACCRC(Device.MAC);
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS * 10; Round++)
+    {
+        this->PermuteBroadcastLFSR(Device.MACCRC, Round, &LFSR);
+        Result = LFSR.LFSRRot;
+    }
+    BenchmarkReportEach("Broadcast key cached", BENCHMARK_ROUNDS * 10, esp_timer_get_time() - Time);
+
+    //decode cost of a small broadcast frame from a known sender
+    Frame = this->GetTXFrame();
+    if(!Frame)
+        return;
+
+    BenchmarkFill(Data, sizeof(Data));
+    ID = 1000;
+    this->PermuteBroadcastLFSR(Device.MACCRC, ID, &LFSR);
+    this->InitCipherState(&State, &LFSR, &this->Schedule_Broadcast, this->Key_Broadcast);
+    memcpy(&State.Nonce[1], Device.MAC, MAC_SIZE);
+    memcpy(Frame->Header.MAC_Sender, Device.MAC, MAC_SIZE);
+    PacketLen = this->EncryptPacketCommon(ID, this->CipherSuiteBroadcast, &State, Data, sizeof(Data), Frame, PACKET_VERSION);
+
+    Failed = 0;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS * 10; Round++)
+    {
+        Decrypted = this->DecryptBroadcastPacket(&Device, &Frame->Header, Frame->Payload, PacketLen, &DecryptedLen);
+        if(!Decrypted || (DecryptedLen != sizeof(Data)) || memcmp(Decrypted, Data, sizeof(Data)))
+            Failed++;
+        free(Decrypted);
+    }
+    BenchmarkReportEach("Broadcast RX decode, 32 bytes", BENCHMARK_ROUNDS * 10, esp_timer_get_time() - Time);
+
+    //a full size frame that isn't ours, with a tag it is dropped before decrypting
+    PacketLen = BENCHMARK_DATA_SIZE;
+    BenchmarkFill(Frame->Payload, PacketLen);
+    ((PacketHeaderStruct *)Frame->Payload)->SequenceID = ID;
+    Frame->Header.PacketVersion = 2;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS * 10; Round++)
+    {
+        Decrypted = this->DecryptBroadcastPacket(&Device, &Frame->Header, Frame->Payload, PacketLen, &DecryptedLen);
+        if(Decrypted)
+        {
+            Failed++;
+            free(Decrypted);
+        }
+    }
+    BenchmarkReportEach("Reject bad tag, 960 bytes", BENCHMARK_ROUNDS * 10, esp_timer_get_time() - Time);
+
+    Frame->Header.PacketVersion = 0;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+    {
+        Decrypted = this->DecryptBroadcastPacket(&Device, &Frame->Header, Frame->Payload, PacketLen, &DecryptedLen);
+        if(Decrypted)
+        {
+            Failed++;
+            free(Decrypted);
+        }
+    }
+    BenchmarkReportEach("Reject untagged, 960 bytes", BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+    Serial.printf("Broadcast decode check: %s\n", Failed ? "FAILED" : "passed");
+
+    this->ReleaseTXFrame(Frame);
+    (void)Result;
+}
+
+void MeshNetworkInternal::BenchmarkDH()
+{
+    unsigned long long P;
+    unsigned long long G;
+    unsigned long long Base;
+    unsigned long long Exp;
+    unsigned long long Chal;
+    int Round;
+    int Failed;
+    int64_t Time;
+    volatile unsigned long long Result;
+
+    //known answers against the long division version, the configured prime and random odd moduli
+    //of all sizes along with edge case bases and exponents. the pool thread reads the DH values
+    //without a lock so it is held off until they are put back
+    this->DHPoolPause(1);
+    P = this->DH_P;
+    G = this->DH_G;
+    Failed = 0;
+    for(Round = 0; Round < 256; Round++)
+    {
+        if(Round)
+        {
+            //never hand DHInit a modulus below 3
+            Base = (((unsigned long long)esp_random() << 32) | esp_random() | 1) >> (Round % 63);
+            this->DHInit((Base < 3) ? 3 : Base, 0);
+        }
+
+        Base = ((unsigned long long)esp_random() << 32) | esp_random();
+        Exp = ((unsigned long long)esp_random() << 32) | esp_random();
+        switch(Round & 7)
+        {
+            case 1: Base = 0; break;
+            case 2: Base = 1; break;
+            case 3: Base = this->DH_P - 1; break;
+            case 4: Exp = 0; break;
+            case 5: Exp = 1; break;
+            case 6: Exp = 0xffffffffffffffffULL; break;
+        }
+
+        if(this->DHPowMod(Base, Exp) != this->DHPowModLegacy(Base, Exp))
+            Failed++;
+    }
+    this->DHInit(P, G);
+    this->DHPoolPause(0);
+    Serial.printf("DH montgomery check: %s\n", Failed ? "FAILED" : "passed");
+
+    //cost of one side of a handshake, creating a challenge and finishing the other side's
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 10); Round++)
+    {
+        Exp = ((unsigned long long)esp_random() << 32) | esp_random();
+        Chal = this->DHPowModLegacy(this->DH_G, Exp);
+        Result = this->DHPowModLegacy(Chal, Exp);
+    }
+    BenchmarkReportEach("DH handshake long division", BENCHMARK_ROUNDS / 10, esp_timer_get_time() - Time);
+
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < (BENCHMARK_ROUNDS / 10); Round++)
+    {
+        Exp = this->DHCreatePriv(&Chal);
+        Result = this->DHFinishChallenge(Exp, Chal);
+    }
+    BenchmarkReportEach("DH handshake montgomery", BENCHMARK_ROUNDS / 10, esp_timer_get_time() - Time);
+
+    //fixed base tables for G at each window size, memory used against the cost of building and using them
+    for(Round = 1; Round <= 8; Round++)
+    {
+        unsigned long long *Table;
+        unsigned int TableSize;
+        int64_t BuildTime;
+        int Count;
+
+        TableSize = DH_FIXED_BASE_WINDOWS(Round) * DH_FIXED_BASE_DIGITS(Round) * sizeof(unsigned long long);
+        Table = (unsigned long long *)malloc(TableSize);
+        if(!Table)
+            break;
+
+        Time = esp_timer_get_time();
+        this->DHBuildFixedBase(Table, Round);
+        BuildTime = esp_timer_get_time() - Time;
+
+        Failed = 0;
+        for(Count = 0; Count < 64; Count++)
+        {
+            Exp = ((unsigned long long)esp_random() << 32) | esp_random();
+            if(Count < 2)
+                Exp = Count ? 0xffffffffffffffffULL : 0;
+            if(this->DHPowFixedBase(Table, Round, Exp) != this->DHPowMod(this->DH_G, Exp))
+                Failed++;
+        }
+
+        Time = esp_timer_get_time();
+        for(Count = 0; Count < BENCHMARK_ROUNDS; Count++)
+            Result = this->DHPowFixedBase(Table, Round, ((unsigned long long)esp_random() << 32) | esp_random());
+        Time = esp_timer_get_time() - Time;
+
+        Serial.printf("DH fixed base %d bits %6u bytes %10lu ns, build %lu us%s\n", Round, TableSize,
+                      (unsigned long)(((unsigned long long)Time * 1000ULL) / BENCHMARK_ROUNDS), (unsigned long)BuildTime,
+                      Failed ? ", FAILED" : "");
+        free(Table);
+    }
+
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        Result = this->DHPowMod(this->DH_G, ((unsigned long long)esp_random() << 32) | esp_random());
+    BenchmarkReportEach("DH challenge square and multiply", BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+
+    //give the pool thread time to refill after the DHInit calls above then use the pooled challenges
+    for(Round = 0; Round < 100; Round++)
+    {
+        pthread_mutex_lock(&this->DHPoolLock);
+        Failed = (this->DHPoolCount < this->DHPoolDepth);
+        pthread_mutex_unlock(&this->DHPoolLock);
+        if(!Failed)
+            break;
+        delay(10);
+    }
+
+    Failed = 0;
+    Time = esp_timer_get_time();
+    for(Round = 0; Round < (int)this->DHPoolDepth; Round++)
+    {
+        Exp = this->DHCreateChallenge(&Chal);
+        Result = this->DHFinishChallenge(Exp, Chal);
+    }
+    BenchmarkReportEach("DH handshake from pool", this->DHPoolDepth, esp_timer_get_time() - Time);
+
+    //pooled entries must belong to the current P and G
+    Exp = this->DHCreateChallenge(&Chal);
+    Failed = (this->DHPowMod(this->DH_G, Exp) != Chal);
+    Serial.printf("DH pool check: %s, hits %u misses %u\n", Failed ? "FAILED" : "passed", this->Stats.DHPoolHits, this->Stats.DHPoolMisses);
+
+    (void)Result;
+}
+
+void MeshNetworkInternal::BenchmarkCipherSuites()
+{
+    //RFC 7539 section 2.3.2 block function test vector
+    const unsigned int ChaChaKey[8] = {0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c, 0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c};
+    const unsigned int ChaChaNonce[3] = {0x09000000, 0x4a000000, 0x00000000};
+    const unsigned int ChaChaResult[16] = {0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3, 0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+                                           0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9, 0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2};
+    unsigned int Block[16];
+    uint8_t *Data;
+    uint8_t *Decrypted;
+    TXFrameStruct *Frame;
+    CipherStateStruct State;
+    LFSRStruct LFSR;
+    unsigned short DataLen;
+    unsigned short PacketLen;
+    unsigned short DecryptedLen;
+    uint8_t Suite;
+    int Round;
+    int Failed;
+    int64_t Time;
+    char Name[48];
+
+    ChaCha20CipherSuite::Block(ChaChaKey, 1, ChaChaNonce, Block);
+    Serial.printf("ChaCha20 known answer: %s\n", memcmp(Block, ChaChaResult, sizeof(Block)) ? "FAILED" : "passed");
+
+    //full size packets through each suite the same way EncryptPacket/DecryptPacket use them
+    DataLen = BENCHMARK_DATA_SIZE - sizeof(PacketHeaderStruct) - sizeof(unsigned int);
+    Data = (uint8_t *)malloc(DataLen);
+    Frame = this->GetTXFrame();
+    if(!Data || !Frame)
+    {
+        free(Data);
+        if(Frame)
+            this->ReleaseTXFrame(Frame);
+        return;
+    }
+
+    BenchmarkFill(Data, DataLen);
+    for(Suite = 0; Suite < CipherSuiteCount; Suite++)
+    {
+        Failed = 0;
+        PacketLen = 0;
+        Time = esp_timer_get_time();
+        for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        {
+            LFSR = this->LFSR_Broadcast;
+            this->InitCipherState(&State, &LFSR, &this->Schedule_Broadcast, this->Key_Broadcast);
+            PacketLen = this->EncryptPacketCommon(Round, Suite, &State, Data, DataLen, Frame, PACKET_VERSION);
+        }
+        snprintf(Name, sizeof(Name), "%s encrypt packet", this->CipherSuites[Suite]->Name());
+        BenchmarkReport(Name, (unsigned long long)DataLen * BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+
+        Time = esp_timer_get_time();
+        for(Round = 0; Round < BENCHMARK_ROUNDS; Round++)
+        {
+            LFSR = this->LFSR_Broadcast;
+            this->InitCipherState(&State, &LFSR, &this->Schedule_Broadcast, this->Key_Broadcast);
+            Decrypted = this->DecryptPacketCommon(BENCHMARK_ROUNDS - 1, Suite, &State, &Frame->Header, PACKET_VERSION, Frame->Payload, PacketLen, &DecryptedLen);
+            if(!Decrypted || (DecryptedLen != DataLen) || memcmp(Decrypted, Data, DataLen))
+                Failed++;
+            free(Decrypted);
+        }
+        snprintf(Name, sizeof(Name), "%s decrypt packet", this->CipherSuites[Suite]->Name());
+        BenchmarkReport(Name, (unsigned long long)DataLen * BENCHMARK_ROUNDS, esp_timer_get_time() - Time);
+        Serial.printf("%s round trip: %s\n", this->CipherSuites[Suite]->Name(), Failed ? "FAILED" : "passed");
+    }
+
+    this->ReleaseTXFrame(Frame);
+    free(Data);
+}
+
+void MeshNetworkInternal::BenchmarkWindowReset()
+{
+    KnownDeviceStruct *Device;
+    unsigned int ID;
+    unsigned int i;
+    int Failed;
+
+    //a device reconnecting well into a session with messages still waiting on an ack, they have to
+    //come back numbered from 0 in the order they were written
+    Device = (KnownDeviceStruct *)calloc(1, sizeof(KnownDeviceStruct));
+    if(!Device)
+        return;
+
+    Failed = 0;
+    this->SetWindow(Device, 8);
+    if(!Device->WindowOut)
+    {
+        free(Device);
+        return;
+    }
+
+    Device->WindowBase = 0x7ffffffe;
+    Device->ID_Out = Device->WindowBase;
+    for(i = 0; i < 4; i++)
+    {
+        ID = Device->ID_Out++;
+        Device->WindowOut[ID % Device->Window].Data = (uint8_t *)malloc(1);
+        if(!Device->WindowOut[ID % Device->Window].Data)
+            Failed++;
+        else
+            Device->WindowOut[ID % Device->Window].Data[0] = i;
+        Device->WindowOut[ID % Device->Window].Len = 1;
+        Device->WindowOut[ID % Device->Window].Type = MSG_Message;
+        Device->WindowOut[ID % Device->Window].Handle = 0;
+    }
+
+    //the second one was acked
+    ID = Device->WindowBase + 1;
+    free(Device->WindowOut[ID % Device->Window].Data);
+    Device->WindowOut[ID % Device->Window].Data = 0;
+
+    //same order as a handshake, the IDs go back to 0 and then the new window is picked
+    this->WindowResetIDs(Device);
+    this->SetWindow(Device, 4);
+    this->TimerCancel(Device);
+    if(!Device->WindowOut || (Device->WindowBase != 0) || (Device->ID_Out != 3) || (Device->ID_In != 0))
+        Failed++;
+    else
+    {
+        for(i = 0; i < 3; i++)
+        {
+            if(!Device->WindowOut[i].Data || (Device->WindowOut[i].Data[0] != ((i == 0) ? 0 : i + 1)))
+                Failed++;
+        }
+    }
+    Serial.printf("Window reset check: %s\n", Failed ? "FAILED" : "passed");
+
+    //free it without reporting anything to the app
+    for(i = 0; i < Device->Window; i++)
+    {
+        free(Device->WindowOut[i].Data);
+        Device->WindowOut[i].Data = 0;
+    }
+    free(Device->WindowOut);
+    free(Device->WindowIn);
+    free(Device);
+}
+
+#endif
@@ -0,0 +1,311 @@
+#include <stddef.h>
+#include <string.h>
+#include "mesh_internal.h"
+#include "debug.h"
+
+//original LFSR stream, the state is carried from packet to packet so there is nothing to start
+const char *MeshNetworkInternal::LFSRCipherSuite::Name()
+{
+    return "LFSR";
+}
+
+void MeshNetworkInternal::LFSRCipherSuite::Start(CipherStateStruct *State, unsigned int SequenceID)
+{
+}
+
+unsigned int MeshNetworkInternal::LFSRCipherSuite::Tag(CipherStateStruct *State, unsigned int SequenceID, unsigned short PacketLen)
+{
+    return this->Mesh->CalculatePacketTag(State->LFSR, State->Schedule, SequenceID, PacketLen);
+}
+
+void MeshNetworkInternal::LFSRCipherSuite::Encrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen)
+{
+    this->Mesh->Encrypt(InData, OutData, DataLen, State->LFSR, State->Schedule);
+}
+
+void MeshNetworkInternal::LFSRCipherSuite::Decrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen, uint8_t *CRC)
+{
+    if(CRC)
+        this->Mesh->DecryptCRC(InData, OutData, DataLen, State->LFSR, CRC, State->Schedule);
+    else
+        this->Mesh->Decrypt(InData, OutData, DataLen, State->LFSR, State->Schedule);
+}
+
+//chacha20, everything is done on 32 bit words. the byte order of a block matches RFC 7539 on
+//little endian cpus which the ESP32 is
+#define CHACHA_ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA_ROTATE(d, 16); \
+    c += d; b ^= c; b = CHACHA_ROTATE(b, 12); \
+    a += b; d ^= a; d = CHACHA_ROTATE(d, 8); \
+    c += d; b ^= c; b = CHACHA_ROTATE(b, 7);
+
+const char *MeshNetworkInternal::ChaCha20CipherSuite::Name()
+{
+    return "ChaCha20";
+}
+
+void MeshNetworkInternal::ChaCha20CipherSuite::Block(const unsigned int Key[8], unsigned int Counter, const unsigned int Nonce[3], unsigned int Out[16])
+{
+    unsigned int x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+    int Round;
+
+    //"expand 32-byte k"
+    Out[0] = x0 = 0x61707865;
+    Out[1] = x1 = 0x3320646e;
+    Out[2] = x2 = 0x79622d32;
+    Out[3] = x3 = 0x6b206574;
+    Out[4] = x4 = Key[0];
+    Out[5] = x5 = Key[1];
+    Out[6] = x6 = Key[2];
+    Out[7] = x7 = Key[3];
+    Out[8] = x8 = Key[4];
+    Out[9] = x9 = Key[5];
+    Out[10] = x10 = Key[6];
+    Out[11] = x11 = Key[7];
+    Out[12] = x12 = Counter;
+    Out[13] = x13 = Nonce[0];
+    Out[14] = x14 = Nonce[1];
+    Out[15] = x15 = Nonce[2];
+
+    //10 column and diagonal double rounds
+    for(Round = 0; Round < 10; Round++)
+    {
+        CHACHA_QUARTER(x0, x4, x8, x12);
+        CHACHA_QUARTER(x1, x5, x9, x13);
+        CHACHA_QUARTER(x2, x6, x10, x14);
+        CHACHA_QUARTER(x3, x7, x11, x15);
+        CHACHA_QUARTER(x0, x5, x10, x15);
+        CHACHA_QUARTER(x1, x6, x11, x12);
+        CHACHA_QUARTER(x2, x7, x8, x13);
+        CHACHA_QUARTER(x3, x4, x9, x14);
+    }
+
+    Out[0] += x0;
+    Out[1] += x1;
+    Out[2] += x2;
+    Out[3] += x3;
+    Out[4] += x4;
+    Out[5] += x5;
+    Out[6] += x6;
+    Out[7] += x7;
+    Out[8] += x8;
+    Out[9] += x9;
+    Out[10] += x10;
+    Out[11] += x11;
+    Out[12] += x12;
+    Out[13] += x13;
+    Out[14] += x14;
+    Out[15] += x15;
+}
+
+void MeshNetworkInternal::ChaCha20CipherSuite::Start(CipherStateStruct *State, unsigned int SequenceID)
+{
+    //the sequence ID never repeats for a key, block 0 is kept for the tag
+    State->Nonce[0] = SequenceID;
+    State->Counter = 1;
+    State->BlockUsed = sizeof(State->Block);
+}
+
+unsigned int MeshNetworkInternal::ChaCha20CipherSuite::Tag(CipherStateStruct *State, unsigned int SequenceID, unsigned short PacketLen)
+{
+    unsigned int TagBlock[16];
+
+    Block(State->Key, 0, State->Nonce, TagBlock);
+    return TagBlock[0] ^ (((unsigned int)PacketLen << 16) | PacketLen);
+}
+
+void MeshNetworkInternal::ChaCha20CipherSuite::Encrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen)
+{
+    const uint8_t *In = (const uint8_t *)InData;
+    uint8_t *Out = (uint8_t *)OutData;
+    const uint8_t *Stream = (const uint8_t *)State->Block;
+    unsigned int Word;
+    int i;
+
+    //use up what is left of the current block
+    while(DataLen && (State->BlockUsed < sizeof(State->Block)))
+    {
+        *Out = *In ^ Stream[State->BlockUsed];
+        State->BlockUsed++;
+        In++;
+        Out++;
+        DataLen--;
+    }
+
+    //whole blocks a word at a time, the packet buffers are not aligned
+    while(DataLen >= sizeof(State->Block))
+    {
+        Block(State->Key, State->Counter, State->Nonce, State->Block);
+        State->Counter++;
+        for(i = 0; i < 16; i++)
+        {
+            memcpy(&Word, &In[i * 4], 4);
+            Word ^= State->Block[i];
+            memcpy(&Out[i * 4], &Word, 4);
+        }
+
+        In += sizeof(State->Block);
+        Out += sizeof(State->Block);
+        DataLen -= sizeof(State->Block);
+    }
+
+    //start a block for the remainder
+    if(DataLen)
+    {
+        Block(State->Key, State->Counter, State->Nonce, State->Block);
+        State->Counter++;
+        State->BlockUsed = 0;
+        while(DataLen)
+        {
+            *Out = *In ^ Stream[State->BlockUsed];
+            State->BlockUsed++;
+            In++;
+            Out++;
+            DataLen--;
+        }
+    }
+}
+
+void MeshNetworkInternal::ChaCha20CipherSuite::Decrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen, uint8_t *CRC)
+{
+    //stream cipher so decrypting is the same as encrypting
+    this->Encrypt(State, InData, OutData, DataLen);
+    if(CRC)
+        *CRC = this->Mesh->CalculateCRC(OutData, DataLen, *CRC);
+}
+
+//suites other than the LFSR are keyed from the starting LFSR values of the direction and the reset
+//values, all of which were sent encrypted during the handshake
+void MeshNetworkInternal::SetSessionKeys(KnownDeviceStruct *Device)
+{
+    memcpy(&Device->Key_In[0], &Device->LFSR_In, sizeof(LFSRStruct));
+    memcpy(&Device->Key_In[4], &Device->LFSR_Reset, sizeof(LFSRStruct));
+    memcpy(&Device->Key_Out[0], &Device->LFSR_Out, sizeof(LFSRStruct));
+    memcpy(&Device->Key_Out[4], &Device->LFSR_Reset, sizeof(LFSRStruct));
+}
+
+//fill in the version and cipher suite from the capabilities the other side appended, DataLen is
+//how much of the payload is left. Reply is set if this is the answer to capabilities we sent
+void MeshNetworkInternal::ReadCapabilities(KnownDeviceStruct *Device, const uint8_t *Data, int DataLen, int Reply)
+{
+    const CapabilityStruct *Caps = (const CapabilityStruct *)Data;
+    uint8_t Suite;
+    uint8_t Window;
+
+    //stay on version 1 packets, the LFSR and one message at a time until the other side says it supports more
+    Device->Version = 0;
+    Device->CipherSuite = CipherLFSR;
+    Device->MaxMessage = 0;
+    Device->Features = 0;
+    Device->CipherSuites = 0;
+    Window = 0;
+    if((DataLen < (int)offsetof(CapabilityStruct, CipherSuites)) || (Caps->ID != CAPABILITY_CMD))
+    {
+        this->SetWindow(Device, Window);
+        return;
+    }
+
+    Device->Version = (Caps->Version < PACKET_VERSION) ? Caps->Version : PACKET_VERSION;
+
+    //version 2 peers before cipher suites stop at the version, peers before send windows stop at the suites
+    if(DataLen < (int)offsetof(CapabilityStruct, Window))
+    {
+        this->SetWindow(Device, Window);
+        return;
+    }
+
+    //the side picking takes the smaller window, the reply has the one picked
+    if(DataLen >= (int)offsetof(CapabilityStruct, MaxMessage))
+    {
+        if(Reply && (Caps->Window <= this->SendWindow))
+            Window = Caps->Window;
+        else if(!Reply)
+            Window = (Caps->Window < this->SendWindow) ? Caps->Window : this->SendWindow;
+
+        if(Window < 2)
+            Window = 0;
+    }
+
+    //each side says how large a fragmented message it will put back together and what else it can handle
+    if(DataLen >= (int)offsetof(CapabilityStruct, Features))
+        Device->MaxMessage = Caps->MaxMessage;
+    if(DataLen >= (int)sizeof(CapabilityStruct))
+        Device->Features = Caps->Features;
+
+    //the side that started the connection picks, the reply has only the suite picked
+    if(Reply)
+    {
+        for(Suite = 0; Suite < CipherSuiteCount; Suite++)
+        {
+            if(Caps->CipherSuites == (1 << Suite))
+                Device->CipherSuite = Suite;
+        }
+    }
+    else
+    {
+        Device->CipherSuites = Caps->CipherSuites;
+        if(Caps->CipherSuites & (1 << this->CipherSuitePreferred))
+            Device->CipherSuite = this->CipherSuitePreferred;
+
+        //strict mode never settles on the LFSR if both sides have ChaCha20
+        if(this->CipherSuiteStrict && (Caps->CipherSuites & (1 << CipherChaCha20)))
+            Device->CipherSuite = CipherChaCha20;
+    }
+
+    this->SetWindow(Device, Window);
+}
+
+void MeshNetworkInternal::WriteCapabilities(KnownDeviceStruct *Device, uint8_t *Data, int Reply)
+{
+    CapabilityStruct *Caps = (CapabilityStruct *)Data;
+
+    Caps->ID = CAPABILITY_CMD;
+    Caps->Version = PACKET_VERSION;
+    Caps->MaxMessage = this->MaxMessageSize;
+    Caps->Features = FEATURE_COALESCE;
+    if(Reply)
+    {
+        Caps->CipherSuites = 1 << Device->CipherSuite;
+        Caps->Window = Device->Window;
+    }
+    else
+    {
+        Caps->CipherSuites = (1 << CipherSuiteCount) - 1;
+        Caps->Window = this->SendWindow;
+    }
+}
+
+//the connected reply echoes the capabilities we put in the handshake unencrypted, returns 1 if the echo
+//came back and matches what we sent. DataLen is how much of the payload is left after ConnectedStruct
+int MeshNetworkInternal::CheckCapabilities(KnownDeviceStruct *Device, const uint8_t *Data, int DataLen)
+{
+    const CapabilityCheckStruct *Check = (const CapabilityCheckStruct *)&Data[sizeof(CapabilityStruct)];
+    CapabilityStruct Sent;
+
+    if(DataLen < (int)(sizeof(CapabilityStruct) + sizeof(CapabilityCheckStruct)))
+        return 0;
+
+    if(Check->ID != CAPABILITY_CHECK_CMD)
+        return 0;
+
+    this->WriteCapabilities(Device, (uint8_t *)&Sent, 0);
+    if(memcmp(&Check->Peer, &Sent, sizeof(Sent)))
+        return 0;
+
+    Device->CipherSuites = Check->CipherSuites;
+    return 1;
+}
+
+//returns 0 if strict mode refuses the suite negotiated with a device. both sides offer every suite
+//so it comes down to what the other side supports, version 1 devices never say
+int MeshNetworkInternal::CipherSuiteAllowed(KnownDeviceStruct *Device)
+{
+    if(!this->CipherSuiteStrict)
+        return 1;
+
+    if(!Device->Version)
+        return 0;
+
+    return (Device->CipherSuite != CipherLFSR) || !(Device->CipherSuites & (1 << CipherChaCha20));
+}
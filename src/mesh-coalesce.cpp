@@ -0,0 +1,187 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+#include "mesh.h"
+#include "debug.h"
+#include <pthread.h>
+#include <string.h>
+
+//small unicast messages can be held for up to CoalesceDelay ms and sent together as one MSG_Coalesced
+//message in the send window, each one starts with a CoalesceHeaderStruct. like nagle a message goes
+//straight out if nothing is waiting on an ack, otherwise it is held until the frame is full, the deadline
+//passes or everything sent was acked. the receiver splits them back up and the sender reports an ack or
+//failure for each message held, the WriteAsync handle of each is kept after the frame data
+
+int MeshNetworkInternal::CoalesceWrite(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle)
+{
+    CoalesceHeaderStruct Header;
+    int NewDeadline;
+    int Ret;
+
+    //returns 1 if the message was held, 0 if it should be sent on it's own or a MeshWriteErrors value
+
+    //nothing waiting on an ack so there is no reason to wait
+    this->WindowAdvanceBase(Device);
+    if(!Device->CoalesceData && (Device->ID_Out == Device->WindowBase))
+        return 0;
+
+    //if it doesn't fit with what is held then send that first, if the window is full it has to wait
+    if(Device->CoalesceData && (((Device->CoalesceLen + sizeof(CoalesceHeaderStruct) + DataLen) > FRAME_DATA_SIZE) ||
+       (Device->CoalesceCount >= COALESCE_MAX_MESSAGES)))
+    {
+        Ret = this->CoalesceFlush(Device);
+        if(Ret)
+            return Ret;
+    }
+
+    NewDeadline = 0;
+    if(!Device->CoalesceData)
+    {
+        Device->CoalesceData = (uint8_t *)malloc(FRAME_DATA_SIZE + (COALESCE_MAX_MESSAGES * sizeof(unsigned int)));
+        if(!Device->CoalesceData)
+            return MeshWriteErrors::OutOfMemory;
+
+        Device->CoalesceLen = 0;
+        Device->CoalesceCount = 0;
+        Device->CoalesceFlush = esp_timer_get_time() + (this->CoalesceDelay * 1000LL);
+        NewDeadline = 1;
+    }
+
+    Header.Len = DataLen;
+    memcpy(&Device->CoalesceData[Device->CoalesceLen], &Header, sizeof(Header));
+    memcpy(&Device->CoalesceData[Device->CoalesceLen + sizeof(Header)], Data, DataLen);
+    memcpy(&Device->CoalesceData[FRAME_DATA_SIZE + (Device->CoalesceCount * sizeof(unsigned int))], &Handle, sizeof(Handle));
+    Device->CoalesceLen += sizeof(Header) + DataLen;
+    Device->CoalesceCount++;
+
+    DEBUG_WRITE("Holding message for ");
+    DEBUG_WRITEMAC(Device->MAC);
+    DEBUG_WRITE(", ");
+    DEBUG_WRITE(Device->CoalesceCount);
+    DEBUG_WRITE(" held\n");
+
+    //nothing else will fit so don't wait on the deadline
+    if(((Device->CoalesceLen + sizeof(CoalesceHeaderStruct)) >= FRAME_DATA_SIZE) || (Device->CoalesceCount >= COALESCE_MAX_MESSAGES))
+        this->CoalesceFlush(Device);
+
+    //have the resend thread send it by the deadline
+    else if(NewDeadline)
+        this->TimerSchedule(Device, Device->CoalesceFlush);
+
+    return 1;
+}
+
+int MeshNetworkInternal::CoalesceFlush(KnownDeviceStruct *Device)
+{
+    uint8_t *Buffer;
+    unsigned int Handles[COALESCE_MAX_MESSAGES];
+    unsigned int Handle;
+    unsigned short Len;
+    unsigned short Count;
+    unsigned short i;
+    uint8_t Type;
+    int Ret;
+
+    //put the held messages in the window
+    if(!Device->CoalesceData)
+        return 0;
+
+    this->WindowAdvanceBase(Device);
+    if((Device->ID_Out - Device->WindowBase) >= Device->Window)
+        return MeshWriteErrors::PreviousWriteNotComplete;
+
+    Buffer = Device->CoalesceData;
+    Len = Device->CoalesceLen;
+    Count = Device->CoalesceCount;
+    Device->CoalesceData = 0;
+    memcpy(Handles, &Buffer[FRAME_DATA_SIZE], Count * sizeof(unsigned int));
+
+    //a single message goes as it is
+    Handle = 0;
+    if(Count == 1)
+    {
+        Len -= sizeof(CoalesceHeaderStruct);
+        memmove(Buffer, &Buffer[sizeof(CoalesceHeaderStruct)], Len);
+        Type = MSG_Message;
+        Handle = Handles[0];
+    }
+    else
+    {
+        Type = MSG_Coalesced;
+        this->Stats.CoalescedFrames++;
+        this->Stats.CoalescedMessages += Count;
+    }
+
+    //the messages were already accepted by Write so a failure here is reported for each one
+    Ret = this->WindowAdd(Device, Type, Buffer, Len, Handle);
+    if((Ret == MeshWriteErrors::OutOfMemory) || (Ret == MeshWriteErrors::DataTooLarge))
+    {
+        for(i = 0; i < Count; i++)
+            this->SendDone(Device, Handles[i], 0);
+    }
+
+    return 0;
+}
+
+unsigned int MeshNetworkInternal::CoalescedCount(const uint8_t *Data, unsigned short DataLen)
+{
+    CoalesceHeaderStruct Header;
+    unsigned int Offset;
+    unsigned int Count;
+
+    Count = 0;
+    for(Offset = 0; (Offset + sizeof(Header)) <= DataLen; Offset += sizeof(Header) + Header.Len)
+    {
+        memcpy(&Header, &Data[Offset], sizeof(Header));
+        Count++;
+    }
+
+    return Count;
+}
+
+void MeshNetworkInternal::CoalesceDeliver(const uint8_t *MAC, const uint8_t *Data, unsigned short DataLen)
+{
+    CoalesceHeaderStruct Header;
+    unsigned int Offset;
+
+    //hand each message to the app, stop at anything that runs past the end
+    Offset = 0;
+    while((Offset + sizeof(Header)) <= DataLen)
+    {
+        memcpy(&Header, &Data[Offset], sizeof(Header));
+        Offset += sizeof(Header);
+        if(Header.Len > (DataLen - Offset))
+            break;
+
+        if(this->ReceiveMessageCallback)
+            this->ReceiveMessageCallback(MAC, &Data[Offset], Header.Len);
+        Offset += Header.Len;
+    }
+}
+
+unsigned int MeshNetworkInternal::CoalesceHandle(const uint8_t *Data, unsigned int Index)
+{
+    unsigned int Handle;
+
+    //handle of a message held in Data, the buffer isn't aligned past the frame data
+    memcpy(&Handle, &Data[FRAME_DATA_SIZE + (Index * sizeof(unsigned int))], sizeof(Handle));
+    return Handle;
+}
+
+void MeshNetworkInternal::CoalesceFail(KnownDeviceStruct *Device)
+{
+    uint8_t *Data;
+    unsigned int Count;
+    unsigned int i;
+
+    //report everything held as failed, WindowLock must be held
+    Data = Device->CoalesceData;
+    Count = Device->CoalesceCount;
+    Device->CoalesceData = 0;
+    Device->CoalesceCount = 0;
+    if(!Data)
+        return;
+
+    for(i = 0; i < Count; i++)
+        this->SendDone(Device, this->CoalesceHandle(Data, i), 0);
+    free(Data);
+}
@@ -77,6 +77,8 @@ int MeshNetworkInternal::ConnectRequest(const uint8_t *MAC, uint8_t *Payload, in
     DHHandshakeStruct *DHChal;
     DHFinalizeHandshakeStruct DHFinal;
     LFSRStruct MasterLFSR;
+    TXFrameStruct *Frame;
+    int Ret;
 
     DHChal = (DHHandshakeStruct *)Payload;
 
@@ -128,8 +130,7 @@ int MeshNetworkInternal::ConnectRequest(const uint8_t *MAC, uint8_t *Payload, in
             return -1;
 
         //reset is good, data was decrypted, reset the ID numbers and setup reset
-        Device->ID_In = 0;
-        Device->ID_Out = 0;
+        this->WindowResetIDs(Device);
         Device->ConnectState = ConnectStateEnum::CS_ResetConnecting;
         DHFinal.Chal = 0;
     }
@@ -167,6 +168,13 @@ int MeshNetworkInternal::ConnectRequest(const uint8_t *MAC, uint8_t *Payload, in
         Device->ConnectState = ConnectStateEnum::CS_Connecting;
     }
     
+    //a message still waiting on an ack was encrypted with the keys being replaced
+    this->LastOutDecrypt(Device);
+
+    //stay on version 1 packets and the LFSR until the other side says it supports more
+    Device->Version = 0;
+    Device->CipherSuite = CipherLFSR;
+
     //generate new LFSR values
     for(int i = 0; i < 3; i++)
     {
@@ -194,6 +202,7 @@ int MeshNetworkInternal::ConnectRequest(const uint8_t *MAC, uint8_t *Payload, in
     //lfsr
     Device->LFSR_In = DHFinal.LFSR[1];
     Device->LFSR_Out = DHFinal.LFSR[2];
+    this->SetSessionKeys(Device);
 
     DEBUG_WRITE("LFSR_In: ");
     DEBUG_WRITEHEXVAL(Device->LFSR_In.LFSR, 8);
@@ -236,7 +245,17 @@ int MeshNetworkInternal::ConnectRequest(const uint8_t *MAC, uint8_t *Payload, in
     //note, on a reset MasterLFSR was modified from a previous decryption and the other side
     //is holding that new value for this packet that will be sent
     this->Encrypt(&DHFinal.LFSR, &DHFinal.LFSR, sizeof(DHFinal.LFSR), &MasterLFSR);
-    return this->SendPayload(MSG_ConnHandshake, MAC, (uint8_t *)&DHFinal, sizeof(DHFinal));
+
+    //send it with our capabilities after it
+    Frame = this->GetTXFrame();
+    if(!Frame)
+        return -1;
+
+    memcpy(Frame->Payload, &DHFinal, sizeof(DHFinal));
+    this->WriteCapabilities(Device, &Frame->Payload[sizeof(DHFinal)], 0);
+    Ret = this->SendFrame(MSG_ConnHandshake, MAC, Frame, sizeof(DHFinal) + sizeof(CapabilityStruct));
+    this->ReleaseTXFrame(Frame);
+    return Ret;
 }
 
 //this function is triggered when we are the receiver of MSG_ConnHandshake
@@ -247,6 +266,11 @@ int MeshNetworkInternal::ConnectHandshake(const uint8_t *MAC, uint8_t *Payload,
     LFSRStruct MasterLFSR;
     int Ret;
     ConnectedStruct ConnectedData;
+    CapabilityStruct *Caps;
+    CapabilityCheckStruct *Check;
+    int CapsLen;
+    TXFrameStruct *Frame;
+    unsigned short FrameLen;
 
     //find our entry
     Device = this->FindKnownDevice(MAC);
@@ -307,11 +331,15 @@ int MeshNetworkInternal::ConnectHandshake(const uint8_t *MAC, uint8_t *Payload,
 
     //fill in our side of the values provided
 
+    //a message still waiting on an ack was encrypted with the keys being replaced
+    this->LastOutDecrypt(Device);
+
     //NOTE: In and Out are swapped from the other side
 
     //lfsr
     Device->LFSR_In = DHFinal->LFSR[2];
     Device->LFSR_Out = DHFinal->LFSR[1];
+    this->SetSessionKeys(Device);
 
     DEBUG_WRITE("LFSR_In: ");
     DEBUG_WRITEHEXVAL(Device->LFSR_In.LFSR, 8);
@@ -334,8 +362,10 @@ int MeshNetworkInternal::ConnectHandshake(const uint8_t *MAC, uint8_t *Payload,
     DEBUG_WRITE("\n");
 
     //make sure our IDs are 0
-    Device->ID_In = 0;
-    Device->ID_Out = 0;
+    this->WindowResetIDs(Device);
+
+    //if the other side sent it's capabilities then use the highest version we both support and pick the cipher suite
+    this->ReadCapabilities(Device, &Payload[sizeof(DHFinalizeHandshakeStruct)], PayloadLen - sizeof(DHFinalizeHandshakeStruct), 0);
 
     //both sides should be in sync now, send a connected message
     ConnectedData.ID = CONNECTED_CMD;
@@ -345,8 +375,36 @@ int MeshNetworkInternal::ConnectHandshake(const uint8_t *MAC, uint8_t *Payload,
     memset(ConnectedData.Name, 0, sizeof(ConnectedData.Name));
     memcpy(ConnectedData.Name, this->PingData, this->PingDataLen);
 
-    this->Encrypt(&ConnectedData, &ConnectedData, sizeof(ConnectedData), &Device->LFSR_Out);
-    Ret = this->SendPayload(MSG_Connected, MAC, (uint8_t *)&ConnectedData, sizeof(ConnectedData));
+    //strict mode refuses the connection rather than use the LFSR
+    Frame = 0;
+    if(this->CipherSuiteAllowed(Device))
+        Frame = this->GetTXFrame();
+
+    if(!Frame)
+        Ret = -1;
+    else
+    {
+        //reply with our capabilities and the ones we were handed, encrypted along with the rest. this goes
+        //out even if none came so a version 2 peer can tell if they were stripped, version 1 peers ignore it
+        this->Encrypt(&ConnectedData, Frame->Payload, sizeof(ConnectedData), &Device->LFSR_Out);
+        FrameLen = sizeof(ConnectedData);
+        Caps = (CapabilityStruct *)&Frame->Payload[sizeof(ConnectedData)];
+        this->WriteCapabilities(Device, (uint8_t *)Caps, 1);
+        Check = (CapabilityCheckStruct *)&Caps[1];
+        memset(&Check->Peer, 0, sizeof(Check->Peer));
+        CapsLen = PayloadLen - (int)sizeof(DHFinalizeHandshakeStruct);
+        if(CapsLen > (int)sizeof(Check->Peer))
+            CapsLen = sizeof(Check->Peer);
+        if(CapsLen > 0)
+            memcpy(&Check->Peer, &Payload[sizeof(DHFinalizeHandshakeStruct)], CapsLen);
+        Check->CipherSuites = (1 << CipherSuiteCount) - 1;
+        Check->ID = CAPABILITY_CHECK_CMD;
+        this->Encrypt(Caps, Caps, sizeof(CapabilityStruct) + sizeof(CapabilityCheckStruct), &Device->LFSR_Out);
+        FrameLen += sizeof(CapabilityStruct) + sizeof(CapabilityCheckStruct);
+
+        Ret = this->SendFrame(MSG_Connected, MAC, Frame, FrameLen);
+        this->ReleaseTXFrame(Frame);
+    }
     DEBUG_WRITE("SendPayload ret: ");
     DEBUG_WRITE(Ret);
     DEBUG_WRITE("\n");
@@ -357,17 +415,13 @@ int MeshNetworkInternal::ConnectHandshake(const uint8_t *MAC, uint8_t *Payload,
         if((Device->ConnectState != ConnectStateEnum::CS_ResetConnecting) && this->ConnectedCallback)
             this->ConnectedCallback(MAC, DHFinal->Name, 1);
 
-        //if in reset then modify the output slightly if we have any data packet waiting
+        //if in reset with a packet waiting it is encrypted for the new connection when it is resent
         if((Device->ConnectState == ConnectStateEnum::CS_ResetConnecting) && Device->LastOutMessage)
-        {
-            //in reset with a packet, modify our out info slightly so we sync properly
-            Device->LFSR_OutPrev = Device->LFSR_Out;
-            Device->ID_Out = 1;
             Device->LastOutMessageCheck = 0;
-        }
 
-        //change our connection status
+        //change our connection status and send anything queued while connecting
         Device->ConnectState = ConnectStateEnum::CS_Connected;
+        this->AsyncDrain(Device);
 
         //store off the entry
         PrefConnStruct NewConnData;
@@ -432,6 +486,19 @@ int MeshNetworkInternal::Connected(const uint8_t *MAC, uint8_t *Payload, int Pay
     //grab the reset vectors as everything is good now
     Device->LFSR_Reset = ConnValue->LFSR;
 
+    //capabilities are only sent back if we sent ours
+    this->ReadCapabilities(Device, &Payload[sizeof(ConnectedStruct)], PayloadLen - sizeof(ConnectedStruct), 1);
+
+    //a version 2 reply has to echo the capabilities we sent in the open and have them arrive intact,
+    //the suite picked is only checked against strict mode once the suites the other side has are known
+    if((Device->Version && !this->CheckCapabilities(Device, &Payload[sizeof(ConnectedStruct)], PayloadLen - sizeof(ConnectedStruct))) ||
+        !this->CipherSuiteAllowed(Device))
+    {
+        DEBUG_WRITELN("MeshNetwork::Connected: capabilities refused, removing known\n");
+        this->RemoveKnownDevice(Device);
+        return -1;
+    }
+
     //alert our side that someone established a connection if not a reset
     if((Device->ConnectState != ConnectStateEnum::CS_ResetConnecting) && this->ConnectedCallback)
         this->ConnectedCallback(MAC, ConnValue->Name, 1);
@@ -453,24 +520,20 @@ int MeshNetworkInternal::Connected(const uint8_t *MAC, uint8_t *Payload, int Pay
         this->prefs->putUChar("count", DeviceCount + 1);
     this->prefs->end();
 
-    //if in reset then modify the output slightly if we have any data packet waiting
+    //if in reset with a packet waiting it is encrypted for the new connection when it is resent
     if((Device->ConnectState == ConnectStateEnum::CS_ResetConnecting) && Device->LastOutMessage)
-    {
-        //in reset with a packet, modify our out info slightly so we sync properly
-        Device->LFSR_OutPrev = Device->LFSR_Out;
-        Device->ID_Out = 1;
         Device->LastOutMessageCheck = 0;
-    }
 
-    //all good
+    //all good, send anything queued while connecting
     Device->ConnectState = ConnectStateEnum::CS_Connected;
+    this->AsyncDrain(Device);
     return 0;
 }
 
 int MeshNetworkInternal::Disconnect(const uint8_t MAC[MAC_SIZE])
 {
     unsigned int DisconnectMsg = DISCONNECT_CMD;
-    uint8_t *EncData;
+    TXFrameStruct *Frame;
     unsigned short EncLen;
     KnownDeviceStruct *Device;
     int Ret;
@@ -485,7 +548,7 @@ int MeshNetworkInternal::Disconnect(const uint8_t MAC[MAC_SIZE])
     DEBUG_WRITE("Disconnect device state: ");
     DEBUG_WRITE(Device->ConnectState);
     DEBUG_WRITE(", LastOut: ");
-    DEBUG_WRITEHEXVAL((unsigned int)Device->LastOutMessage, 8);
+    DEBUG_WRITEHEXVAL((unsigned int)Device->LastOutFrame, 8);
     DEBUG_WRITE("\n");
 
     //if not connected then fail
@@ -496,19 +559,26 @@ int MeshNetworkInternal::Disconnect(const uint8_t MAC[MAC_SIZE])
     }
 
     //if still buffered data then fail
-    if(Device->LastOutMessage)
+    if(Device->LastOutMessage || Device->LastOutFrame || this->WindowPending(Device))
         return MeshWriteErrors::PreviousWriteNotComplete;
 
     //encrypt the packet
-    EncData = this->EncryptPacket(Device, (uint8_t *)&DisconnectMsg, sizeof(DisconnectMsg), &EncLen);
+    Frame = this->GetTXFrame();
+    if(!Frame)
+        return MeshWriteErrors::OutOfMemory;
+
+    EncLen = this->EncryptPacket(Device, (uint8_t *)&DisconnectMsg, sizeof(DisconnectMsg), Frame);
 
     //if no valid data then fail
-    if(!EncData)
+    if(!EncLen)
+    {
+        this->ReleaseTXFrame(Frame);
         return MeshWriteErrors::DataTooLarge;
+    }
 
     //device is connected, send a message saying we want to disconnect
-    Ret = this->SendPayload(MSG_Disconnect, MAC, EncData, EncLen);
-    free(EncData);
+    Ret = this->SendFrame(MSG_Disconnect, MAC, Frame, EncLen);
+    this->ReleaseTXFrame(Frame);
     return Ret;
 }
 
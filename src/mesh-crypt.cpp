@@ -1,87 +1,558 @@
 #include "mesh_internal.h"
 #include "debug.h"
 #include <unistd.h>
+#ifdef LFSR_BATCH_X86
+#include <immintrin.h>
+#endif
 
-void MeshNetworkInternal::Encrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR)
+void MeshNetworkInternal::Encrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule)
 {
     int Count;
     uint8_t *IntInData = (uint8_t *)InData;
     uint8_t *IntOutData = (uint8_t *)OutData;
+    LFSRStruct CurLFSR;
     uint8_t InChar;
 
+    //only use the schedule if it was built for these masks, work on a local copy of the LFSR
+    //so it can stay in registers
+    Schedule = this->CheckLFSRSchedule(Schedule, LFSR);
+    CurLFSR = *LFSR;
+
     //cycle through and encrypt, we do a cbc style mode by xor'ing in the original data into the LFSR before it is recalculated
     for(Count = 0; Count < DataLen; Count++, IntInData++, IntOutData++)
     {
         //get a copy of the character just in-case in and out are the same
         InChar = *IntInData;
-        *IntOutData = *IntInData ^ (LFSR->LFSR & 0xff);
+        *IntOutData = *IntInData ^ (CurLFSR.LFSR & 0xff);
 
         //advance the LFSR after xor'ing in the original data to force a CBC mode
-        LFSR->LFSR ^= InChar;
-        LFSR->LFSRRot ^= (uint32_t)InChar << 13;
-        this->CalculateLFSR(LFSR);
+        CurLFSR.LFSR ^= InChar;
+        CurLFSR.LFSRRot ^= (uint32_t)InChar << 13;
+        if(Schedule)
+            this->CalculateLFSR(&CurLFSR, Schedule);
+        else
+            this->CalculateLFSR(&CurLFSR);
     }
 
+    *LFSR = CurLFSR;
     return;
 }
 
-void MeshNetworkInternal::Decrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR)
+void MeshNetworkInternal::Decrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule)
 {
     int Count;
     uint8_t *IntInData = (uint8_t *)InData;
     uint8_t *IntOutData = (uint8_t *)OutData;
+    LFSRStruct CurLFSR;
+
+    //only use the schedule if it was built for these masks, work on a local copy of the LFSR
+    //so it can stay in registers
+    Schedule = this->CheckLFSRSchedule(Schedule, LFSR);
+    CurLFSR = *LFSR;
 
     //cycle through and encrypt, we do a cbc style mode by xor'ing in the original data into the LFSR before it is recalculated
     for(Count = 0; Count < DataLen; Count++, IntInData++, IntOutData++)
     {
-        *IntOutData = *IntInData ^ (LFSR->LFSR & 0xff);
+        *IntOutData = *IntInData ^ (CurLFSR.LFSR & 0xff);
 
         //advance the LFSR after xor'ing in the resulting data which should be the original to force CBC mode
-        LFSR->LFSR ^= *IntOutData;
-        LFSR->LFSRRot ^= (uint32_t)*IntOutData << 13;
-        this->CalculateLFSR(LFSR);
+        CurLFSR.LFSR ^= *IntOutData;
+        CurLFSR.LFSRRot ^= (uint32_t)*IntOutData << 13;
+        if(Schedule)
+            this->CalculateLFSR(&CurLFSR, Schedule);
+        else
+            this->CalculateLFSR(&CurLFSR);
     }
 
+    *LFSR = CurLFSR;
     return;
 }
 
-uint8_t *MeshNetworkInternal::EncryptPacketCommon(unsigned int SequenceID, LFSRStruct *LFSR, const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen)
+void MeshNetworkInternal::DecryptCRC(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, uint8_t *CRC, const LFSRScheduleStruct *Schedule)
+{
+    int Count;
+    uint8_t *IntInData = (uint8_t *)InData;
+    uint8_t *IntOutData = (uint8_t *)OutData;
+    LFSRStruct CurLFSR;
+    uint8_t CurCRC;
+
+    //same as Decrypt but the crc is updated as each byte comes out so the data is only walked once
+    //the result matches CalculateCRC(OutData, DataLen, *CRC)
+    if(!DataLen)
+    {
+        *CRC = 0;
+        return;
+    }
+
+    //only use the schedule if it was built for these masks, work on a local copy of the LFSR
+    //so it can stay in registers
+    Schedule = this->CheckLFSRSchedule(Schedule, LFSR);
+    CurLFSR = *LFSR;
+
+    CurCRC = *CRC;
+    for(Count = 0; Count < DataLen; Count++, IntInData++, IntOutData++)
+    {
+        *IntOutData = *IntInData ^ (CurLFSR.LFSR & 0xff);
+
+        //the start value mixes in after the first byte, afterwards it is a normal table step
+        if(Count)
+            CurCRC = CRCTable[0][CurCRC ^ *IntOutData];
+        else
+            CurCRC = CRCTable[0][*IntOutData] ^ CurCRC;
+
+        //advance the LFSR after xor'ing in the resulting data which should be the original to force CBC mode
+        CurLFSR.LFSR ^= *IntOutData;
+        CurLFSR.LFSRRot ^= (uint32_t)*IntOutData << 13;
+        if(Schedule)
+            this->CalculateLFSR(&CurLFSR, Schedule);
+        else
+            this->CalculateLFSR(&CurLFSR);
+    }
+
+    *LFSR = CurLFSR;
+    *CRC = CurCRC;
+    return;
+}
+
+void MeshNetworkInternal::EncryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount)
+{
+    this->CryptBatch(Jobs, JobCount, 0);
+}
+
+void MeshNetworkInternal::DecryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount)
+{
+    this->CryptBatch(Jobs, JobCount, 1);
+}
+
+uint8_t MeshNetworkInternal::SelectBatchMode()
+{
+#ifdef LFSR_BATCH_X86
+    //the build only assumes the baseline cpu, the vector lanes are compiled for their own
+    //instruction sets and picked here
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return LFSR_BATCH_AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return LFSR_BATCH_SSE2;
+#endif
+    return LFSR_BATCH_SCALAR;
+}
+
+void MeshNetworkInternal::CryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount, int DecryptFlag)
+{
+    LFSRBatchJobStruct *Lanes[LFSR_BATCH_LANES];
+    unsigned int LaneCount;
+    unsigned int LaneMax;
+    unsigned int Count;
+
+    //AVX2 has 8 lanes, SSE2 and the scalar interleave run 4
+    LaneMax = (this->BatchMode == LFSR_BATCH_AVX2) ? 8 : 4;
+
+    //jobs without a schedule for their masks go through the single stream code, the rest are
+    //grouped up so a group of streams can be run side by side
+    LaneCount = 0;
+    for(Count = 0; Count < JobCount; Count++)
+    {
+        if(!Jobs[Count].DataLen)
+            continue;
+
+        if(!this->CheckLFSRSchedule(Jobs[Count].Schedule, Jobs[Count].LFSR))
+        {
+            if(DecryptFlag)
+                this->Decrypt(Jobs[Count].InData, Jobs[Count].OutData, Jobs[Count].DataLen, Jobs[Count].LFSR);
+            else
+                this->Encrypt(Jobs[Count].InData, Jobs[Count].OutData, Jobs[Count].DataLen, Jobs[Count].LFSR);
+            continue;
+        }
+
+        Lanes[LaneCount++] = &Jobs[Count];
+        if(LaneCount == LaneMax)
+        {
+            this->CryptLanes(Lanes, LaneCount, DecryptFlag);
+            LaneCount = 0;
+        }
+    }
+
+    if(LaneCount)
+        this->CryptLanes(Lanes, LaneCount, DecryptFlag);
+}
+
+//single byte step of a batch lane, same as the Encrypt/Decrypt loops
+inline void MeshNetworkInternal::CryptLaneByte(const uint8_t **InData, uint8_t **OutData, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, int DecryptFlag)
+{
+    uint8_t InChar;
+    uint8_t OutChar;
+
+    InChar = *(*InData)++;
+    OutChar = InChar ^ (LFSR->LFSR & 0xff);
+    *(*OutData)++ = OutChar;
+
+    //cbc style, the original data is xor'd in before advancing
+    if(DecryptFlag)
+        InChar = OutChar;
+    LFSR->LFSR ^= InChar;
+    LFSR->LFSRRot ^= (uint32_t)InChar << 13;
+    CalculateLFSR(LFSR, Schedule);
+}
+
+void MeshNetworkInternal::CryptLanes(LFSRBatchJobStruct **Lanes, unsigned int LaneCount, int DecryptFlag)
+{
+    LFSRStruct CurLFSR[LFSR_BATCH_LANES];
+    const LFSRScheduleStruct *Schedule[LFSR_BATCH_LANES];
+    const uint8_t *InData[LFSR_BATCH_LANES];
+    uint8_t *OutData[LFSR_BATCH_LANES];
+    LFSRStruct *LFSR[LFSR_BATCH_LANES];
+    unsigned int DataLeft[LFSR_BATCH_LANES];
+    unsigned int MinLen;
+    unsigned int Lane;
+    unsigned int Count;
+
+    //local copies of everything so each lane stays in registers
+    MinLen = 0xffff;
+    for(Lane = 0; Lane < LaneCount; Lane++)
+    {
+        CurLFSR[Lane] = *Lanes[Lane]->LFSR;
+        Schedule[Lane] = Lanes[Lane]->Schedule;
+        InData[Lane] = Lanes[Lane]->InData;
+        OutData[Lane] = Lanes[Lane]->OutData;
+        LFSR[Lane] = Lanes[Lane]->LFSR;
+        DataLeft[Lane] = Lanes[Lane]->DataLen;
+        if(DataLeft[Lane] < MinLen)
+            MinLen = DataLeft[Lane];
+    }
+
+#ifdef LFSR_BATCH_X86
+    //a full group runs in vector lanes for the bytes all of them have
+    if(((this->BatchMode == LFSR_BATCH_AVX2) && (LaneCount == 8)) ||
+       ((this->BatchMode == LFSR_BATCH_SSE2) && (LaneCount == 4)))
+    {
+        if(this->BatchMode == LFSR_BATCH_AVX2)
+            this->CryptLanesAVX2(InData, OutData, MinLen, CurLFSR, Schedule, DecryptFlag);
+        else
+            this->CryptLanesSSE2(InData, OutData, MinLen, CurLFSR, Schedule, DecryptFlag);
+        for(Lane = 0; Lane < LaneCount; Lane++)
+            DataLeft[Lane] -= MinLen;
+        MinLen = 0;
+    }
+#endif
+
+    while(LaneCount)
+    {
+        //each stream is a chain of dependent lookups, running a byte of every lane per loop
+        //lets the lookups of one lane overlap the others. a full group has a fixed lane count
+        //so the compiler can unroll it and keep every lane in registers
+        if(LaneCount == 4)
+        {
+            for(Count = 0; Count < MinLen; Count++)
+            {
+                for(Lane = 0; Lane < 4; Lane++)
+                    CryptLaneByte(&InData[Lane], &OutData[Lane], &CurLFSR[Lane], Schedule[Lane], DecryptFlag);
+            }
+        }
+        else
+        {
+            for(Count = 0; Count < MinLen; Count++)
+            {
+                for(Lane = 0; Lane < LaneCount; Lane++)
+                    CryptLaneByte(&InData[Lane], &OutData[Lane], &CurLFSR[Lane], Schedule[Lane], DecryptFlag);
+            }
+        }
+
+        //store finished lanes and move the last lane into their spot
+        for(Lane = 0; Lane < LaneCount;)
+        {
+            DataLeft[Lane] -= MinLen;
+            if(DataLeft[Lane])
+            {
+                Lane++;
+                continue;
+            }
+
+            *LFSR[Lane] = CurLFSR[Lane];
+            LaneCount--;
+            CurLFSR[Lane] = CurLFSR[LaneCount];
+            Schedule[Lane] = Schedule[LaneCount];
+            InData[Lane] = InData[LaneCount];
+            OutData[Lane] = OutData[LaneCount];
+            LFSR[Lane] = LFSR[LaneCount];
+            DataLeft[Lane] = DataLeft[LaneCount];
+        }
+
+        MinLen = 0xffff;
+        for(Lane = 0; Lane < LaneCount; Lane++)
+        {
+            if(DataLeft[Lane] < MinLen)
+                MinLen = DataLeft[Lane];
+        }
+    }
+}
+
+#ifdef LFSR_BATCH_X86
+//jump 4 LFSRs at once. SSE2 has no gathers or per lane shifts so the table lookups are done a lane
+//at a time and the shifts come from multiplying by 1 << (32 - Count), the 64 bit product has
+//LFSR >> Count in the top half and NewBits << (32 - Count) in the bottom half
+static inline unsigned int JumpLFSRBits(unsigned int LFSR, const MeshNetworkInternal::LFSRJumpStruct *Jump)
+{
+    return Jump->XNOR ^
+           Jump->Table[0][LFSR & 0xf] ^ Jump->Table[1][(LFSR >> 4) & 0xf] ^
+           Jump->Table[2][(LFSR >> 8) & 0xf] ^ Jump->Table[3][(LFSR >> 12) & 0xf] ^
+           Jump->Table[4][(LFSR >> 16) & 0xf] ^ Jump->Table[5][(LFSR >> 20) & 0xf] ^
+           Jump->Table[6][(LFSR >> 24) & 0xf] ^ Jump->Table[7][LFSR >> 28];
+}
+
+__attribute__((target("sse2"))) static inline __m128i JumpLFSRSSE2(__m128i LFSR, __m128i Count, const MeshNetworkInternal::LFSRJumpStruct **Jump)
+{
+    __m128i Bits, Power, Even, Odd, Low, Invalid;
+
+    Bits = _mm_setr_epi32(JumpLFSRBits(_mm_cvtsi128_si32(LFSR), Jump[0]),
+                          JumpLFSRBits(_mm_cvtsi128_si32(_mm_shuffle_epi32(LFSR, 1)), Jump[1]),
+                          JumpLFSRBits(_mm_cvtsi128_si32(_mm_shuffle_epi32(LFSR, 2)), Jump[2]),
+                          JumpLFSRBits(_mm_cvtsi128_si32(_mm_shuffle_epi32(LFSR, 3)), Jump[3]));
+
+    //build 2^(32 - Count) as a float and convert it, 2^31 is out of range for the conversion but
+    //comes back as 0x80000000 which is the value we want
+    Power = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127 + 32), Count), 23)));
+
+    //multiplies only use lanes 0 and 2, lanes 1 and 3 go through a second one
+    Low = _mm_set_epi32(0, -1, 0, -1);
+    Even = _mm_mul_epu32(LFSR, Power);
+    Odd = _mm_mul_epu32(_mm_srli_epi64(LFSR, 32), _mm_srli_epi64(Power, 32));
+    LFSR = _mm_or_si128(_mm_srli_epi64(Even, 32), _mm_andnot_si128(Low, Odd));
+    Even = _mm_mul_epu32(Bits, Power);
+    Odd = _mm_mul_epu32(_mm_srli_epi64(Bits, 32), _mm_srli_epi64(Power, 32));
+    LFSR = _mm_or_si128(LFSR, _mm_or_si128(_mm_and_si128(Even, Low), _mm_slli_epi64(Odd, 32)));
+
+    //0 and 0xffffffff become 1
+    Invalid = _mm_or_si128(_mm_cmpeq_epi32(LFSR, _mm_setzero_si128()), _mm_cmpeq_epi32(LFSR, _mm_set1_epi32(-1)));
+    return _mm_or_si128(_mm_andnot_si128(Invalid, LFSR), _mm_and_si128(Invalid, _mm_set1_epi32(1)));
+}
+
+__attribute__((target("sse2"))) void MeshNetworkInternal::CryptLanesSSE2(const uint8_t **InData, uint8_t **OutData, unsigned int DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct **Schedule, int DecryptFlag)
+{
+    const LFSRJumpStruct *Jump[2][4];
+    uint32_t State[2][4] __attribute__((aligned(16)));
+    uint32_t Bytes[4] __attribute__((aligned(16)));
+    __m128i LFSRVec, RotVec, InVec, OutVec;
+    unsigned int Lane;
+    unsigned int Count;
+
+    for(Lane = 0; Lane < 4; Lane++)
+    {
+        Jump[0][Lane] = &Schedule[Lane]->LFSRRot;
+        Jump[1][Lane] = &Schedule[Lane]->LFSR;
+        State[0][Lane] = LFSR[Lane].LFSRRot;
+        State[1][Lane] = LFSR[Lane].LFSR;
+    }
+
+    RotVec = _mm_load_si128((const __m128i *)State[0]);
+    LFSRVec = _mm_load_si128((const __m128i *)State[1]);
+    for(Count = 0; Count < DataLen; Count++)
+    {
+        InVec = _mm_setr_epi32(InData[0][Count], InData[1][Count], InData[2][Count], InData[3][Count]);
+        OutVec = _mm_xor_si128(InVec, _mm_and_si128(LFSRVec, _mm_set1_epi32(0xff)));
+        _mm_store_si128((__m128i *)Bytes, OutVec);
+        for(Lane = 0; Lane < 4; Lane++)
+            OutData[Lane][Count] = Bytes[Lane];
+
+        //cbc style, the original data is xor'd in before advancing
+        if(DecryptFlag)
+            InVec = OutVec;
+        LFSRVec = _mm_xor_si128(LFSRVec, InVec);
+        RotVec = _mm_xor_si128(RotVec, _mm_slli_epi32(InVec, 13));
+
+        //both jump amounts come from the rotation LFSR before it moves
+        InVec = RotVec;
+        RotVec = JumpLFSRSSE2(RotVec, _mm_add_epi32(_mm_and_si128(_mm_srli_epi32(InVec, 7), _mm_set1_epi32(0xf)), _mm_set1_epi32(1)), Jump[0]);
+        LFSRVec = JumpLFSRSSE2(LFSRVec, _mm_add_epi32(_mm_and_si128(InVec, _mm_set1_epi32(0xf)), _mm_set1_epi32(1)), Jump[1]);
+    }
+
+    _mm_store_si128((__m128i *)State[0], RotVec);
+    _mm_store_si128((__m128i *)State[1], LFSRVec);
+    for(Lane = 0; Lane < 4; Lane++)
+    {
+        LFSR[Lane].LFSRRot = State[0][Lane];
+        LFSR[Lane].LFSR = State[1][Lane];
+        InData[Lane] += DataLen;
+        OutData[Lane] += DataLen;
+    }
+}
+
+//jump 8 LFSRs at once, Tables holds 256 entries per lane with Offset selecting which 128 to use
+__attribute__((target("avx2"))) static inline __m256i JumpLFSRAVX2(__m256i LFSR, __m256i Count, const int *Tables, __m256i Offset, __m256i XNOR)
+{
+    __m256i NewBits;
+    __m256i Nibble;
+    __m256i Mask;
+    __m256i Invalid;
+    int Entry;
+
+    NewBits = XNOR;
+    for(Entry = 0; Entry < 8; Entry++)
+    {
+        Nibble = _mm256_and_si256(_mm256_srli_epi32(LFSR, Entry * 4), _mm256_set1_epi32(0xf));
+        Nibble = _mm256_add_epi32(Nibble, _mm256_add_epi32(Offset, _mm256_set1_epi32(Entry * 16)));
+        NewBits = _mm256_xor_si256(NewBits, _mm256_i32gather_epi32(Tables, Nibble, 4));
+    }
+
+    Mask = _mm256_sub_epi32(_mm256_sllv_epi32(_mm256_set1_epi32(1), Count), _mm256_set1_epi32(1));
+    LFSR = _mm256_or_si256(_mm256_srlv_epi32(LFSR, Count),
+                           _mm256_sllv_epi32(_mm256_and_si256(NewBits, Mask), _mm256_sub_epi32(_mm256_set1_epi32(32), Count)));
+
+    //0 and 0xffffffff become 1
+    Invalid = _mm256_or_si256(_mm256_cmpeq_epi32(LFSR, _mm256_setzero_si256()), _mm256_cmpeq_epi32(LFSR, _mm256_set1_epi32(-1)));
+    return _mm256_blendv_epi8(LFSR, _mm256_set1_epi32(1), Invalid);
+}
+
+__attribute__((target("avx2"))) void MeshNetworkInternal::CryptLanesAVX2(const uint8_t **InData, uint8_t **OutData, unsigned int DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct **Schedule, int DecryptFlag)
 {
+    int Tables[8][256] __attribute__((aligned(32)));
+    uint32_t State[2][8] __attribute__((aligned(32)));
+    uint32_t XNOR[2][8] __attribute__((aligned(32)));
+    uint32_t Bytes[8] __attribute__((aligned(32)));
+    __m256i LFSRVec, RotVec, InVec, OutVec, Offset;
+    unsigned int Lane;
+    unsigned int Count;
+    int Entry;
+
+    //widen each lane's tables so they can be gathered, rotation first then the main LFSR
+    for(Lane = 0; Lane < 8; Lane++)
+    {
+        for(Entry = 0; Entry < 128; Entry++)
+        {
+            Tables[Lane][Entry] = Schedule[Lane]->LFSRRot.Table[Entry >> 4][Entry & 0xf];
+            Tables[Lane][Entry + 128] = Schedule[Lane]->LFSR.Table[Entry >> 4][Entry & 0xf];
+        }
+        XNOR[0][Lane] = Schedule[Lane]->LFSRRot.XNOR;
+        XNOR[1][Lane] = Schedule[Lane]->LFSR.XNOR;
+        State[0][Lane] = LFSR[Lane].LFSRRot;
+        State[1][Lane] = LFSR[Lane].LFSR;
+    }
+
+    Offset = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    RotVec = _mm256_load_si256((const __m256i *)State[0]);
+    LFSRVec = _mm256_load_si256((const __m256i *)State[1]);
+    for(Count = 0; Count < DataLen; Count++)
+    {
+        InVec = _mm256_setr_epi32(InData[0][Count], InData[1][Count], InData[2][Count], InData[3][Count],
+                                  InData[4][Count], InData[5][Count], InData[6][Count], InData[7][Count]);
+        OutVec = _mm256_xor_si256(InVec, _mm256_and_si256(LFSRVec, _mm256_set1_epi32(0xff)));
+        _mm256_store_si256((__m256i *)Bytes, OutVec);
+        for(Lane = 0; Lane < 8; Lane++)
+            OutData[Lane][Count] = Bytes[Lane];
+
+        //cbc style, the original data is xor'd in before advancing
+        if(DecryptFlag)
+            InVec = OutVec;
+        LFSRVec = _mm256_xor_si256(LFSRVec, InVec);
+        RotVec = _mm256_xor_si256(RotVec, _mm256_slli_epi32(InVec, 13));
+
+        //both jump amounts come from the rotation LFSR before it moves
+        InVec = RotVec;
+        RotVec = JumpLFSRAVX2(RotVec, _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(InVec, 7), _mm256_set1_epi32(0xf)), _mm256_set1_epi32(1)),
+                              &Tables[0][0], Offset, _mm256_load_si256((const __m256i *)XNOR[0]));
+        LFSRVec = JumpLFSRAVX2(LFSRVec, _mm256_add_epi32(_mm256_and_si256(InVec, _mm256_set1_epi32(0xf)), _mm256_set1_epi32(1)),
+                               &Tables[0][0], _mm256_add_epi32(Offset, _mm256_set1_epi32(128)), _mm256_load_si256((const __m256i *)XNOR[1]));
+    }
+
+    _mm256_store_si256((__m256i *)State[0], RotVec);
+    _mm256_store_si256((__m256i *)State[1], LFSRVec);
+    for(Lane = 0; Lane < 8; Lane++)
+    {
+        LFSR[Lane].LFSRRot = State[0][Lane];
+        LFSR[Lane].LFSR = State[1][Lane];
+        InData[Lane] += DataLen;
+        OutData[Lane] += DataLen;
+    }
+}
+#endif
+
+unsigned int MeshNetworkInternal::CalculatePacketTag(const LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, unsigned int SequenceID, unsigned short PacketLen)
+{
+    LFSRStruct TagLFSR;
+    int Count;
+
+    //run a copy of the LFSR the packet is encrypted with after mixing in the ID and length, only someone
+    //holding the key can generate it and it can be checked before decrypting anything
+    Schedule = this->CheckLFSRSchedule(Schedule, LFSR);
+    TagLFSR = *LFSR;
+    TagLFSR.LFSR ^= ((unsigned int)PacketLen << 16) | PacketLen;
+    TagLFSR.LFSRRot ^= SequenceID;
+    for(Count = 0; Count < 4; Count++)
+    {
+        if(Schedule)
+            this->CalculateLFSR(&TagLFSR, Schedule);
+        else
+            this->CalculateLFSR(&TagLFSR);
+    }
+
+    return TagLFSR.LFSR ^ TagLFSR.LFSRRot;
+}
+
+void MeshNetworkInternal::InitCipherState(CipherStateStruct *State, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, const unsigned int *Key)
+{
+    State->LFSR = LFSR;
+    State->Schedule = Schedule;
+    State->Key = Key;
+    State->Nonce[1] = 0;
+    State->Nonce[2] = 0;
+}
+
+unsigned short MeshNetworkInternal::EncryptPacketCommon(unsigned int SequenceID, uint8_t Suite, CipherStateStruct *State, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame, uint8_t Version)
+{
+    CipherSuite *Cipher = this->CipherSuites[Suite];
     unsigned int ValidPacketID = VALID_PACKET_ID;
-    uint8_t *Packet;
     PacketHeaderStruct *PacketHeader;
+    uint8_t *OutPacket = Frame->Payload;
 
     //if no room for the header due to wrap around then fail
     if(!DataLen || ((DataLen + sizeof(PacketHeaderStruct)) < DataLen))
         return 0;
 
-    if((DataLen + sizeof(PacketHeaderStruct)) > MAX_PACKET_SIZE)
+    //must fit in the payload of a frame
+    if((DataLen + sizeof(PacketHeaderStruct) + sizeof(ValidPacketID)) > field_sizeof(TXFrameStruct, Payload))
         return 0;
 
-    //allocate space for the packet
-    Packet = (uint8_t *)malloc(DataLen + sizeof(PacketHeaderStruct) + sizeof(ValidPacketID));
-    PacketHeader = (PacketHeaderStruct *)Packet;
+    PacketHeader = (PacketHeaderStruct *)OutPacket;
+    Cipher->Start(State, SequenceID);
+
+    //tag the frame if the receiver understands it
+    Frame->Header.PacketVersion = 0;
+    Frame->Header.PacketTag = 0;
+    if(Version >= 2)
+    {
+        Frame->Header.PacketVersion = 2;
+        Frame->Header.PacketTag = Cipher->Tag(State, SequenceID, DataLen + sizeof(PacketHeaderStruct) + sizeof(ValidPacketID));
+    }
 
     //setup the header
     PacketHeader->SequenceID = SequenceID;
-    PacketHeader->InternalCRC = this->CalculateCRC(&Packet[1], sizeof(PacketHeaderStruct) - 1);   //calculate the CRC with the ID and ValidID in it
+    PacketHeader->InternalCRC = this->CalculateCRC(&OutPacket[1], sizeof(PacketHeaderStruct) - 1);   //calculate the CRC with the ID and ValidID in it
     PacketHeader->InternalCRC = this->CalculateCRC(InData, DataLen, PacketHeader->InternalCRC); //add in the incoming data
 
     //do the encryption
-    this->Encrypt(InData, &Packet[sizeof(PacketHeaderStruct)], DataLen, LFSR);
+    Cipher->Encrypt(State, InData, &OutPacket[sizeof(PacketHeaderStruct)], DataLen);
 
     //add on the indicator that the packet was decrypted properly
-    this->Encrypt(&ValidPacketID, &Packet[sizeof(PacketHeaderStruct) + DataLen], sizeof(ValidPacketID), LFSR);
+    Cipher->Encrypt(State, &ValidPacketID, &OutPacket[sizeof(PacketHeaderStruct) + DataLen], sizeof(ValidPacketID));
 
-    //everything is good, return the buffer, ack will cause LFSR and ID to change
-    *OutPacketLen = DataLen + sizeof(PacketHeaderStruct) + sizeof(ValidPacketID);
-    return Packet;
+    //everything is good, return the length, ack will cause LFSR and ID to change
+    return DataLen + sizeof(PacketHeaderStruct) + sizeof(ValidPacketID);
 }
 
-uint8_t *MeshNetworkInternal::EncryptPacket(KnownDeviceStruct *Device, const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen)
+unsigned short MeshNetworkInternal::EncryptPacket(KnownDeviceStruct *Device, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame)
 {
-    uint8_t *ret;
+    unsigned short ret;
     LFSRStruct LFSR;
+    CipherStateStruct State;
+
+    //with a send window every message is keyed by it's own ID
+    if(Device->Window > 1)
+    {
+        ret = this->EncryptWindowPacket(Device, Device->ID_Out, InData, DataLen, Frame);
+        if(ret)
+            Device->ID_Out++;
+        return ret;
+    }
 
     //copy off the LFSR so that we can update if successful
     DEBUG_WRITE("EncryptPacket: LFSR: ");
@@ -94,8 +565,12 @@ uint8_t *MeshNetworkInternal::EncryptPacket(KnownDeviceStruct *Device, const uin
     DEBUG_WRITEHEXVAL(Device->LFSR_Out.LFSRRotMask, 8);
     DEBUG_WRITE("\n");
 
+    //make sure the key schedule matches the current masks
+    this->BuildLFSRSchedule(&Device->Schedule_Out, &Device->LFSR_Out);
+
     LFSR = Device->LFSR_Out;
-    ret = this->EncryptPacketCommon(Device->ID_Out, &LFSR, InData, DataLen, OutPacketLen);
+    this->InitCipherState(&State, &LFSR, &Device->Schedule_Out, Device->Key_Out);
+    ret = this->EncryptPacketCommon(Device->ID_Out, Device->CipherSuite, &State, InData, DataLen, Frame, Device->Version);
     if(ret)
     {
         //update LFSR and ID
@@ -107,13 +582,42 @@ uint8_t *MeshNetworkInternal::EncryptPacket(KnownDeviceStruct *Device, const uin
     return ret;
 }
 
-uint8_t *MeshNetworkInternal::EncryptBroadcastPacket(const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen)
+unsigned short MeshNetworkInternal::EncryptWindowPacket(KnownDeviceStruct *Device, unsigned int ID, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame)
 {
-    uint8_t *ret;
     LFSRStruct LFSR;
+    CipherStateStruct State;
+
+    //LFSR_Out stays where the connection left it, each message gets a copy permuted by it's ID
+    //so resends and out of order messages don't depend on what was sent before
+    this->BuildLFSRSchedule(&Device->Schedule_Out, &Device->LFSR_Out);
+    this->PermuteSessionLFSR(&Device->LFSR_Out, &Device->Schedule_Out, ID, &LFSR);
+    this->InitCipherState(&State, &LFSR, &Device->Schedule_Out, Device->Key_Out);
+    return this->EncryptPacketCommon(ID, Device->CipherSuite, &State, InData, DataLen, Frame, Device->Version);
+}
 
-    //get our LFSR for this device
-    this->PermuteBroadcastLFSR(this->MAC, this->BroadcastMsgID, &LFSR);
+unsigned short MeshNetworkInternal::EncryptBroadcastPacket(const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame)
+{
+    unsigned short ret;
+
+    //use the next broadcast ID
+    ret = this->EncryptBroadcastPacket(this->BroadcastMsgID, InData, DataLen, Frame);
+    if(ret)
+    {
+        this->BroadcastMsgID++;
+        if((int)(this->BroadcastMsgID - this->BroadcastMsgIDSaved) > 0)
+            this->ReserveBroadcastIDs(0);
+    }
+
+    return ret;
+}
+
+unsigned short MeshNetworkInternal::EncryptBroadcastPacket(unsigned int SequenceID, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame)
+{
+    LFSRStruct LFSR;
+    CipherStateStruct State;
+
+    //get our LFSR for this device, SequenceID has to be one we reserved
+    this->PermuteBroadcastLFSR(this->BroadcastMACCRC, SequenceID, &LFSR);
     DEBUG_WRITE("Encrypt Broadcast LFSR: ");
     DEBUG_WRITEHEXVAL(LFSR.LFSR, 8);
     DEBUG_WRITE(", Mask: ");
@@ -123,23 +627,30 @@ uint8_t *MeshNetworkInternal::EncryptBroadcastPacket(const uint8_t *InData, unsi
     DEBUG_WRITE(", RotMask: ");
     DEBUG_WRITEHEXVAL(LFSR.LFSRRotMask, 8);
     DEBUG_WRITE(", ID: ");
-    DEBUG_WRITEHEXVAL(this->BroadcastMsgID, 8);
+    DEBUG_WRITEHEXVAL(SequenceID, 8);
     DEBUG_WRITE("\n");
 
-    ret = this->EncryptPacketCommon(this->BroadcastMsgID, &LFSR, InData, DataLen, OutPacketLen);
-    if(ret)
-    {
-        this->BroadcastMsgID++;
-        this->prefs->begin("mesh");
-        this->prefs->putUInt("broadcastid", this->BroadcastMsgID);
-        this->prefs->end();
-    }
+    //every device shares the broadcast key so the sender is part of the nonce
+    this->InitCipherState(&State, &LFSR, &this->Schedule_Broadcast, this->Key_Broadcast);
+    memcpy(&State.Nonce[1], this->MAC, MAC_SIZE);
 
-    return ret;
+    //version 1 peers ignore the tag so broadcasts are always tagged
+    return this->EncryptPacketCommon(SequenceID, this->CipherSuiteBroadcast, &State, InData, DataLen, Frame, PACKET_VERSION);
 }
 
-uint8_t *MeshNetworkInternal::DecryptPacketCommon(unsigned int SequenceID, LFSRStruct *LFSR, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen)
+void MeshNetworkInternal::ReserveBroadcastIDs(unsigned int Count)
 {
+    //store where the IDs will be after Count more broadcasts so a message split into many
+    //fragments only writes flash once, after a restart anything reserved is skipped
+    this->BroadcastMsgIDSaved = this->BroadcastMsgID + Count;
+    this->prefs->begin("mesh");
+    this->prefs->putUInt("broadcastid", this->BroadcastMsgIDSaved);
+    this->prefs->end();
+}
+
+uint8_t *MeshNetworkInternal::DecryptPacketCommon(unsigned int SequenceID, uint8_t Suite, CipherStateStruct *State, const WifiHeaderStruct *Header, uint8_t Version, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen)
+{
+    CipherSuite *Cipher = this->CipherSuites[Suite];
     uint8_t *Packet;
     PacketHeaderStruct *PacketHeader;
     uint8_t CRC;
@@ -157,31 +668,43 @@ uint8_t *MeshNetworkInternal::DecryptPacketCommon(unsigned int SequenceID, LFSRS
     if(PacketHeader->SequenceID != SequenceID)
         return 0;
 
+    Cipher->Start(State, SequenceID);
+
+    //check the tag before spending time decrypting, untagged packets are only allowed if
+    //a version below 2 is accepted
+    if(Header->PacketVersion == 2)
+    {
+        if(Header->PacketTag != Cipher->Tag(State, SequenceID, PacketLen))
+            return 0;
+    }
+    else if(Header->PacketVersion || (Version >= 2))
+        return 0;
+
     //see if we can decrypt it
     DataSize = PacketLen - sizeof(PacketHeaderStruct) - sizeof(ValidPacketID);
     if(!DataSize)
         return 0;
 
-    Packet = (uint8_t *)malloc(DataSize);
-    this->Decrypt(&InPacket[sizeof(PacketHeaderStruct)], Packet, DataSize, LFSR);
-    this->Decrypt(&InPacket[sizeof(PacketHeaderStruct) + DataSize], (uint8_t *)&ValidPacketID, sizeof(ValidPacketID), LFSR);
-
-    //check the internal CRC and PacketID
+    //start the CRC with the header then decrypt and add in the data in a single pass
     CRC = this->CalculateCRC(&InPacket[1], sizeof(PacketHeaderStruct) - 1);
 
+    Packet = (uint8_t *)malloc(DataSize);
+    Cipher->Decrypt(State, &InPacket[sizeof(PacketHeaderStruct)], Packet, DataSize, &CRC);
+    Cipher->Decrypt(State, &InPacket[sizeof(PacketHeaderStruct) + DataSize], (uint8_t *)&ValidPacketID, sizeof(ValidPacketID), 0);
+
     DEBUG_WRITE("Decrypt results: ");
     DEBUG_WRITEHEXVAL(ValidPacketID, 8);
     DEBUG_WRITE(" == ");
     DEBUG_WRITEHEXVAL(VALID_PACKET_ID, 8);
     DEBUG_WRITE(", CRC ");
-    DEBUG_WRITEHEXVAL(this->CalculateCRC(Packet, DataSize, CRC), 2);
+    DEBUG_WRITEHEXVAL(CRC, 2);
     DEBUG_WRITE(" == ");
     DEBUG_WRITEHEXVAL(PacketHeader->InternalCRC, 2);
     DEBUG_WRITE(", Data size:");
     DEBUG_WRITE(DataSize);
     DEBUG_WRITE("\n");
 
-    if((ValidPacketID != VALID_PACKET_ID) || (this->CalculateCRC(Packet, DataSize, CRC) != PacketHeader->InternalCRC))
+    if((ValidPacketID != VALID_PACKET_ID) || (CRC != PacketHeader->InternalCRC))
     {
         free(Packet);
         return 0;
@@ -192,13 +715,49 @@ uint8_t *MeshNetworkInternal::DecryptPacketCommon(unsigned int SequenceID, LFSRS
     return Packet;
 }
 
-uint8_t *MeshNetworkInternal::DecryptPacket(KnownDeviceStruct *Device, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen, unsigned int *DoAck)
+uint8_t *MeshNetworkInternal::DecryptPacket(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen, unsigned int *DoAck)
 {
     uint8_t *ret;
     LFSRStruct LFSR;
+    CipherStateStruct State;
+    unsigned int ID;
+
+    //with a send window anything from a window behind to a window ahead of ID_In is accepted
+    //and only a message past everything seen so far is returned
+    if(Device->Window > 1)
+    {
+        *DoAck = 0;
+        if(PacketLen < sizeof(PacketHeaderStruct))
+            return 0;
+
+        ID = ((PacketHeaderStruct *)InPacket)->SequenceID;
+        if(((ID - Device->ID_In) >= Device->Window) && ((Device->ID_In - ID) > Device->Window))
+            return 0;
+
+        ret = this->DecryptWindowPacket(Device, Header, InPacket, PacketLen, OutDataLen);
+        if(!ret)
+            return 0;
+
+        //messages held before it were sent first so they are still delivered
+        *DoAck = 1;
+        pthread_mutex_lock(&this->WindowLock);
+        if((ID - Device->ID_In) < Device->Window)
+            this->WindowSkipTo(Device, ID + 1);
+        else
+        {
+            free(ret);
+            ret = 0;
+        }
+        pthread_mutex_unlock(&this->WindowLock);
+        return ret;
+    }
+
+    //make sure the key schedule matches the current masks, LFSR_InPrev uses the same masks
+    this->BuildLFSRSchedule(&Device->Schedule_In, &Device->LFSR_In);
 
     LFSR = Device->LFSR_In;
-    ret = this->DecryptPacketCommon(Device->ID_In, &LFSR, InPacket, PacketLen, OutDataLen);
+    this->InitCipherState(&State, &LFSR, &Device->Schedule_In, Device->Key_In);
+    ret = this->DecryptPacketCommon(Device->ID_In, Device->CipherSuite, &State, Header, Device->Version, InPacket, PacketLen, OutDataLen);
 
     //if a good message then increment the ID
     *DoAck = 0;
@@ -213,7 +772,7 @@ uint8_t *MeshNetworkInternal::DecryptPacket(KnownDeviceStruct *Device, const uin
     {
         //we failed to decrypt, try to decrypt with the previous lfsr and see if we are off by 1
         LFSR = Device->LFSR_InPrev;
-        ret = this->DecryptPacketCommon(Device->ID_In - 1, &LFSR, InPacket, PacketLen, OutDataLen);
+        ret = this->DecryptPacketCommon(Device->ID_In - 1, Device->CipherSuite, &State, Header, Device->Version, InPacket, PacketLen, OutDataLen);
 
         //if successful then indicate we need to just re-ack
         if(ret)
@@ -227,10 +786,28 @@ uint8_t *MeshNetworkInternal::DecryptPacket(KnownDeviceStruct *Device, const uin
     return ret;
 }
 
-uint8_t *MeshNetworkInternal::DecryptBroadcastPacket(UnknownDeviceStruct *Device, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen)
+uint8_t *MeshNetworkInternal::DecryptWindowPacket(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen)
+{
+    unsigned int SequenceID;
+    LFSRStruct LFSR;
+    CipherStateStruct State;
+
+    //the caller checks the ID is in the window, decrypt it with the LFSR for that ID
+    if(PacketLen < sizeof(PacketHeaderStruct))
+        return 0;
+
+    SequenceID = ((PacketHeaderStruct *)InPacket)->SequenceID;
+    this->BuildLFSRSchedule(&Device->Schedule_In, &Device->LFSR_In);
+    this->PermuteSessionLFSR(&Device->LFSR_In, &Device->Schedule_In, SequenceID, &LFSR);
+    this->InitCipherState(&State, &LFSR, &Device->Schedule_In, Device->Key_In);
+    return this->DecryptPacketCommon(SequenceID, Device->CipherSuite, &State, Header, Device->Version, InPacket, PacketLen, OutDataLen);
+}
+
+uint8_t *MeshNetworkInternal::DecryptBroadcastPacket(UnknownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen)
 {
     unsigned int SequenceID;
     LFSRStruct LFSR;
+    CipherStateStruct State;
 
     //decrypt data and return the data found in the packet
 
@@ -242,8 +819,14 @@ uint8_t *MeshNetworkInternal::DecryptBroadcastPacket(UnknownDeviceStruct *Device
     SequenceID = ((PacketHeaderStruct *)InPacket)->SequenceID;
 
     //get our LFSR for this device
-    this->PermuteBroadcastLFSR(Device->MAC, SequenceID, &LFSR);
+    this->PermuteBroadcastLFSR(Device->MACCRC, SequenceID, &LFSR);
+    this->InitCipherState(&State, &LFSR, &this->Schedule_Broadcast, this->Key_Broadcast);
+    memcpy(&State.Nonce[1], Header->MAC_Sender, MAC_SIZE);
 
     //attempt to decrypt
-    return this->DecryptPacketCommon(SequenceID, &LFSR, InPacket, PacketLen, OutDataLen);
+#ifdef MESH_BROADCAST_V1_COMPAT
+    return this->DecryptPacketCommon(SequenceID, this->CipherSuiteBroadcast, &State, Header, 1, InPacket, PacketLen, OutDataLen);
+#else
+    return this->DecryptPacketCommon(SequenceID, this->CipherSuiteBroadcast, &State, Header, PACKET_VERSION, InPacket, PacketLen, OutDataLen);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,361 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+#include "mesh.h"
+#include "debug.h"
+#include <pthread.h>
+#include <string.h>
+
+//messages larger than a frame are split into fragments that each start with a FragmentHeaderStruct and
+//are sent as MSG_Fragment. unicast fragments are queued in the send window so each one is acked and resent
+//on it's own and they arrive in order, broadcast fragments are sent by the resend thread and can be put
+//back together in any order. broadcast fragments have consecutive sequence IDs so a rebroadcast copy of a lost
+//one is let through even though a later fragment already moved the sender's ID past it
+
+int MeshNetworkInternal::WriteFragments(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle)
+{
+    FragmentOutStruct *Fragment;
+
+    pthread_mutex_lock(&this->WindowLock);
+
+    //only one fragmented message to a device at a time and anything held has to go first
+    if(Device->FragmentOut || this->CoalesceFlush(Device))
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::PreviousWriteNotComplete;
+    }
+
+    //keep a copy of the whole message, fragments are made from it as the window has room
+    Fragment = (FragmentOutStruct *)malloc(sizeof(FragmentOutStruct) + DataLen);
+    if(!Fragment)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::OutOfMemory;
+    }
+
+    Fragment->MessageID = this->FragmentMsgID++;
+    Fragment->Len = DataLen;
+    Fragment->Count = (DataLen + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE;
+    Fragment->Next = 0;
+    Fragment->Acked = 0;
+    Fragment->Handle = Handle;
+    memcpy(Fragment->Data, Data, DataLen);
+
+    DEBUG_WRITE("Sending ");
+    DEBUG_WRITE(Fragment->Count);
+    DEBUG_WRITE(" fragments to ");
+    DEBUG_WRITEMAC(Device->MAC);
+    DEBUG_WRITE("\n");
+
+    Device->FragmentOut = Fragment;
+    this->Stats.FragmentedSent++;
+    this->WindowFill(Device);
+    pthread_mutex_unlock(&this->WindowLock);
+
+    //if we are in reset mode then tell the other side we want to reconnect
+    if(Device->ConnectState == ConnectStateEnum::CS_Reset)
+    {
+        this->Connect(Device->MAC);
+        return MeshWriteErrors::ResettingConnection;
+    }
+
+    return 0;
+}
+
+int MeshNetworkInternal::WriteBroadcastFragments(const uint8_t *Data, unsigned short DataLen)
+{
+    BroadcastTXStruct *Entry;
+    FragmentHeaderStruct *Header;
+    unsigned short Len;
+    unsigned int Offset;
+    uint16_t MessageID;
+    uint8_t Index;
+    uint8_t Count;
+
+    //split the message up front, each fragment is encrypted as the resend thread gets to it
+    Count = (DataLen + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE;
+    Entry = (BroadcastTXStruct *)malloc(sizeof(BroadcastTXStruct) + (Count * FRAME_DATA_SIZE));
+    if(!Entry)
+        return MeshWriteErrors::OutOfMemory;
+
+    Entry->Next = 0;
+    Entry->Frame = 0;
+    Entry->Len = DataLen;
+    Entry->Count = Count;
+    Entry->Sent = 0;
+    MessageID = this->FragmentMsgID++;
+    for(Index = 0, Offset = 0; Index < Count; Index++, Offset += FRAGMENT_DATA_SIZE)
+    {
+        Len = DataLen - Offset;
+        if(Len > FRAGMENT_DATA_SIZE)
+            Len = FRAGMENT_DATA_SIZE;
+
+        Header = (FragmentHeaderStruct *)&Entry->Data[Index * FRAME_DATA_SIZE];
+        Header->MessageID = MessageID;
+        Header->Len = DataLen;
+        Header->Index = Index;
+        Header->Count = Count;
+        memcpy(&Header[1], &Data[Offset], Len);
+    }
+
+    //each fragment is a broadcast of it's own, reserve the IDs for all of them with one write to flash
+    pthread_mutex_lock(&this->BroadcastTXLock);
+    Entry->FirstID = this->BroadcastMsgID;
+    this->BroadcastMsgID += Count;
+    this->ReserveBroadcastIDs(0);
+    this->Stats.FragmentedSent++;
+
+    if(this->BroadcastTXTail)
+        this->BroadcastTXTail->Next = Entry;
+    else
+        this->BroadcastTXHead = Entry;
+    this->BroadcastTXTail = Entry;
+    pthread_mutex_unlock(&this->BroadcastTXLock);
+
+    xSemaphoreGive(this->TXSemaphore);
+    return 0;
+}
+
+int64_t MeshNetworkInternal::RunBroadcastTX(int64_t Now)
+{
+    BroadcastTXStruct *Entry;
+    TXFrameStruct *Frame;
+    unsigned short EncLen;
+    unsigned short Len;
+    int64_t NextTime;
+
+    //send what is due, fragments are spaced out a little so receivers can keep up. returns when the
+    //next fragment can go or 0 if nothing is waiting
+    pthread_mutex_lock(&this->BroadcastTXLock);
+    while((Entry = this->BroadcastTXHead) && (Now >= this->BroadcastTXTime))
+    {
+        if(!Entry->Count)
+        {
+            this->SendFrame(MSG_Message, this->BroadcastMAC, Entry->Frame, Entry->FrameLen);
+            this->ReleaseTXFrame(Entry->Frame);
+        }
+        else
+        {
+            //a fragment that can't be sent is dropped, the receivers time the message out
+            Len = FRAME_DATA_SIZE;
+            if(Entry->Sent == (Entry->Count - 1))
+                Len = sizeof(FragmentHeaderStruct) + Entry->Len - (Entry->Sent * FRAGMENT_DATA_SIZE);
+
+            Frame = this->GetTXFrame();
+            if(Frame)
+            {
+                EncLen = this->EncryptBroadcastPacket(Entry->FirstID + Entry->Sent, &Entry->Data[Entry->Sent * FRAME_DATA_SIZE], Len, Frame);
+                if(EncLen)
+                    this->SendFrame(MSG_Fragment, this->BroadcastMAC, Frame, EncLen);
+                this->ReleaseTXFrame(Frame);
+            }
+
+            Entry->Sent++;
+            this->BroadcastTXTime = Now + (FRAGMENT_BROADCAST_GAP_MS * 1000LL);
+            if(Entry->Sent < Entry->Count)
+                continue;
+        }
+
+        this->BroadcastTXHead = Entry->Next;
+        if(!this->BroadcastTXHead)
+            this->BroadcastTXTail = 0;
+        free(Entry);
+    }
+
+    NextTime = this->BroadcastTXHead ? this->BroadcastTXTime : 0;
+    pthread_mutex_unlock(&this->BroadcastTXLock);
+
+    return NextTime;
+}
+
+void MeshNetworkInternal::HandleFragment(KnownDeviceStruct *Device, const uint8_t *MAC, const uint8_t *Data, unsigned short DataLen, unsigned int SequenceID)
+{
+    const FragmentHeaderStruct *Header;
+    ReassemblyStruct *Entry;
+    uint8_t *Message;
+    unsigned short Len;
+    unsigned short Expected;
+    int64_t Now;
+    int i;
+
+    //Device is set for unicast fragments which arrive in order, broadcast fragments share a few buffers
+    //and SequenceID is the broadcast ID the fragment came in with
+    if(DataLen < sizeof(FragmentHeaderStruct))
+    {
+        this->Stats.ReassemblyDropped++;
+        return;
+    }
+
+    //make sure the fragment agrees with the message it claims to be part of
+    Header = (const FragmentHeaderStruct *)Data;
+    Len = DataLen - sizeof(FragmentHeaderStruct);
+    Expected = FRAGMENT_DATA_SIZE;
+    if(Header->Index == (Header->Count - 1))
+        Expected = Header->Len - (Header->Index * FRAGMENT_DATA_SIZE);
+    if((Header->Len > this->MaxMessageSize) || (Header->Count != ((Header->Len + FRAGMENT_DATA_SIZE - 1) / FRAGMENT_DATA_SIZE)) ||
+       (Header->Index >= Header->Count) || (Len != Expected))
+    {
+        this->Stats.ReassemblyDropped++;
+        return;
+    }
+
+    Now = esp_timer_get_time();
+    pthread_mutex_lock(&this->FragmentLock);
+    if(Device)
+    {
+        if(!Device->FragmentIn)
+            Device->FragmentIn = (ReassemblyStruct *)calloc(1, sizeof(ReassemblyStruct));
+        Entry = Device->FragmentIn;
+    }
+    else
+    {
+        //find the message, otherwise take a free buffer or one that timed out
+        Entry = 0;
+        for(i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+        {
+            if(this->BroadcastReassembly[i].Data && (this->BroadcastReassembly[i].MessageID == Header->MessageID) &&
+               (memcmp(this->BroadcastReassembly[i].MAC, MAC, MAC_SIZE) == 0))
+            {
+                Entry = &this->BroadcastReassembly[i];
+                break;
+            }
+
+            if(!Entry && (!this->BroadcastReassembly[i].Data || ((Now - this->BroadcastReassembly[i].Updated) > (FRAGMENT_TIMEOUT_MS * 1000LL))))
+                Entry = &this->BroadcastReassembly[i];
+        }
+    }
+
+    if(!Entry)
+    {
+        pthread_mutex_unlock(&this->FragmentLock);
+        this->Stats.ReassemblyDropped++;
+        return;
+    }
+
+    //a broadcast fragment has to use the ID it's index was given, BroadcastFragmentMissing depends on it
+    if(!Device && Entry->Data && (Entry->MessageID == Header->MessageID) && (Entry->Len == Header->Len) &&
+       !memcmp(Entry->MAC, MAC, MAC_SIZE) && ((SequenceID - Header->Index) != Entry->FirstID))
+    {
+        pthread_mutex_unlock(&this->FragmentLock);
+        this->Stats.ReassemblyDropped++;
+        return;
+    }
+
+    //start over if this is a new message, whatever was in the buffer is not going to be finished
+    if(!Entry->Data || (Entry->MessageID != Header->MessageID) || (Entry->Len != Header->Len) || memcmp(Entry->MAC, MAC, MAC_SIZE))
+    {
+        if(Entry->Data)
+        {
+            free(Entry->Data);
+            this->Stats.ReassemblyTimeouts++;
+        }
+
+        Entry->Data = (uint8_t *)malloc(Header->Len);
+        if(!Entry->Data)
+        {
+            pthread_mutex_unlock(&this->FragmentLock);
+            this->Stats.ReassemblyDropped++;
+            return;
+        }
+
+        memcpy(Entry->MAC, MAC, MAC_SIZE);
+        Entry->MessageID = Header->MessageID;
+        Entry->Len = Header->Len;
+        Entry->Count = Header->Count;
+        Entry->Received = 0;
+        Entry->FirstID = SequenceID - Header->Index;
+        memset(Entry->Have, 0, sizeof(Entry->Have));
+
+        //have the resend thread discard it if the rest doesn't show up
+        if(Device)
+            this->TimerSchedule(Device, Now + (FRAGMENT_TIMEOUT_MS * 1000LL));
+        else if(!this->ResendWake || ((Now + (FRAGMENT_TIMEOUT_MS * 1000LL)) < this->ResendWake))
+            xSemaphoreGive(this->TXSemaphore);
+    }
+
+    //copy it in if we don't have it yet
+    if(!(Entry->Have[Header->Index / 32] & (1u << (Header->Index % 32))))
+    {
+        memcpy(&Entry->Data[Header->Index * FRAGMENT_DATA_SIZE], &Data[sizeof(FragmentHeaderStruct)], Len);
+        Entry->Have[Header->Index / 32] |= (1u << (Header->Index % 32));
+        Entry->Received++;
+        Entry->Updated = Now;
+    }
+
+    //if complete take the message out of the buffer
+    Message = 0;
+    if(Entry->Received == Entry->Count)
+    {
+        Message = Entry->Data;
+        Len = Entry->Len;
+        Entry->Data = 0;
+        this->Stats.Reassembled++;
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
+
+    if(!Message)
+        return;
+
+    //alert the callback
+    if(Device && this->ReceiveMessageCallback)
+        this->ReceiveMessageCallback(MAC, Message, Len);
+    else if(!Device && this->BroadcastMessageCallback)
+        this->BroadcastMessageCallback(MAC, Message, Len);
+
+    free(Message);
+}
+
+int MeshNetworkInternal::BroadcastFragmentMissing(const uint8_t *MAC, unsigned int SequenceID)
+{
+    unsigned int Index;
+    int Ret;
+    int i;
+
+    //see if SequenceID belongs to a fragment of a broadcast being put back together that hasn't arrived yet
+    Ret = 0;
+    pthread_mutex_lock(&this->FragmentLock);
+    for(i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+    {
+        if(!this->BroadcastReassembly[i].Data || memcmp(this->BroadcastReassembly[i].MAC, MAC, MAC_SIZE))
+            continue;
+
+        Index = SequenceID - this->BroadcastReassembly[i].FirstID;
+        if((Index < this->BroadcastReassembly[i].Count) && !(this->BroadcastReassembly[i].Have[Index / 32] & (1u << (Index % 32))))
+        {
+            Ret = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
+
+    return Ret;
+}
+
+int64_t MeshNetworkInternal::ExpireFragments(int64_t Now)
+{
+    int64_t NextTime;
+    int64_t Expire;
+    int i;
+
+    //discard broadcasts that stopped getting fragments, the sender gave up or they were lost. fragmented
+    //messages from a device are checked with the device's resends. returns when the next one times out or 0
+    NextTime = 0;
+    pthread_mutex_lock(&this->FragmentLock);
+    for(i = 0; i < FRAGMENT_REASSEMBLY_SLOTS; i++)
+    {
+        if(!this->BroadcastReassembly[i].Data)
+            continue;
+
+        Expire = this->BroadcastReassembly[i].Updated + (FRAGMENT_TIMEOUT_MS * 1000LL);
+        if(Now >= Expire)
+        {
+            free(this->BroadcastReassembly[i].Data);
+            this->BroadcastReassembly[i].Data = 0;
+            this->Stats.ReassemblyTimeouts++;
+        }
+        else if(!NextTime || (Expire < NextTime))
+            NextTime = Expire;
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
+
+    return NextTime;
+}
@@ -6,50 +6,97 @@
 #include <stdio.h>
 #include <string.h>
 
-pthread_mutex_t mesh_message_lock;
-
 void *Static_ProcessRXMessages(void *)
 {
-    pthread_mutex_init(&mesh_message_lock, NULL);
     if(_GlobalMesh)
         _GlobalMesh->ProcessRXMessages();
 
     return 0;
 }
 
+int MeshNetworkInternal::RXQueueEmpty(int Class)
+{
+    return this->RXQueues[Class].Tail == __atomic_load_n(&this->RXQueues[Class].Head, __ATOMIC_ACQUIRE);
+}
+
 void MeshNetworkInternal::ProcessRXMessages()
 {
-    MeshMessageStruct *CurMessage;
+    RXQueueStruct *Queue;
+    RXSlotStruct *Slot;
+    unsigned int Count;
+    int64_t Wait;
+    int64_t Latency;
+    int Bucket;
+    int Class;
 
     while(1)
     {
-        //if no beginning message then wait
-        if(!this->MeshMessageBegin)
+        //hand messages that came in order out of a send window to the app
+        if(this->WindowDeliverHead)
+            this->WindowDeliverQueued();
+
+        //control frames go first so handshakes and acks are not stuck behind a burst of broadcasts,
+        //then unicast gets RX_UNICAST_WEIGHT frames for each broadcast frame so neither starves
+        if(!this->RXQueueEmpty(RXClassControl))
+            Class = RXClassControl;
+        else if(!this->RXQueueEmpty(RXClassUnicast) &&
+                (this->RXUnicastCredit || this->RXQueueEmpty(RXClassBroadcast)))
         {
-            yield();
-            delay(500);
+            Class = RXClassUnicast;
+            if(this->RXUnicastCredit)
+                this->RXUnicastCredit--;
+        }
+        else if(!this->RXQueueEmpty(RXClassBroadcast))
+        {
+            Class = RXClassBroadcast;
+            this->RXUnicastCredit = RX_UNICAST_WEIGHT;
+        }
+        else
+        {
+            //sleep until a frame is added, the semaphore stays given if one showed up after the check
+            xSemaphoreTake(this->RXSemaphore, portMAX_DELAY);
             continue;
         }
 
-        //we have a beginning message, pull it off for processing
-        pthread_mutex_lock(&mesh_message_lock);
+        //take the frame, any repeats from now on are queued as new frames
+        Queue = &this->RXQueues[Class];
+        Slot = &Queue->Ring[Queue->Tail & (Queue->Slots - 1)];
+        Count = __atomic_exchange_n(&Slot->Count, RX_SLOT_TAKEN, __ATOMIC_ACQ_REL);
+
+        //evicted by the wifi callback, or the slot was reused for a newer frame that was already handled
+        //from here as the callback writes into the slot of the frame it evicts
+        if(Count & RX_SLOT_TAKEN)
+        {
+            __atomic_store_n(&Queue->Tail, Queue->Tail + 1, __ATOMIC_RELEASE);
+            continue;
+        }
 
-        CurMessage = this->MeshMessageBegin;
-        this->MeshMessageBegin = CurMessage->next;
+        //too old to be of use, the other side has given up or resent by now
+        Wait = esp_timer_get_time() - Slot->Queued;
+        if(Wait > this->RXMaxAge)
+        {
+            this->Stats.RXExpired++;
+            __atomic_store_n(&Queue->Tail, Queue->Tail + 1, __ATOMIC_RELEASE);
+            continue;
+        }
 
-        //if we are the tail then wipe it out
-        if(this->MeshMessageTail == CurMessage)
-            this->MeshMessageTail = 0;
+        this->Stats.RXClassFrames[Class]++;
+        this->Stats.RXClassWait[Class] += Wait;
+        if(Wait > this->Stats.RXClassMaxWait[Class])
+            this->Stats.RXClassMaxWait[Class] = Wait;
 
-        //unlock as we are done
-        pthread_mutex_unlock(&mesh_message_lock);
+        Latency = Wait >> 6;
+        for(Bucket = 0; (Bucket < (MESH_RX_LATENCY_BUCKETS - 1)) && Latency; Bucket++)
+            Latency >>= 1;
+        this->Stats.RXLatency[Bucket]++;
 
-        //now process the message
-        this->HandleRXMessage(CurMessage->Message, CurMessage->Len, CurMessage->Count);
-        free(CurMessage);
+        //now process the message then hand the slot back to the callback
+        this->HandleRXMessage(Slot->Message, Slot->Len, Count);
+        __atomic_store_n(&Queue->Tail, Queue->Tail + 1, __ATOMIC_RELEASE);
 
-        //yield before trying another message
-        yield();
+        //yield once per round
+        if(Class == RXClassBroadcast)
+            yield();
     }
 }
 
@@ -63,12 +110,41 @@ void Promiscuous_RX(void *buf, wifi_promiscuous_pkt_type_t type)
 void MeshNetworkInternal::PromiscuousRX(void *buf, wifi_promiscuous_pkt_type_t type)
 {
     wifi_promiscuous_pkt_t *packet = (wifi_promiscuous_pkt_t *)buf;
-    uint8_t *Payload = (uint8_t *)packet->payload;
-    WifiHeaderStruct *WifiHeader = (WifiHeaderStruct *)Payload;
-    MeshMessageStruct *CurMessage;
 
     //message length - header - crc
-    uint16_t PayloadLen = packet->rx_ctrl.sig_len - 4;
+    if(packet->rx_ctrl.sig_len < 4)
+        return;
+
+    //ProcessFrame may be adding a frame, never wait in the wifi callback
+    if(__atomic_test_and_set(&this->RXProducerBusy, __ATOMIC_ACQUIRE))
+    {
+        this->Stats.RXBusy++;
+        return;
+    }
+
+    this->AddRXFrame((const uint8_t *)packet->payload, packet->rx_ctrl.sig_len - 4);
+    __atomic_clear(&this->RXProducerBusy, __ATOMIC_RELEASE);
+}
+
+//single producer side of the rx ring, no locks or allocations as this runs in the wifi callback. Payload
+//is the 802.11 frame without the crc
+void MeshNetworkInternal::AddRXFrame(const uint8_t *Payload, uint16_t PayloadLen)
+{
+    const WifiHeaderStruct *WifiHeader = (const WifiHeaderStruct *)Payload;
+    RXQueueStruct *Queue;
+    RXSlotStruct *Slot;
+    RXDedupStruct *DedupSet;
+    RXDedupStruct *DedupFree;
+    unsigned int SequenceID;
+    unsigned int Head;
+    unsigned int Oldest;
+    unsigned int Count;
+    int Way;
+    int Ways;
+    int Class;
+
+    if(PayloadLen < sizeof(WifiHeaderStruct))
+        return;
 
     //if not action frame then return
     if(WifiHeader->FC != 0x00d0)
@@ -78,48 +154,333 @@ void MeshNetworkInternal::PromiscuousRX(void *buf, wifi_promiscuous_pkt_type_t t
     if((WifiHeader->Type & 0xF0) != 0x60)
         return;
 
-    //probably a message we want to handle, add it to the list
-    pthread_mutex_lock(&mesh_message_lock);
+    //pick the queue, frames between other devices are never handled so don't queue them
+    if(memcmp(WifiHeader->MAC_Reciever, this->BroadcastMAC, MAC_SIZE) == 0)
+        Class = ((WifiHeader->Type == MSG_Message) || (WifiHeader->Type == MSG_Fragment)) ? RXClassBroadcast : RXClassControl;
+    else if(memcmp(WifiHeader->MAC_Reciever, this->MAC, MAC_SIZE) == 0)
+        Class = ((WifiHeader->Type == MSG_Message) || (WifiHeader->Type == MSG_Fragment) || (WifiHeader->Type == MSG_Coalesced)) ? RXClassUnicast : RXClassControl;
+    else
+        return;
+    Queue = &this->RXQueues[Class];
+
+    //the header is the same for every message of a type from a sender so the sequence ID from the packet
+    //tells them apart, handshake messages have no ID but the start of the challenge is just as unique
+    SequenceID = 0;
+    if(PayloadLen >= (sizeof(WifiHeaderStruct) + sizeof(PacketHeaderStruct)))
+        SequenceID = ((PacketHeaderStruct *)&Payload[sizeof(WifiHeaderStruct)])->SequenceID;
 
-    //scan the list for an identical message, if the same sender and sequence id then increment count
-    CurMessage = this->MeshMessageBegin;
-    while(CurMessage)
+    //drop copies of broadcasts that were already handled
+    if((Class == RXClassBroadcast) && (PayloadLen >= (sizeof(WifiHeaderStruct) + sizeof(PacketHeaderStruct))) &&
+       this->SeenCacheCheck(WifiHeader->MAC_Sender, SequenceID))
     {
-        //if the header matches then assume it is the same message and increment the count
-        if(memcmp(CurMessage->Message, WifiHeader, sizeof(WifiHeaderStruct)) == 0)
+        this->Stats.RXSeen++;
+        return;
+    }
+
+    DedupSet = this->RXDedup[this->CalculateCRC(&SequenceID, sizeof(SequenceID), this->CalculateCRC(WifiHeader->MAC_Sender, MAC_SIZE, WifiHeader->Type)) & (RX_DEDUP_SETS - 1)];
+
+    //selective acks have no sequence ID and each one has more than the last so they are never repeats
+    Ways = (WifiHeader->Type == MSG_MessageSAck) ? 0 : RX_DEDUP_WAYS;
+
+    //if the same message is still queued then increment it's count
+    DedupFree = 0;
+    for(Way = 0; Way < Ways; Way++)
+    {
+        //entries for slots that have been written over since are free
+        if(DedupSet[Way].Valid && ((this->RXQueues[DedupSet[Way].Class].Head - DedupSet[Way].Position) > this->RXQueues[DedupSet[Way].Class].Slots))
+            DedupSet[Way].Valid = 0;
+
+        if(!DedupSet[Way].Valid)
         {
-            CurMessage->Count++;
+            if(!DedupFree)
+                DedupFree = &DedupSet[Way];
+            continue;
+        }
 
-            //unlock as we are done
-            pthread_mutex_unlock(&mesh_message_lock);
+        if((DedupSet[Way].SequenceID == SequenceID) && (DedupSet[Way].Type == WifiHeader->Type) &&
+           (DedupSet[Way].Class == Class) && (memcmp(DedupSet[Way].MAC, WifiHeader->MAC_Sender, MAC_SIZE) == 0))
+        {
+            //only count it if the rx thread has not taken the frame yet
+            Slot = &Queue->Ring[DedupSet[Way].Position & (Queue->Slots - 1)];
+            Count = __atomic_load_n(&Slot->Count, __ATOMIC_RELAXED);
+            while(!(Count & RX_SLOT_TAKEN))
+            {
+                if(__atomic_compare_exchange_n(&Slot->Count, &Count, Count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    this->Stats.RXRepeats++;
+                    return;
+                }
+            }
+
+            //already being handled, reuse the entry for the new copy
+            DedupSet[Way].Valid = 0;
+            if(!DedupFree)
+                DedupFree = &DedupSet[Way];
+        }
+    }
+
+    if(PayloadLen > MAX_PACKET_SIZE)
+    {
+        this->Stats.RXTooLarge++;
+        return;
+    }
+
+    //make sure the rx thread is done with the slot, frames we evicted the rx thread has not passed
+    //yet are gone already
+    Head = Queue->Head;
+    Oldest = __atomic_load_n(&Queue->Tail, __ATOMIC_ACQUIRE);
+    if((int)(Queue->Evicted - Oldest) > 0)
+        Oldest = Queue->Evicted;
+    __atomic_store_n(&Queue->Evicted, Oldest, __ATOMIC_RELAXED);
+    Count = Head - Oldest;
+    Slot = &Queue->Ring[Head & (Queue->Slots - 1)];
+    if(Count >= Queue->Slots)
+    {
+        if((Class != RXClassBroadcast) || (this->RXDropPolicy != RXDropOldestBroadcast))
+        {
+            this->Stats.RXQueueFull++;
+            return;
+        }
+
+        //take the oldest broadcast away from the rx thread, the new frame goes in it's slot. if the rx
+        //thread is handling it right now then there is no room
+        Count = __atomic_load_n(&Slot->Count, __ATOMIC_RELAXED);
+        while(!(Count & RX_SLOT_TAKEN) &&
+              !__atomic_compare_exchange_n(&Slot->Count, &Count, RX_SLOT_TAKEN, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            ;
+        if(Count & RX_SLOT_TAKEN)
+        {
+            this->Stats.RXQueueFull++;
             return;
         }
 
-        //next message
-        CurMessage = CurMessage->next;
+        __atomic_store_n(&Queue->Evicted, Oldest + 1, __ATOMIC_RELAXED);
+        this->Stats.RXDroppedOldest++;
+        Count = Queue->Slots - 1;
+    }
+
+    if((Count + 1) > this->Stats.RXClassMaxDepth[Class])
+        this->Stats.RXClassMaxDepth[Class] = Count + 1;
+
+    //the rx thread may reach an evicted slot before Head moves, it stays taken until the frame is in
+    Slot->Len = PayloadLen;
+    Slot->Queued = esp_timer_get_time();
+    memcpy(Slot->Message, Payload, PayloadLen);
+    __atomic_store_n(&Slot->Count, 0, __ATOMIC_RELEASE);
+
+    //if the set is full then repeats of this one are queued separately
+    if(DedupFree)
+    {
+        memcpy(DedupFree->MAC, WifiHeader->MAC_Sender, MAC_SIZE);
+        DedupFree->Type = WifiHeader->Type;
+        DedupFree->Class = Class;
+        DedupFree->SequenceID = SequenceID;
+        DedupFree->Position = Head;
+        DedupFree->Valid = 1;
+    }
+
+    //hand it to the rx thread
+    this->Stats.RXFrames++;
+    __atomic_store_n(&Queue->Head, Head + 1, __ATOMIC_RELEASE);
+    xSemaphoreGive(this->RXSemaphore);
+}
+
+//fingerprints and buckets for the seen cache come from one 32 bit mix of the sender and sequence ID,
+//the alternate bucket only depends on the current bucket and the fingerprint so entries can be moved
+static unsigned int SeenCacheHash(const uint8_t *MAC, unsigned int SequenceID)
+{
+    unsigned int Hash;
+
+    Hash = SequenceID * 0x9e3779b1;
+    Hash ^= MAC[0] | (MAC[1] << 8) | (MAC[2] << 16) | (MAC[3] << 24);
+    Hash *= 0x85ebca6b;
+    Hash ^= Hash >> 13;
+    Hash ^= MAC[4] | (MAC[5] << 8);
+    Hash *= 0xc2b2ae35;
+    Hash ^= Hash >> 16;
+    return Hash;
+}
+
+static inline unsigned int SeenCacheFingerprint(unsigned int Hash)
+{
+    //0 marks an empty entry
+    Hash >>= 10;
+    return Hash ? Hash : 1;
+}
+
+static inline unsigned int SeenCacheAltBucket(unsigned int Bucket, unsigned int Fingerprint)
+{
+    return (Bucket ^ ((Fingerprint * 0x5bd1e995) >> 16)) & (SEEN_CACHE_BUCKETS - 1);
+}
+
+unsigned int MeshNetworkInternal::SeenCacheEpoch()
+{
+    //about a second per epoch, entries only keep the low 6 bits
+    return (unsigned int)(esp_timer_get_time() >> 20);
+}
+
+static inline int SeenCacheLive(unsigned int Entry, unsigned int Epoch)
+{
+    return Entry && (((Epoch - SEEN_ENTRY_EPOCH(Entry)) & 0x3f) < SEEN_CACHE_EPOCHS);
+}
+
+//only called from the rx thread, clears entries that expired since the last sweep
+void MeshNetworkInternal::SeenCacheSweep(unsigned int Epoch)
+{
+    unsigned int Entry;
+    int Bucket;
+    int Way;
+
+    if(Epoch == this->SeenCacheSwept)
+        return;
+
+    //if it has been long enough everything expired, the wifi callback may be bumping a count
+    //on an entry so only clear it if it didn't change
+    for(Bucket = 0; Bucket < SEEN_CACHE_BUCKETS; Bucket++)
+    {
+        for(Way = 0; Way < SEEN_CACHE_WAYS; Way++)
+        {
+            Entry = __atomic_load_n(&this->SeenCache[Bucket][Way], __ATOMIC_RELAXED);
+            if(Entry && (((Epoch - this->SeenCacheSwept) >= SEEN_CACHE_EPOCHS) || !SeenCacheLive(Entry, Epoch)))
+                __atomic_compare_exchange_n(&this->SeenCache[Bucket][Way], &Entry, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+
+    this->SeenCacheSwept = Epoch;
+}
+
+unsigned int *MeshNetworkInternal::SeenCacheFind(const uint8_t *MAC, unsigned int SequenceID, unsigned int Epoch)
+{
+    unsigned int Hash;
+    unsigned int Fingerprint;
+    unsigned int Bucket;
+    unsigned int Entry;
+    int Pass;
+    int Way;
+
+    //if the rx thread hasn't swept in a while the epochs left in the entries may have wrapped
+    if((Epoch - this->SeenCacheSwept) >= (0x40 - SEEN_CACHE_EPOCHS))
+        return 0;
+
+    Hash = SeenCacheHash(MAC, SequenceID);
+    Fingerprint = SeenCacheFingerprint(Hash);
+    Bucket = Hash & (SEEN_CACHE_BUCKETS - 1);
+    for(Pass = 0; Pass < 2; Pass++)
+    {
+        for(Way = 0; Way < SEEN_CACHE_WAYS; Way++)
+        {
+            Entry = __atomic_load_n(&this->SeenCache[Bucket][Way], __ATOMIC_RELAXED);
+            if(SeenCacheLive(Entry, Epoch) && (SEEN_ENTRY_FINGERPRINT(Entry) == Fingerprint))
+                return &this->SeenCache[Bucket][Way];
+        }
+        Bucket = SeenCacheAltBucket(Bucket, Fingerprint);
     }
 
-    //no current message, create it
-    CurMessage = (MeshMessageStruct *)malloc(sizeof(MeshMessageStruct) + PayloadLen);
-    if(CurMessage)
+    return 0;
+}
+
+//called from the wifi callback, returns 1 and counts the copy if the broadcast was already handled
+int MeshNetworkInternal::SeenCacheCheck(const uint8_t *MAC, unsigned int SequenceID)
+{
+    unsigned int *Slot;
+    unsigned int Entry;
+
+    Slot = this->SeenCacheFind(MAC, SequenceID, this->SeenCacheEpoch());
+    if(!Slot)
+        return 0;
+
+    //the rx thread may move the entry while we count, losing a count only means an extra rebroadcast
+    Entry = __atomic_load_n(Slot, __ATOMIC_RELAXED);
+    while(Entry && (SEEN_ENTRY_COPIES(Entry) < 0x0f))
     {
-        CurMessage->next = 0;
-        CurMessage->Count = 0;
-        CurMessage->Len = PayloadLen;
-        memcpy(CurMessage->Message, Payload, PayloadLen);
-
-        //add it to the end
-        if(this->MeshMessageTail)
-            this->MeshMessageTail->next = CurMessage;
-        this->MeshMessageTail = CurMessage;
-
-        //if no beginning then set it
-        if(!this->MeshMessageBegin)
-            this->MeshMessageBegin = CurMessage;
+        if(__atomic_compare_exchange_n(Slot, &Entry, Entry + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
     }
 
-    //unlock as we are done
-    pthread_mutex_unlock(&mesh_message_lock);
+    return 1;
+}
+
+//only called from the rx thread, adds copies to an existing entry or inserts a new one
+void MeshNetworkInternal::SeenCacheAdd(const uint8_t *MAC, unsigned int SequenceID, unsigned int Copies)
+{
+    unsigned int *Slot;
+    unsigned int Entry;
+    unsigned int NewEntry;
+    unsigned int Epoch;
+    unsigned int Hash;
+    unsigned int Fingerprint;
+    unsigned int Bucket;
+    int Pass;
+    int Way;
+    int Kick;
+
+    Epoch = this->SeenCacheEpoch();
+    this->SeenCacheSweep(Epoch);
+    if(Copies > 0x0f)
+        Copies = 0x0f;
+
+    Slot = this->SeenCacheFind(MAC, SequenceID, Epoch);
+    if(Slot)
+    {
+        Entry = __atomic_load_n(Slot, __ATOMIC_RELAXED);
+        do
+        {
+            NewEntry = SEEN_ENTRY_COPIES(Entry) + Copies;
+            NewEntry = (Entry & ~0x0f) | ((NewEntry > 0x0f) ? 0x0f : NewEntry);
+        } while(!__atomic_compare_exchange_n(Slot, &Entry, NewEntry, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        return;
+    }
+
+    Hash = SeenCacheHash(MAC, SequenceID);
+    Fingerprint = SeenCacheFingerprint(Hash);
+    Bucket = Hash & (SEEN_CACHE_BUCKETS - 1);
+    NewEntry = SEEN_ENTRY(Fingerprint, Epoch, Copies);
+
+    //use an empty or expired entry in either bucket
+    for(Pass = 0; Pass < 2; Pass++)
+    {
+        for(Way = 0; Way < SEEN_CACHE_WAYS; Way++)
+        {
+            if(!SeenCacheLive(__atomic_load_n(&this->SeenCache[Bucket][Way], __ATOMIC_RELAXED), Epoch))
+            {
+                __atomic_store_n(&this->SeenCache[Bucket][Way], NewEntry, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+        Bucket = SeenCacheAltBucket(Bucket, Fingerprint);
+    }
+
+    //both full, push entries to their other bucket. if we run out of kicks the last one moved is dropped,
+    //it is only a missed early drop and the sequence ID check still catches the copy
+    for(Kick = 0; Kick < SEEN_CACHE_KICKS; Kick++)
+    {
+        Way = esp_random() % SEEN_CACHE_WAYS;
+        NewEntry = __atomic_exchange_n(&this->SeenCache[Bucket][Way], NewEntry, __ATOMIC_RELAXED);
+        if(!SeenCacheLive(NewEntry, Epoch))
+            return;
+
+        Bucket = SeenCacheAltBucket(Bucket, SEEN_ENTRY_FINGERPRINT(NewEntry));
+        for(Way = 0; Way < SEEN_CACHE_WAYS; Way++)
+        {
+            if(!SeenCacheLive(__atomic_load_n(&this->SeenCache[Bucket][Way], __ATOMIC_RELAXED), Epoch))
+            {
+                __atomic_store_n(&this->SeenCache[Bucket][Way], NewEntry, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+    }
+}
+
+//copies of a broadcast seen since it was handled
+unsigned int MeshNetworkInternal::SeenCacheCopies(const uint8_t *MAC, unsigned int SequenceID)
+{
+    unsigned int *Slot;
+
+    Slot = this->SeenCacheFind(MAC, SequenceID, this->SeenCacheEpoch());
+    if(!Slot)
+        return 0;
+
+    return SEEN_ENTRY_COPIES(__atomic_load_n(Slot, __ATOMIC_RELAXED));
 }
 
 void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t Count)
@@ -131,7 +492,8 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
     unsigned short DecryptedMessageLen;
     int BroadcastMsg;
     unsigned int AckID;
-    uint8_t *EncData;
+    unsigned int SequenceID;
+    TXFrameStruct *Frame;
     unsigned short EncLen;
 
     WifiHeaderStruct *WifiHeader = (WifiHeaderStruct *)Data;
@@ -196,9 +558,13 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
             break;
 
         case MSG_Message:
+        case MSG_Fragment:
+        case MSG_Coalesced:
             if(BroadcastMsg)
             {
-                //broadcast message
+                //broadcast message, several messages are only put together for a single device
+                if(WifiHeader->Type == MSG_Coalesced)
+                    return;
 
                 //see if we know of the device
                 NewDevice = 0;
@@ -209,20 +575,28 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                     UnknownDevice = (UnknownDeviceStruct *)malloc(sizeof(UnknownDeviceStruct));
                     memcpy(UnknownDevice->MAC, &WifiHeader->MAC_Sender, MAC_SIZE);
                     UnknownDevice->ID = 0;
+                    UnknownDevice->MACCRC = this->CalculateBroadcastMACCRC(UnknownDevice->MAC);
                     NewDevice = 1;
                 }
                 else
                 {
-                    //if the ID is below our current one then ignore it
-                    if(((PacketHeaderStruct *)Payload)->SequenceID <= UnknownDevice->ID)
+                    //if the ID is below our current one then ignore it, remember it so further copies
+                    //are dropped before being queued. a fragment that was lost the first time can still
+                    //fill a gap in a message being put back together
+                    SequenceID = ((PacketHeaderStruct *)Payload)->SequenceID;
+                    if((SequenceID <= UnknownDevice->ID) &&
+                       ((WifiHeader->Type != MSG_Fragment) || !this->BroadcastFragmentMissing(UnknownDevice->MAC, SequenceID)))
+                    {
+                        this->SeenCacheAdd(UnknownDevice->MAC, SequenceID, Count + 1);
                         return;
+                    }
                 }
 
                 //in theory we would wrap around at 0 however that requires 4 billion messages during the conference
                 //or 12 messages/msec for 4 days straight
 
                 //decrypt the message
-                DecryptedMessage = this->DecryptBroadcastPacket(UnknownDevice, Payload, PayloadLen, &DecryptedMessageLen);
+                DecryptedMessage = this->DecryptBroadcastPacket(UnknownDevice, WifiHeader, Payload, PayloadLen, &DecryptedMessageLen);
                 if(!DecryptedMessage)
                 {
                     if(NewDevice)
@@ -230,24 +604,24 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                     return;
                 }
 
-                //store off the ID we found as everything decrypted properly
-                UnknownDevice->ID = ((PacketHeaderStruct *)Payload)->SequenceID;
+                //store off the ID we found as everything decrypted properly, a late fragment leaves it alone
+                SequenceID = ((PacketHeaderStruct *)Payload)->SequenceID;
+                if(NewDevice || (SequenceID > UnknownDevice->ID))
+                    UnknownDevice->ID = SequenceID;
+                this->SeenCacheAdd(UnknownDevice->MAC, SequenceID, 0);
 
                 //if a new device add it to our known list
                 if(NewDevice)
                     this->InsertUnknownDevice(UnknownDevice);
 
-                //all good, first rebroadcast this packet for others to see if we haven't seen enough copies
-                if((Count < 3) && this->BroadcastFlag)
-                {
-                    //delay a random amount of time so we don't flood the wifi
-                    delay((esp_random() & 0xff) + 1);   //0 to 265ms delay
-                    yield();
-                    esp_wifi_80211_tx(WIFI_IF_STA, Data, DataLen, 0);
-                }
+                //all good, queue a rebroadcast of this packet for others to see if we haven't seen enough copies
+                if((Count < REBROADCAST_COPIES) && this->BroadcastFlag)
+                    this->ScheduleRebroadcast(Data, DataLen, UnknownDevice->MAC, SequenceID, Count);
 
-                //alert the callback
-                if(this->BroadcastMessageCallback)
+                //alert the callback, fragments only once the whole message is here
+                if(WifiHeader->Type == MSG_Fragment)
+                    this->HandleFragment(0, UnknownDevice->MAC, DecryptedMessage, DecryptedMessageLen, SequenceID);
+                else if(this->BroadcastMessageCallback)
                     this->BroadcastMessageCallback(UnknownDevice->MAC, DecryptedMessage, DecryptedMessageLen);
 
                 //free and continue
@@ -270,11 +644,22 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                 else if(KnownDevice->ConnectState == ConnectStateEnum::CS_ResetConnecting)
                     return;     //not ready yet, still connecting
 
+                //with a send window messages can arrive out of order
+                if(KnownDevice->Window > 1)
+                {
+                    this->WindowReceive(KnownDevice, WifiHeader, Payload, PayloadLen);
+                    break;
+                }
+
+                //fragments and coalesced messages are only sent through a send window
+                if(WifiHeader->Type != MSG_Message)
+                    return;
+
                 //in theory we would wrap around at 0 however that requires 4 billion messages during the conference
                 //or 12 messages/msec for 4 days straight
 
                 //decrypt the message
-                DecryptedMessage = this->DecryptPacket(KnownDevice, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
+                DecryptedMessage = this->DecryptPacket(KnownDevice, WifiHeader, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
 
                 DEBUG_WRITE("Message decrypt results: Ack ");
                 DEBUG_WRITE(AckID);
@@ -325,20 +710,35 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
             if(*(unsigned int *)Payload == KnownDevice->ID_Out - 1)
             {
                 //if we have a known message then remove it and reset our length
-                if(KnownDevice->LastOutMessage)
+                if(KnownDevice->LastOutMessage || KnownDevice->LastOutFrame)
                 {
-                    free(KnownDevice->LastOutMessage);
-                    KnownDevice->LastOutMessage = 0;
-                    KnownDevice->LastOutMessageLen = 0;
-                    KnownDevice->LastOutMessageCheck = 0;
-
-                    //alert the calling app to the message being received
-                    if(this->ReceiveMessageCallback)
-                        this->ReceiveMessageCallback(KnownDevice->MAC, 0, 0);
+                    //time the round trip if it was only sent once
+                    if(!KnownDevice->LastOutMessageResent)
+                        this->UpdateRTT(KnownDevice, esp_timer_get_time() - KnownDevice->LastOutMessageSent);
+
+                    this->LastOutFree(KnownDevice);
+
+                    //alert the calling app to the message being received then send anything queued
+                    this->SendDone(KnownDevice, KnownDevice->LastOutMessageHandle, 1);
+                    this->AsyncDrain(KnownDevice);
                 }
             }
             break;
 
+        case MSG_MessageSAck:
+            //if a broadcast message then ignore
+            if(BroadcastMsg)
+                return;
+
+            //see if we know of the device and it is using a send window
+            NewDevice = 0;
+            KnownDevice = this->FindKnownDevice(WifiHeader->MAC_Sender);
+            if(!KnownDevice || (KnownDevice->Window < 2))
+                return;
+
+            this->WindowAck(KnownDevice, Payload, PayloadLen);
+            break;
+
         case MSG_Ping:
             //if not a broadcast message then ignore
             if(!BroadcastMsg)
@@ -346,9 +746,14 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
 
             //respond back with an ack directly to the requestor
             //while returning our nickname
-            EncData = this->EncryptBroadcastPacket(this->PingData, this->PingDataLen, &EncLen);
-            this->SendPayload(MSG_PingAck, WifiHeader->MAC_Sender, EncData, EncLen);
-            free(EncData);
+            Frame = this->GetTXFrame();
+            if(!Frame)
+                return;
+
+            EncLen = this->EncryptBroadcastPacket(this->PingData, this->PingDataLen, Frame);
+            if(EncLen)
+                this->SendFrame(MSG_PingAck, WifiHeader->MAC_Sender, Frame, EncLen);
+            this->ReleaseTXFrame(Frame);
             break;
 
         case MSG_PingAck:
@@ -367,6 +772,7 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                 UnknownDevice = (UnknownDeviceStruct *)malloc(sizeof(UnknownDeviceStruct));
                 memcpy(UnknownDevice->MAC, &WifiHeader->MAC_Sender, MAC_SIZE);
                 UnknownDevice->ID = 0;
+                UnknownDevice->MACCRC = this->CalculateBroadcastMACCRC(UnknownDevice->MAC);
                 NewDevice = 1;
             }
             else
@@ -376,7 +782,7 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                     return;
             }
 
-            DecryptedMessage = this->DecryptBroadcastPacket(UnknownDevice, Payload, PayloadLen, &DecryptedMessageLen);
+            DecryptedMessage = this->DecryptBroadcastPacket(UnknownDevice, WifiHeader, Payload, PayloadLen, &DecryptedMessageLen);
             if(!DecryptedMessage)
             {
                 if(NewDevice)
@@ -413,7 +819,7 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
             //or 12 messages/msec for 4 days straight
 
             //decrypt the message
-            DecryptedMessage = this->DecryptPacket(KnownDevice, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
+            DecryptedMessage = this->DecryptPacket(KnownDevice, WifiHeader, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
 
             DEBUG_WRITE("Message decrypt results: Ack ");
             DEBUG_WRITE(AckID);
@@ -438,11 +844,24 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                 //set the ack ID to respond to
                 AckID = KnownDevice->ID_In - 1;
 
-                free(DecryptedMessage);
-
                 //send an ack for this message
-                DecryptedMessage = this->EncryptPacket(KnownDevice, (uint8_t *)&AckID, sizeof(AckID), &DecryptedMessageLen);
-                this->SendPayload(MSG_DisconnectAck, KnownDevice->MAC, DecryptedMessage, DecryptedMessageLen);
+                Frame = this->GetTXFrame();
+                if(Frame)
+                {
+                    EncLen = this->EncryptPacket(KnownDevice, (uint8_t *)&AckID, sizeof(AckID), Frame);
+                    if(EncLen)
+                        this->SendFrame(MSG_DisconnectAck, KnownDevice->MAC, Frame, EncLen);
+                    this->ReleaseTXFrame(Frame);
+                }
+            }
+
+            //anything the other side sent before disconnecting goes to the app first, it may remove the device
+            this->WindowDeliverQueued();
+            KnownDevice = this->FindKnownDevice(WifiHeader->MAC_Sender);
+            if(!KnownDevice)
+            {
+                free(DecryptedMessage);
+                return;
             }
 
             //alert the callback
@@ -474,7 +893,7 @@ void MeshNetworkInternal::HandleRXMessage(uint8_t *Data, size_t DataLen, size_t
                 return;
 
             //decrypt the message
-            DecryptedMessage = this->DecryptPacket(KnownDevice, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
+            DecryptedMessage = this->DecryptPacket(KnownDevice, WifiHeader, Payload, PayloadLen, &DecryptedMessageLen, &AckID);
             if(!DecryptedMessage)
                 return;
 
@@ -18,94 +18,218 @@ void MeshNetworkInternal::Ping()
 int MeshNetworkInternal::Write(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen)
 {
     int Ret;
-    uint8_t *EncData;
+    TXFrameStruct *Frame;
+    BroadcastTXStruct *Entry;
     unsigned short EncLen;
     KnownDeviceStruct *Device;
-    int BroadcastMsg = 0;
 
     if(!this->Initialized)
         return MeshWriteErrors::MeshNotInitialized;
 
-    if((DataLen + sizeof(PacketHeaderStruct)) > MAX_PACKET_SIZE)
+    //messages larger than a frame are split into fragments, up to MaxMessageSize
+    if(DataLen > this->MaxMessageSize)
         return MeshWriteErrors::DataTooLarge;
 
-    //encrypt the data with the proper LFSR then send it along
-    if(memcmp(MAC, this->BroadcastMAC, MAC_SIZE) == 0)
-    {
-        DEBUG_WRITELN("Sending broadcast message");
-        EncData = this->EncryptBroadcastPacket(Data, DataLen, &EncLen);
-
-        //if no valid data then fail
-        if(!EncData)
-            return MeshWriteErrors::DataTooLarge;
-
-        BroadcastMsg = 1;
-    }
-    else
+    //look up and encrypt with the proper device
+    if(memcmp(MAC, this->BroadcastMAC, MAC_SIZE) != 0)
     {
-        //look up and encrypt with the proper device
         Device = this->FindKnownDevice(MAC);
         if(!Device)
             return MeshWriteErrors::DeviceDoesNotExist;
 
-        //if we have an outstanding message then error
-        if(Device->LastOutMessage)
-            return MeshWriteErrors::PreviousWriteNotComplete;
+        return this->WriteDevice(Device, Data, DataLen, 0);
+    }
 
-        DEBUG_WRITE("Sending data to ");
-        DEBUG_WRITEMAC(MAC);
-        DEBUG_WRITE("\n");
+    //encrypt the data with the proper LFSR then send it along
+    DEBUG_WRITELN("Sending broadcast message");
+    if(DataLen > FRAME_DATA_SIZE)
+        return this->WriteBroadcastFragments(Data, DataLen);
 
-        //store it off in-case we need to re-transmit
-        Device->LastOutMessage = (uint8_t *)malloc(DataLen);
-        if(!Device->LastOutMessage)
-            return MeshWriteErrors::OutOfMemory;
-        memcpy(Device->LastOutMessage, Data, DataLen);
-        Device->LastOutMessageLen = DataLen;
-        Device->LastOutMessageCheck = 0;
+    Frame = this->GetTXFrame();
+    if(!Frame)
+        return MeshWriteErrors::OutOfMemory;
+
+    pthread_mutex_lock(&this->BroadcastTXLock);
+    EncLen = this->EncryptBroadcastPacket(Data, DataLen, Frame);
 
-        //if we are in reset mode then tell the other side we want to reconnect
-        if(Device->ConnectState == CS_Reset)
+    //if no valid data then fail
+    if(!EncLen)
+    {
+        pthread_mutex_unlock(&this->BroadcastTXLock);
+        this->ReleaseTXFrame(Frame);
+        return MeshWriteErrors::DataTooLarge;
+    }
+
+    //a fragmented broadcast is still going out, wait behind it so the IDs go out in order. if there
+    //is no memory to queue it then it goes now
+    if(this->BroadcastTXHead)
+    {
+        Entry = (BroadcastTXStruct *)malloc(sizeof(BroadcastTXStruct));
+        if(Entry)
         {
-            this->Connect(Device->MAC);
-            if(this->BroadcastFlag)
-                this->MessageWasSent = 1;
-            return MeshWriteErrors::ResettingConnection;
+            Entry->Next = 0;
+            Entry->Frame = Frame;
+            Entry->FrameLen = EncLen;
+            Entry->Count = 0;
+            this->BroadcastTXTail->Next = Entry;
+            this->BroadcastTXTail = Entry;
+            pthread_mutex_unlock(&this->BroadcastTXLock);
+            return 0;
         }
+    }
 
-        //encrypt the packet
-        EncData = this->EncryptPacket(Device, Data, DataLen, &EncLen);
+    //send the data and return if it succeeded
+    Ret = this->SendFrame(MSG_Message, MAC, Frame, EncLen);
+    pthread_mutex_unlock(&this->BroadcastTXLock);
+    this->ReleaseTXFrame(Frame);
 
-        //if no valid data then fail
-        if(!EncData)
-        {
-            free(Device->LastOutMessage);
-            Device->LastOutMessage = 0;
+    return Ret;
+}
+
+int MeshNetworkInternal::WriteDevice(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle)
+{
+    int Ret;
+    uint8_t *Buffer;
+
+    //Handle is reported with the ack or failure, 0 for messages from Write
+
+    //fragments go through the send window and the device has to be able to put them back together
+    if(DataLen > FRAME_DATA_SIZE)
+    {
+        if((Device->Window < 2) || (DataLen > Device->MaxMessage))
             return MeshWriteErrors::DataTooLarge;
-        }
+        return this->WriteFragments(Device, Data, DataLen, Handle);
+    }
+
+    //with a send window the message is held and sent by it's own ID
+    if(Device->Window > 1)
+        return this->WindowWrite(Device, Data, DataLen, Handle);
+
+    //if we have an outstanding message then error
+    if(Device->LastOutMessage || Device->LastOutFrame)
+        return MeshWriteErrors::PreviousWriteNotComplete;
+
+    DEBUG_WRITE("Sending data to ");
+    DEBUG_WRITEMAC(Device->MAC);
+    DEBUG_WRITE("\n");
+
+    //the timing is filled in first as the resend thread looks at the message once it is set
+    Device->LastOutMessageCheck = 0;
+    Device->LastOutMessageResent = 0;
+    Device->LastOutMessageHandle = Handle;
+    Device->LastOutMessageSent = esp_timer_get_time();
+    Device->LastOutMessageResend = this->ResendDeadline(Device, Device->LastOutMessageSent, Device->LastOutMessageSent);
+
+    //if we are in reset mode then keep a copy to encrypt once the connection is back and tell the
+    //other side we want to reconnect
+    if(Device->ConnectState == CS_Reset)
+    {
+        Buffer = (uint8_t *)malloc(DataLen);
+        if(!Buffer)
+            return MeshWriteErrors::OutOfMemory;
+        memcpy(Buffer, Data, DataLen);
+        Device->LastOutMessageLen = DataLen;
+        Device->LastOutMessageResent = 1;
+        Device->LastOutMessage = Buffer;
 
-        DEBUG_WRITE("EncData ptr: ");
-        DEBUG_WRITEHEXVAL(EncData, 8);
-        DEBUG_WRITE("\n");
-        DEBUG_DUMPHEX("EncPacket:", EncData, EncLen);
+        this->Connect(Device->MAC);
+        if(this->BroadcastFlag)
+            this->TimerSchedule(Device, Device->LastOutMessageSent);
+        return MeshWriteErrors::ResettingConnection;
     }
-    
-    //send the data and return if it succeeded    
-    Ret = this->SendPayload(MSG_Message, MAC, EncData, EncLen);
-
-    //if a broadcast message then free the packet buffer
-    //if a broadcast message or not supposed to broadcast then free the packet buffer
-    if(BroadcastMsg || !this->BroadcastFlag)
-        free(EncData);
-    else
-        this->MessageWasSent = 1;
 
-    return Ret;
+    //encrypt straight into the frame kept for resends
+    Ret = this->LastOutEncrypt(Device, Data, DataLen);
+    if(Ret)
+        return Ret;
+
+    //let the resend thread know there is a message waiting on an ack
+    if(this->BroadcastFlag)
+        this->TimerSchedule(Device, Device->LastOutMessageResend);
+
+    //send the data and return if it succeeded
+    return this->SendFrame(MSG_Message, Device->MAC, Device->LastOutFrame, Device->LastOutFrameLen);
+}
+
+int MeshNetworkInternal::LastOutEncrypt(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen)
+{
+    TXFrameStruct *Frame;
+    unsigned short EncLen;
+
+    //the frame is only as large as the packet, EncryptPacket fails before writing anything that doesn't fit
+    Frame = (TXFrameStruct *)malloc(offsetof(TXFrameStruct, Payload) + sizeof(PacketHeaderStruct) + DataLen + sizeof(unsigned int));
+    if(!Frame)
+        return MeshWriteErrors::OutOfMemory;
+
+    Frame->Next = 0;
+    Frame->Pooled = 0;
+    EncLen = this->EncryptPacket(Device, Data, DataLen, Frame);
+    if(!EncLen)
+    {
+        free(Frame);
+        return MeshWriteErrors::DataTooLarge;
+    }
+
+    DEBUG_DUMPHEX("EncPacket:", Frame->Payload, EncLen);
+
+    Device->LastOutFrameLen = EncLen;
+    Device->LastOutFrame = Frame;
+    return 0;
+}
+
+void MeshNetworkInternal::LastOutDecrypt(KnownDeviceStruct *Device)
+{
+    TXFrameStruct *Frame;
+    LFSRStruct LFSR;
+    CipherStateStruct State;
+    uint8_t *Data;
+    unsigned short DataLen;
+
+    //a reset is about to replace the session keys, get the message back out of the frame waiting on an
+    //ack so it can be encrypted for the new connection
+    Frame = Device->LastOutFrame;
+    if(!Frame)
+        return;
+
+    this->BuildLFSRSchedule(&Device->Schedule_Out, &Device->LFSR_OutPrev);
+    LFSR = Device->LFSR_OutPrev;
+    this->InitCipherState(&State, &LFSR, &Device->Schedule_Out, Device->Key_Out);
+    Data = this->DecryptPacketCommon(((PacketHeaderStruct *)Frame->Payload)->SequenceID, Device->CipherSuite, &State, &Frame->Header,
+                                     Device->Version, Frame->Payload, Device->LastOutFrameLen, &DataLen);
+
+    Device->LastOutFrame = 0;
+    Device->LastOutFrameLen = 0;
+    free(Frame);
+
+    if(!Data)
+    {
+        Device->LastOutMessageCheck = 0;
+        this->SendDone(Device, Device->LastOutMessageHandle, 0);
+        return;
+    }
+
+    Device->LastOutMessageLen = DataLen;
+    Device->LastOutMessage = Data;
+}
+
+void MeshNetworkInternal::LastOutFree(KnownDeviceStruct *Device)
+{
+    if(Device->LastOutMessage)
+        free(Device->LastOutMessage);
+    if(Device->LastOutFrame)
+        free(Device->LastOutFrame);
+
+    Device->LastOutMessage = 0;
+    Device->LastOutMessageLen = 0;
+    Device->LastOutFrame = 0;
+    Device->LastOutFrameLen = 0;
+    Device->LastOutMessageCheck = 0;
 }
 
 void *Static_ResendMessages(void *)
 {
-    if(_GlobalMesh && _GlobalMesh->CanBroadcast())
+    //always run, rebroadcasts can be queued once broadcasting is turned on later
+    if(_GlobalMesh)
         _GlobalMesh->ResendMessages();
 
     return 0;
@@ -113,120 +237,472 @@ void *Static_ResendMessages(void *)
 
 void MeshNetworkInternal::ResendMessages()
 {
-    KnownDeviceStruct *CurDevice;
-    int i;
-    int FoundMessage;
+    int64_t Now;
+    int64_t NextResend;
+    int64_t NextRebroadcast;
+    int64_t NextFragment;
+    int64_t WakeTime;
 
     while(1)
     {
-        //cycle through all known connections and see if there is anything we need to send out
-        if(this->MessageWasSent)
+        //send anything that is due and sleep until the next device, rebroadcast, broadcast fragment or fragment timeout is due.
+        //anything scheduled while we are checking wakes us again as it may have been missed
+        this->ResendWake = 0;
+        Now = esp_timer_get_time();
+        WakeTime = 0;
+        NextResend = this->CheckResends(Now);
+        if(NextResend)
+            WakeTime = NextResend;
+        NextRebroadcast = this->RunRebroadcasts(Now);
+        if(NextRebroadcast && (!WakeTime || (NextRebroadcast < WakeTime)))
+            WakeTime = NextRebroadcast;
+        NextFragment = this->ExpireFragments(Now);
+        if(NextFragment && (!WakeTime || (NextFragment < WakeTime)))
+            WakeTime = NextFragment;
+        NextFragment = this->RunBroadcastTX(Now);
+        if(NextFragment && (!WakeTime || (NextFragment < WakeTime)))
+            WakeTime = NextFragment;
+
+        //with nothing waiting sleep until something is scheduled
+        if(!WakeTime)
+        {
+            this->ResendWake = INT64_MAX;
+            xSemaphoreTake(this->TXSemaphore, portMAX_DELAY);
+            continue;
+        }
+
+        this->ResendWake = WakeTime;
+        Now = esp_timer_get_time();
+        if(WakeTime > Now)
+            xSemaphoreTake(this->TXSemaphore, pdMS_TO_TICKS(((WakeTime - Now) + 999) / 1000));
+    };
+
+    return;
+}
+
+unsigned int MeshNetworkInternal::GetRTO(KnownDeviceStruct *Device)
+{
+    //nothing timed yet
+    if(!Device->PeerStats.RTO)
+    {
+        Device->PeerStats.RTO = RTO_INITIAL_MS * 1000;
+        if(Device->PeerStats.RTO < this->RTOMin)
+            Device->PeerStats.RTO = this->RTOMin;
+        else if(Device->PeerStats.RTO > this->RTOMax)
+            Device->PeerStats.RTO = this->RTOMax;
+    }
+
+    return Device->PeerStats.RTO;
+}
+
+void MeshNetworkInternal::UpdateRTT(KnownDeviceStruct *Device, int64_t Sample)
+{
+    unsigned int Delta;
+    unsigned int RTO;
+
+    //jacobson/karels, only acks of messages sent once are timed
+    if(Sample <= 0)
+        Sample = 1;
+    else if(Sample > (RESEND_GIVE_UP_MS * 1000LL))
+        Sample = RESEND_GIVE_UP_MS * 1000LL;
+
+    if(!Device->PeerStats.SRTT)
+    {
+        Device->PeerStats.SRTT = Sample;
+        Device->PeerStats.RTTVar = Sample / 2;
+    }
+    else
+    {
+        Delta = (Device->PeerStats.SRTT > Sample) ? (Device->PeerStats.SRTT - Sample) : (Sample - Device->PeerStats.SRTT);
+        Device->PeerStats.RTTVar = ((Device->PeerStats.RTTVar * 3) + Delta) / 4;
+        Device->PeerStats.SRTT = ((Device->PeerStats.SRTT * 7) + Sample) / 8;
+    }
+
+    //a new sample also undoes any backoff
+    RTO = Device->PeerStats.SRTT + (Device->PeerStats.RTTVar * 4);
+    if(RTO < this->RTOMin)
+        RTO = this->RTOMin;
+    else if(RTO > this->RTOMax)
+        RTO = this->RTOMax;
+    Device->PeerStats.RTO = RTO;
+}
+
+void MeshNetworkInternal::BackoffRTO(KnownDeviceStruct *Device)
+{
+    //wait twice as long each time the wait runs out
+    Device->PeerStats.RTO = this->GetRTO(Device) * 2;
+    if(Device->PeerStats.RTO > this->RTOMax)
+        Device->PeerStats.RTO = this->RTOMax;
+}
+
+int64_t MeshNetworkInternal::ResendDeadline(KnownDeviceStruct *Device, int64_t FirstSent, int64_t Now)
+{
+    int64_t Deadline;
+
+    //when to resend a message sent now, no later than when it is given up on
+    Deadline = Now + this->GetRTO(Device);
+    if(Deadline > (FirstSent + (RESEND_GIVE_UP_MS * 1000LL)))
+        Deadline = FirstSent + (RESEND_GIVE_UP_MS * 1000LL);
+
+    return Deadline;
+}
+
+int64_t MeshNetworkInternal::CheckResends(int64_t Now)
+{
+    KnownDeviceStruct *Device;
+    int64_t Next;
+
+    //only the devices that are due are looked at, each is put back for whatever it waits on next.
+    //returns when the next device is due or 0
+    this->TimerExpire(Now);
+    while((Device = this->TimerPop()))
+    {
+        Next = this->CheckDevice(Device, Now);
+        if(Next)
+            this->TimerSchedule(Device, Next);
+    }
+
+    return this->TimerNextDeadline();
+}
+
+int64_t MeshNetworkInternal::CheckDevice(KnownDeviceStruct *Device, int64_t Now)
+{
+    int64_t Next;
+    int64_t Expire;
+    int Pending;
+    int Tick;
+
+    //see if there is anything we need to send out. connection timeouts and gaps are counted when Tick is set
+    //every RESEND_INTERVAL_MS while something is waiting, resends go out once they are due. returns when the
+    //device has to be looked at again or 0 if nothing is waiting
+    Tick = 0;
+    if(!Device->TickTime)
+        Device->TickTime = Now + (RESEND_INTERVAL_MS * 1000LL);
+    else if(Now >= Device->TickTime)
+    {
+        Tick = 1;
+        Device->TickTime += RESEND_INTERVAL_MS * 1000LL;
+
+        //if we fell well behind then don't try to catch up
+        if(Device->TickTime <= Now)
+            Device->TickTime = Now + (RESEND_INTERVAL_MS * 1000LL);
+    }
+
+    Next = 0;
+    Pending = 0;
+
+    //if we have a message see if it needs to go out again
+    if(Device->LastOutMessage || Device->LastOutFrame)
+    {
+        //set our flag so we can keep checking but only send if we are connected and not in reset
+        Pending = 1;
+        if(Device->ConnectState == ConnectStateEnum::CS_ResetConnecting)
+        {
+            if(Tick)
+                Device->LastOutMessageCheck++;
+            if(Device->LastOutMessageCheck >= 5) //2.5 seconds due to 500ms delay
+            {
+                //taken too long reset connect state and give up on the message
+                Device->ConnectState = ConnectStateEnum::CS_Reset;
+                this->LastOutFree(Device);
+                this->SendDone(Device, Device->LastOutMessageHandle, 0);
+            }
+        }
+        else if((Device->ConnectState == ConnectStateEnum::CS_Connected) && (Now >= Device->LastOutMessageResend))
         {
-            FoundMessage = 0;
-            for(i = 0; i < TABLE_SIZE; i++)
+            //if we have waited long enough then stop waiting
+            if((Now - Device->LastOutMessageSent) >= (RESEND_GIVE_UP_MS * 1000LL))
+            {
+                this->LastOutFree(Device);
+                Device->PeerStats.Timeouts++;
+                this->SendDone(Device, Device->LastOutMessageHandle, 0);
+            }
+            else
             {
-                CurDevice = this->KnownDeviceTable[i];
-                while(CurDevice)
+                DEBUG_WRITE((unsigned long) (esp_timer_get_time() / 1000ULL));
+                DEBUG_WRITE(": Message sent to ");
+                DEBUG_WRITEMAC(Device->MAC);
+                DEBUG_WRITE(" being resent, len ");
+                DEBUG_WRITE(Device->LastOutMessage ? Device->LastOutMessageLen : Device->LastOutFrameLen);
+                DEBUG_WRITE("\n");
+
+                //a message from before a reset is encrypted for the new connection once, after that the
+                //same frame goes out each time
+                if(Device->LastOutMessage && !this->LastOutEncrypt(Device, Device->LastOutMessage, Device->LastOutMessageLen))
                 {
-                    //if we have a message increment the check value
-                    if(CurDevice->LastOutMessage)
-                    {
-                        //set our flag so we can keep checking but only send if we are connected and not in reset
-                        FoundMessage = 1;
-                        if(CurDevice->ConnectState == ConnectStateEnum::CS_ResetConnecting)
-                        {
-                            CurDevice->LastOutMessageCheck++;
-                            if(CurDevice->LastOutMessageCheck >= 5) //2.5 seconds due to 500ms delay
-                            {
-                                //taken too long reset connect state
-                                CurDevice->ConnectState = ConnectStateEnum::CS_Reset;
-                                if(this->SendFailedCallback)
-                                    this->SendFailedCallback(CurDevice->MAC);
-                            }
-                        }
-                        else if(CurDevice->ConnectState == ConnectStateEnum::CS_Connected)
-                        {
-                            CurDevice->LastOutMessageCheck++;
-                            if((CurDevice->LastOutMessageCheck & 1) == 0)
-                            {
-                                //if we have waited up to 5 cycles then stop waiting (2.5 seconds)
-                                if(CurDevice->LastOutMessageCheck >= 5)
-                                {
-                                    free(CurDevice->LastOutMessage);
-                                    CurDevice->LastOutMessage = 0;
-                                    CurDevice->LastOutMessageCheck = 0;
-                                    CurDevice->LastOutMessageLen = 0;
-
-                                    if(this->SendFailedCallback)
-                                        this->SendFailedCallback(CurDevice->MAC);
-                                }
-                            }
-                            else
-                            {
-                                DEBUG_WRITE((unsigned long) (esp_timer_get_time() / 1000ULL));
-                                DEBUG_WRITE(": Message sent to ");
-                                DEBUG_WRITEMAC(CurDevice->MAC);
-                                DEBUG_WRITE(" being resent, len ");
-                                DEBUG_WRITE(CurDevice->LastOutMessageLen);
-                                DEBUG_WRITE("\n");
-
-                                //reset the out lfsr and out id
-                                CurDevice->LFSR_Out = CurDevice->LFSR_OutPrev;
-                                CurDevice->ID_Out--;
-
-                                //encrypt the packet
-                                unsigned short EncLen;
-                                uint8_t *EncData = this->EncryptPacket(CurDevice, CurDevice->LastOutMessage, CurDevice->LastOutMessageLen, &EncLen);
-                                if(EncData)
-                                {
-                                    //resend, we will retransmit every 1 seconds
-                                    this->SendPayload(MSG_Message, CurDevice->MAC, EncData, EncLen);
-                                    free(EncData);
-                                }
-                            }
-                        }
-                    }
-
-                    //next device
-                    CurDevice = CurDevice->Next;
+                    free(Device->LastOutMessage);
+                    Device->LastOutMessage = 0;
+                    Device->LastOutMessageLen = 0;
                 }
+
+                //resend, waiting twice as long for the next one
+                if(Device->LastOutFrame)
+                    this->SendFrame(MSG_Message, Device->MAC, Device->LastOutFrame, Device->LastOutFrameLen);
+
+                Device->LastOutMessageResent = 1;
+                Device->PeerStats.Retransmits++;
+                this->BackoffRTO(Device);
+                Device->LastOutMessageResend = this->ResendDeadline(Device, Device->LastOutMessageSent, Now);
+            }
+        }
+
+        if((Device->LastOutMessage || Device->LastOutFrame) && (Device->ConnectState == ConnectStateEnum::CS_Connected) &&
+           (!Next || (Device->LastOutMessageResend < Next)))
+            Next = Device->LastOutMessageResend;
+    }
+
+    //messages in a send window
+    if(Device->WindowOut && this->WindowCheck(Device, Now, Tick, &Next))
+        Pending = 1;
+
+    //held messages go out once due, if the window is full they go out on the next ack instead. queued
+    //messages go once there is room and fail if the connection doesn't finish
+    pthread_mutex_lock(&this->WindowLock);
+    if(Device->CoalesceData)
+    {
+        if(Device->CoalesceFlush <= Now)
+            this->CoalesceFlush(Device);
+        else if(!Next || (Device->CoalesceFlush < Next))
+            Next = Device->CoalesceFlush;
+    }
+    if(Device->CoalesceData)
+        Pending = 1;
+
+    if(Device->AsyncHead)
+    {
+        if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+            this->AsyncDrain(Device);
+        else
+        {
+            if(Tick)
+                Device->AsyncCheck++;
+            if((Device->AsyncCheck >= ASYNC_CONNECT_TICKS) || (Device->ConnectState == ConnectStateEnum::CS_Reset))
+            {
+                if(Device->ConnectState == ConnectStateEnum::CS_ResetConnecting)
+                    Device->ConnectState = ConnectStateEnum::CS_Reset;
+                this->AsyncFail(Device);
             }
+        }
+    }
+    if(Device->AsyncHead)
+        Pending = 1;
+    pthread_mutex_unlock(&this->WindowLock);
 
-            //if no messages then reset the send flag
-            if(!FoundMessage)
-                this->MessageWasSent = 0;
+    //discard a fragmented message that stopped getting fragments
+    pthread_mutex_lock(&this->FragmentLock);
+    if(Device->FragmentIn && Device->FragmentIn->Data)
+    {
+        Expire = Device->FragmentIn->Updated + (FRAGMENT_TIMEOUT_MS * 1000LL);
+        if(Now >= Expire)
+        {
+            free(Device->FragmentIn->Data);
+            Device->FragmentIn->Data = 0;
+            this->Stats.ReassemblyTimeouts++;
         }
-        delay(500);
-    };
+        else if(!Next || (Expire < Next))
+            Next = Expire;
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
 
-    return;
+    //keep counting while anything is waiting, start over once nothing is
+    if(!Pending)
+        Device->TickTime = 0;
+    else if(!Next || (Device->TickTime < Next))
+        Next = Device->TickTime;
+
+    return Next;
+}
+
+void MeshNetworkInternal::ScheduleRebroadcast(const uint8_t *Data, size_t DataLen, const uint8_t *MAC, unsigned int SequenceID, size_t Count)
+{
+    RebroadcastStruct *Entry;
+    RebroadcastStruct *Parent;
+    unsigned int Pos;
+
+    //copy the frame as the rx slot is reused once we return
+    Entry = (RebroadcastStruct *)malloc(sizeof(RebroadcastStruct) + DataLen);
+    if(!Entry)
+    {
+        this->Stats.RebroadcastsDropped++;
+        return;
+    }
+
+    //wait a random amount of time so we don't flood the wifi, 1 to 256ms
+    Entry->FireTime = esp_timer_get_time() + (((esp_random() & 0xff) + 1) * 1000LL);
+    memcpy(Entry->MAC, MAC, MAC_SIZE);
+    Entry->SequenceID = SequenceID;
+    Entry->Count = Count;
+    Entry->Len = DataLen;
+    memcpy(Entry->Data, Data, DataLen);
+
+    pthread_mutex_lock(&this->RebroadcastLock);
+    if(this->RebroadcastCount >= REBROADCAST_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&this->RebroadcastLock);
+        this->Stats.RebroadcastsDropped++;
+        free(Entry);
+        return;
+    }
+
+    //sift up
+    Pos = this->RebroadcastCount;
+    this->RebroadcastCount++;
+    while(Pos)
+    {
+        Parent = this->RebroadcastQueue[(Pos - 1) / 2];
+        if(Parent->FireTime <= Entry->FireTime)
+            break;
+        this->RebroadcastQueue[Pos] = Parent;
+        Pos = (Pos - 1) / 2;
+    }
+    this->RebroadcastQueue[Pos] = Entry;
+    pthread_mutex_unlock(&this->RebroadcastLock);
+
+    //if it is now the first to go then the resend thread may be sleeping past it
+    if(!Pos)
+        xSemaphoreGive(this->TXSemaphore);
+}
+
+int64_t MeshNetworkInternal::RunRebroadcasts(int64_t Now)
+{
+    RebroadcastStruct *Entry;
+    RebroadcastStruct *Last;
+    int64_t NextTime;
+    unsigned int Pos;
+    unsigned int Child;
+
+    while(1)
+    {
+        pthread_mutex_lock(&this->RebroadcastLock);
+        if(!this->RebroadcastCount || (this->RebroadcastQueue[0]->FireTime > Now))
+        {
+            NextTime = this->RebroadcastCount ? this->RebroadcastQueue[0]->FireTime : 0;
+            pthread_mutex_unlock(&this->RebroadcastLock);
+            return NextTime;
+        }
+
+        //pop the top and sift the last entry down into its place
+        Entry = this->RebroadcastQueue[0];
+        this->RebroadcastCount--;
+        Last = this->RebroadcastQueue[this->RebroadcastCount];
+        Pos = 0;
+        while(1)
+        {
+            Child = (Pos * 2) + 1;
+            if(Child >= this->RebroadcastCount)
+                break;
+            if(((Child + 1) < this->RebroadcastCount) && (this->RebroadcastQueue[Child + 1]->FireTime < this->RebroadcastQueue[Child]->FireTime))
+                Child++;
+            if(Last->FireTime <= this->RebroadcastQueue[Child]->FireTime)
+                break;
+            this->RebroadcastQueue[Pos] = this->RebroadcastQueue[Child];
+            Pos = Child;
+        }
+        if(this->RebroadcastCount)
+            this->RebroadcastQueue[Pos] = Last;
+        pthread_mutex_unlock(&this->RebroadcastLock);
+
+        //skip it if enough others repeated it while we waited
+        if(((Entry->Count + this->SeenCacheCopies(Entry->MAC, Entry->SequenceID)) < REBROADCAST_COPIES) && this->BroadcastFlag)
+        {
+            esp_wifi_80211_tx(WIFI_IF_STA, Entry->Data, Entry->Len, 0);
+            this->Stats.RebroadcastsSent++;
+        }
+        else
+            this->Stats.RebroadcastsCancelled++;
+
+        free(Entry);
+    }
+}
+
+MeshNetworkInternal::TXFrameStruct *MeshNetworkInternal::GetTXFrame()
+{
+    TXFrameStruct *Frame;
+
+    //pull a frame from the pool
+    pthread_mutex_lock(&this->TXFrameLock);
+    Frame = this->TXFramePool;
+    if(Frame)
+        this->TXFramePool = Frame->Next;
+    pthread_mutex_unlock(&this->TXFrameLock);
+
+    //if the pool is empty then allocate one that is freed on release
+    if(!Frame)
+    {
+        Frame = (TXFrameStruct *)malloc(sizeof(TXFrameStruct));
+        if(!Frame)
+            return 0;
+        Frame->Pooled = 0;
+    }
+
+    //untagged unless the encryption fills it in
+    Frame->Next = 0;
+    Frame->Header.PacketVersion = 0;
+    Frame->Header.PacketTag = 0;
+    return Frame;
+}
+
+void MeshNetworkInternal::ReleaseTXFrame(TXFrameStruct *Frame)
+{
+    if(!Frame)
+        return;
+
+    if(!Frame->Pooled)
+    {
+        free(Frame);
+        return;
+    }
+
+    //put it back in the pool
+    pthread_mutex_lock(&this->TXFrameLock);
+    Frame->Next = this->TXFramePool;
+    this->TXFramePool = Frame;
+    pthread_mutex_unlock(&this->TXFrameLock);
 }
 
 int MeshNetworkInternal::SendPayload(MessageTypeEnum MsgType, const uint8_t *MAC, const void *InData, unsigned short DataLen)
 {
     //just send a payload as-is, no encryption is done!
-    uint8_t *FinalPayload;
-    uint8_t *Data = (uint8_t *)InData;
-    WifiHeaderStruct *Header;
+    TXFrameStruct *Frame;
     int ret;
 
     //make sure the payload can fit
-    if(((int)DataLen + sizeof(WifiHeaderStruct)) > MAX_PACKET_SIZE)
+    if(DataLen > sizeof(Frame->Payload))
         return -1;
 
-    FinalPayload = (uint8_t *) malloc(DataLen + sizeof(WifiHeaderStruct));
-    if(!FinalPayload)
+    Frame = this->GetTXFrame();
+    if(!Frame)
         return -1;
 
     //copy the data into our payload packet
-    memcpy(&FinalPayload[sizeof(WifiHeaderStruct)], Data, DataLen);
+    memcpy(Frame->Payload, InData, DataLen);
+
+    ret = this->SendFrame(MsgType, MAC, Frame, DataLen);
+    this->ReleaseTXFrame(Frame);
+
+    //return result
+    return ret;
+}
 
-    //setup the Header
-    Header = (WifiHeaderStruct *)FinalPayload;
-    memset(Header, 0, sizeof(WifiHeaderStruct));
+int MeshNetworkInternal::SendFrame(MessageTypeEnum MsgType, const uint8_t *MAC, TXFrameStruct *Frame, unsigned short DataLen)
+{
+    //send a frame that already has it's payload filled in, the frame is not released
+    uint8_t *FinalPayload;
+    WifiHeaderStruct *Header;
+    MeshIOVec Vec[2];
+    int ret;
+
+    //make sure the payload can fit
+    if(DataLen > sizeof(Frame->Payload))
+        return -1;
+
+    //setup the Header, the version and tag are left as the encryption set them
+    FinalPayload = (uint8_t *)&Frame->Header;
+    Header = &Frame->Header;
     Header->FC = 0x00d0;
     Header->Duration = 0;
     Header->Type = MsgType;
+    Header->SequenceControl = 0;
 
     //setup the mac values
     memcpy(Header->MAC_Sender, this->MAC, MAC_SIZE);
@@ -239,8 +715,16 @@ int MeshNetworkInternal::SendPayload(MessageTypeEnum MsgType, const uint8_t *MAC
     DEBUG_WRITE("\n");
     DEBUG_DUMPHEX(0, FinalPayload, DataLen + sizeof(WifiHeaderStruct));
 
-    //if we have a function to call for sending then call it
-    if(this->SendMessageCallback)
+    //if we have a function to call for sending then call it, the binary one is handed the frame where it is
+    if(this->SendFrameCallback)
+    {
+        Vec[0].Data = Header;
+        Vec[0].Len = sizeof(WifiHeaderStruct);
+        Vec[1].Data = Frame->Payload;
+        Vec[1].Len = DataLen;
+        this->SendFrameCallback(Vec, 2);
+    }
+    else if(this->SendMessageCallback)
     {
         //get a base64 version of the string
         uint8_t *OutData;
@@ -255,12 +739,11 @@ int MeshNetworkInternal::SendPayload(MessageTypeEnum MsgType, const uint8_t *MAC
         free(OutData);
     }
 
-    //transmit the raw packet
+    //transmit the raw packet, the wifi driver copies the frame so it can be released after
     ret = 0;
     if(this->BroadcastFlag)
     {
         ret = esp_wifi_80211_tx(WIFI_IF_STA, FinalPayload, DataLen + sizeof(WifiHeaderStruct), false);
-        free(FinalPayload);
         if(ret != ESP_OK)
         {
             DEBUG_WRITE("Error on esp_wifi_80211_tx: ");
@@ -276,8 +759,6 @@ int MeshNetworkInternal::SendPayload(MessageTypeEnum MsgType, const uint8_t *MAC
         }
     }
 
-    free(FinalPayload);
-
     //return result
     return ret;
-}
\ No newline at end of file
+}
@@ -1,6 +1,26 @@
 #include "mesh_internal.h"
 #include <unistd.h>
 
+//the crc is a poor-man 8 bit crc with a polynomial of 0x07, the tables are generated by the compiler
+//table 0 is a single byte processed while tables 1 to 3 include 1 to 3 additional zero bytes being
+//pushed through so 4 bytes can be handled at once
+static constexpr uint8_t CRCShift(uint8_t CRC, int Bits)
+{
+    return Bits ? CRCShift((CRC & 0x80) ? (uint8_t)((CRC << 1) ^ 0x07) : (uint8_t)(CRC << 1), Bits - 1) : CRC;
+}
+
+static constexpr uint8_t CRCEntry(uint8_t Value, int Bytes)
+{
+    return Bytes ? CRCEntry(CRCShift(Value, 8), Bytes - 1) : Value;
+}
+
+#define CRC_ROW4(Bytes, Val) CRCEntry((Val), Bytes), CRCEntry((Val) + 1, Bytes), CRCEntry((Val) + 2, Bytes), CRCEntry((Val) + 3, Bytes)
+#define CRC_ROW16(Bytes, Val) CRC_ROW4(Bytes, Val), CRC_ROW4(Bytes, (Val) + 4), CRC_ROW4(Bytes, (Val) + 8), CRC_ROW4(Bytes, (Val) + 12)
+#define CRC_ROW64(Bytes, Val) CRC_ROW16(Bytes, Val), CRC_ROW16(Bytes, (Val) + 16), CRC_ROW16(Bytes, (Val) + 32), CRC_ROW16(Bytes, (Val) + 48)
+#define CRC_TABLE(Bytes) {CRC_ROW64(Bytes, 0), CRC_ROW64(Bytes, 64), CRC_ROW64(Bytes, 128), CRC_ROW64(Bytes, 192)}
+
+const uint8_t MeshNetworkInternal::CRCTable[4][256] = {CRC_TABLE(1), CRC_TABLE(2), CRC_TABLE(3), CRC_TABLE(4)};
+
 int MeshNetworkInternal::SetBroadcastLFSR(unsigned int BroadcastLFSR[2], uint8_t Mask1[3], uint8_t Mask2[3])
 {
     int Divisor;
@@ -36,6 +56,17 @@ int MeshNetworkInternal::SetBroadcastLFSR(unsigned int BroadcastLFSR[2], uint8_t
     this->LFSR_Broadcast.LFSRMask = 0x3e000000 | ((Mask1[0] - 1) << 20) | ((Mask1[1] - 1) << 15) | ((Mask1[2] - 1) << 10);
     this->LFSR_Broadcast.LFSRRotMask = 0x3e000000 | ((Mask2[0] - 1) << 20) | ((Mask2[1] - 1) << 15) | ((Mask2[2] - 1) << 10);
     this->BroadcastMsgID = 0;
+    this->BroadcastMsgIDSaved = 0;
+
+    //the broadcast masks never change so the schedule is built once
+    this->Schedule_Broadcast.Valid = 0;
+    this->BuildLFSRSchedule(&this->Schedule_Broadcast, &this->LFSR_Broadcast);
+
+    //broadcast key for the other cipher suites, the LFSR values followed by the start of their stream
+    LFSRStruct LFSR = this->LFSR_Broadcast;
+    memcpy(&this->Key_Broadcast[0], &LFSR, sizeof(LFSRStruct));
+    memset(&this->Key_Broadcast[4], 0, sizeof(LFSRStruct));
+    this->Encrypt(&this->Key_Broadcast[4], &this->Key_Broadcast[4], sizeof(LFSRStruct), &LFSR, &this->Schedule_Broadcast);
     return 0;
 }
 
@@ -198,6 +229,98 @@ void MeshNetworkInternal::CalculateLFSR(LFSRStruct *LFSR)
     LFSR->LFSR = this->RotateLFSR(LFSR->LFSR, LFSR->LFSRMask, ROT[0]);
 }
 
+unsigned int MeshNetworkInternal::DecodeLFSRMask(unsigned int Mask, unsigned int *XNOR)
+{
+    unsigned int Taps;
+    unsigned int BitCount;
+
+    //decode the mask the same way RotateLFSR does, the top bit is always part of the new bit
+    //and each 5 bit entry adds in another bit, an entry that repeats a bit cancels it out
+    *XNOR = (Mask >> 30) & 1;
+    BitCount = 6;
+    if(!(Mask >> 31))
+    {
+        Mask >>= 10;
+        BitCount = 4;
+    }
+
+    Taps = 0x80000000;
+    while(BitCount)
+    {
+        Taps ^= (1u << (Mask & 0x1f));
+        Mask >>= 5;
+        BitCount--;
+    }
+
+    return Taps;
+}
+
+void MeshNetworkInternal::BuildLFSRJump(LFSRJumpStruct *Jump, unsigned int Mask)
+{
+    unsigned int Basis[32];
+    unsigned int XNOR;
+    unsigned int Value;
+    unsigned int Bit;
+    int i;
+    int Step;
+
+    Jump->Mask = Mask;
+    Jump->Taps = this->DecodeLFSRMask(Mask, &XNOR);
+
+    //the LFSR is linear other than the xnor flag so run 16 steps from 0 to get the xnor
+    //contribution then 16 steps from each single bit to find what that bit contributes
+    for(i = -1; i < 32; i++)
+    {
+        Value = (i < 0) ? 0 : (1u << i);
+        for(Step = 0; Step < 16; Step++)
+        {
+            Bit = __builtin_parity(Value & Jump->Taps) ^ ((i < 0) ? XNOR : 0);
+            Value = (Value >> 1) | (Bit << 31);
+        }
+
+        //the new bits are in the upper 16 bits, first generated is the lowest
+        if(i < 0)
+            Jump->XNOR = Value >> 16;
+        else
+            Basis[i] = Value >> 16;
+    }
+
+    //combine the single bits into a table for every nibble value
+    for(i = 0; i < 8; i++)
+    {
+        for(Value = 0; Value < 16; Value++)
+        {
+            Jump->Table[i][Value] = 0;
+            for(Bit = 0; Bit < 4; Bit++)
+            {
+                if(Value & (1 << Bit))
+                    Jump->Table[i][Value] ^= Basis[(i * 4) + Bit];
+            }
+        }
+    }
+}
+
+void MeshNetworkInternal::BuildLFSRSchedule(LFSRScheduleStruct *Schedule, const LFSRStruct *LFSR)
+{
+    //only rebuild if the masks changed since the last time
+    if(this->CheckLFSRSchedule(Schedule, LFSR))
+        return;
+
+    Schedule->Valid = 0;
+    this->BuildLFSRJump(&Schedule->LFSR, LFSR->LFSRMask);
+    this->BuildLFSRJump(&Schedule->LFSRRot, LFSR->LFSRRotMask);
+    Schedule->Valid = 1;
+}
+
+const MeshNetworkInternal::LFSRScheduleStruct *MeshNetworkInternal::CheckLFSRSchedule(const LFSRScheduleStruct *Schedule, const LFSRStruct *LFSR)
+{
+    //return the schedule if it can be used for the LFSR otherwise 0
+    if(!Schedule || !Schedule->Valid || (Schedule->LFSR.Mask != LFSR->LFSRMask) || (Schedule->LFSRRot.Mask != LFSR->LFSRRotMask))
+        return 0;
+
+    return Schedule;
+}
+
 uint8_t MeshNetworkInternal::CalculateCRC(const void *Data, unsigned int DataLen)
 {
     return this->CalculateCRC(Data, DataLen, 0xff);
@@ -205,28 +328,46 @@ uint8_t MeshNetworkInternal::CalculateCRC(const void *Data, unsigned int DataLen
 
 uint8_t MeshNetworkInternal::CalculateCRC(const void *Data, unsigned int DataLen, uint8_t StartCRC)
 {
-    uint8_t Count;
-    uint16_t CRC;
+    uint8_t CRC;
     uint8_t *InData = (uint8_t *)Data;
-    uint8_t BitPos;
 
-    //calculate our index, do a poor-man 8 bit crc
-    CRC = StartCRC;
-    for(Count = 0; Count < DataLen; Count++)
+    //nothing to process leaves the crc at 0, StartCRC only mixes in with the first byte
+    if(!DataLen)
+        return 0;
+
+    //the start value sits below the first byte so it is xor'd in after the first byte is processed
+    CRC = CRCTable[0][*InData] ^ StartCRC;
+    InData++;
+    DataLen--;
+
+    //handle 4 bytes at a time, each table is an additional zero byte pushed through the crc
+    while(DataLen >= 4)
     {
-        CRC ^= (uint16_t)InData[Count] << 8;
-        for(BitPos = 8; BitPos; BitPos--) {
-            if(CRC & 0x8000)
-                CRC ^= 0x8380;
-            CRC <<=1;
-        }
+        CRC = CRCTable[3][CRC ^ InData[0]] ^ CRCTable[2][InData[1]] ^ CRCTable[1][InData[2]] ^ CRCTable[0][InData[3]];
+        InData += 4;
+        DataLen -= 4;
+    }
+
+    //finish off anything left over
+    while(DataLen)
+    {
+        CRC = CRCTable[0][CRC ^ *InData];
+        InData++;
+        DataLen--;
     }
 
     //return the crc
-    return (CRC >> 8);
+    return CRC;
 }
 
-void MeshNetworkInternal::PermuteBroadcastLFSR(const uint8_t *MAC, unsigned int ID, LFSRStruct *LFSR)
+uint8_t MeshNetworkInternal::CalculateBroadcastMACCRC(const uint8_t *MAC)
+{
+    //the crc of the MAC pushed through 3 zero bytes, the part of PermuteBroadcastLFSR that only
+    //depends on the sender so it can be calculated once per device
+    return CRCTable[2][this->CalculateCRC(MAC, 6, 0)];
+}
+
+void MeshNetworkInternal::PermuteBroadcastLFSR(uint8_t MACCRC, unsigned int ID, LFSRStruct *LFSR)
 {
     //start with our LFSR for global, run it through a few cycles with the MAC and use the result as our new LFSR for messages
     //from that device
@@ -234,29 +375,19 @@ void MeshNetworkInternal::PermuteBroadcastLFSR(const uint8_t *MAC, unsigned int
         uint8_t Data[4];
         unsigned int Ret;
     };
+    uint8_t Key;
 
-    //as with crypt, look to see if aes function on esp is 1 or multiple rounds
-    //allowing simplistic data modification for permutation at lower impact potentially
-    //yes I could use crc32 and be done with it, this is more fun
-    LFSR->LFSR = this->LFSR_Broadcast.LFSR;
-    Data[0] = this->CalculateCRC(MAC, 6, LFSR->LFSR & 0xff);
-    Data[0] = this->CalculateCRC(&ID, 4, Data[0]);
-    Data[1] = this->CalculateCRC(MAC, 6, Data[0] ^ ((LFSR->LFSR >> 8) & 0xff));
-    Data[1] = this->CalculateCRC(&ID, 4, Data[1]);
-    Data[2] = this->CalculateCRC(MAC, 6, Data[1] ^ ((LFSR->LFSR >> 16) & 0xff));
-    Data[2] = this->CalculateCRC(&ID, 4, Data[2]);
-    Data[3] = this->CalculateCRC(MAC, 6, Data[2] ^ ((LFSR->LFSR >> 24) & 0xff));
-    Data[3] = this->CalculateCRC(&ID, 4, Data[3]);
+    //each byte is CalculateCRC(&ID, 4, CalculateCRC(MAC, 6, Start)). the crc is linear so that is the start value
+    //pushed through 8 zero bytes xor'd with the crc of the MAC and ID by themselves, MACCRC is the MAC half of
+    //that from CalculateBroadcastMACCRC
+    Key = MACCRC ^ this->CalculateCRC(&ID, 4, 0);
 
+    LFSR->LFSR = this->LFSR_Broadcast.LFSR;
     LFSR->LFSRRot = this->LFSR_Broadcast.LFSRRot;
-    Data[0] = this->CalculateCRC(MAC, 6, LFSR->LFSRRot & 0xff);
-    Data[0] = this->CalculateCRC(&ID, 4, Data[0]);
-    Data[1] = this->CalculateCRC(MAC, 6, Data[0] ^ ((LFSR->LFSRRot >> 8) & 0xff));
-    Data[1] = this->CalculateCRC(&ID, 4, Data[1]);
-    Data[2] = this->CalculateCRC(MAC, 6, Data[1] ^ ((LFSR->LFSRRot >> 16) & 0xff));
-    Data[2] = this->CalculateCRC(&ID, 4, Data[2]);
-    Data[3] = this->CalculateCRC(MAC, 6, Data[2] ^ ((LFSR->LFSRRot >> 24) & 0xff));
-    Data[3] = this->CalculateCRC(&ID, 4, Data[3]);
+    Data[0] = CRCTable[3][CRCTable[3][LFSR->LFSRRot & 0xff]] ^ Key;
+    Data[1] = CRCTable[3][CRCTable[3][Data[0] ^ ((LFSR->LFSRRot >> 8) & 0xff)]] ^ Key;
+    Data[2] = CRCTable[3][CRCTable[3][Data[1] ^ ((LFSR->LFSRRot >> 16) & 0xff)]] ^ Key;
+    Data[3] = CRCTable[3][CRCTable[3][Data[2] ^ ((LFSR->LFSRRot >> 24) & 0xff)]] ^ Key;
 
     //setup our modified value
     LFSR->LFSRRot = Ret;
@@ -264,4 +395,29 @@ void MeshNetworkInternal::PermuteBroadcastLFSR(const uint8_t *MAC, unsigned int
     //put in our masks
     LFSR->LFSRMask = this->LFSR_Broadcast.LFSRMask;
     LFSR->LFSRRotMask = this->LFSR_Broadcast.LFSRRotMask;
-}
\ No newline at end of file
+}
+
+void MeshNetworkInternal::PermuteSessionLFSR(const LFSRStruct *Base, const LFSRScheduleStruct *Schedule, unsigned int ID, LFSRStruct *LFSR)
+{
+    int Count;
+
+    //windowed messages can arrive in any order so each one starts from the session LFSR with the ID mixed in
+    //instead of where the previous message left off
+    Schedule = this->CheckLFSRSchedule(Schedule, Base);
+    *LFSR = *Base;
+    LFSR->LFSR ^= ID * 0x9e3779b1;
+    LFSR->LFSRRot ^= ID;
+    if(!LFSR->LFSR || (LFSR->LFSR == 0xffffffff))
+        LFSR->LFSR = 1;
+    if(!LFSR->LFSRRot || (LFSR->LFSRRot == 0xffffffff))
+        LFSR->LFSRRot = 1;
+
+    //run it a few cycles so neighbouring IDs end up unrelated
+    for(Count = 0; Count < 8; Count++)
+    {
+        if(Schedule)
+            this->CalculateLFSR(LFSR, Schedule);
+        else
+            this->CalculateLFSR(LFSR);
+    }
+}
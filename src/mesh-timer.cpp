@@ -0,0 +1,184 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+#include "mesh.h"
+#include <pthread.h>
+#include <string.h>
+
+//devices with something for the resend thread to do are kept in a two level timing wheel by the ms they are
+//due. adding, moving and removing a device doesn't depend on how many are known and the resend thread only
+//looks at the devices that are due instead of walking the whole table
+
+void MeshNetworkInternal::TimerLink(KnownDeviceStruct *Device, KnownDeviceStruct **Slot)
+{
+    //TimerLock must be held
+    Device->TimerNext = *Slot;
+    if(Device->TimerNext)
+        Device->TimerNext->TimerPrev = &Device->TimerNext;
+    Device->TimerPrev = Slot;
+    *Slot = Device;
+}
+
+void MeshNetworkInternal::TimerUnlink(KnownDeviceStruct *Device)
+{
+    //TimerLock must be held
+    *Device->TimerPrev = Device->TimerNext;
+    if(Device->TimerNext)
+        Device->TimerNext->TimerPrev = Device->TimerPrev;
+    Device->TimerNext = 0;
+    Device->TimerPrev = 0;
+}
+
+void MeshNetworkInternal::TimerInsert(KnownDeviceStruct *Device)
+{
+    int64_t Due;
+    int64_t Upper;
+
+    //put it in the first slot at or after the deadline, anything overdue goes out on the next expire
+    Due = (Device->TimerDeadline + 999) / 1000;
+    if(Due < this->TimerWheelTime)
+        Due = this->TimerWheelTime;
+
+    if((Due - this->TimerWheelTime) < TIMER_WHEEL_SLOTS)
+    {
+        this->TimerLink(Device, &this->TimerWheel[Due & (TIMER_WHEEL_SLOTS - 1)]);
+        return;
+    }
+
+    //too far out for the first level, past the end of the upper level it waits in the last slot
+    Upper = Due >> TIMER_WHEEL_BITS;
+    if((Upper - (this->TimerWheelTime >> TIMER_WHEEL_BITS)) >= TIMER_WHEEL_UPPER_SLOTS)
+        Upper = (this->TimerWheelTime >> TIMER_WHEEL_BITS) + TIMER_WHEEL_UPPER_SLOTS - 1;
+    this->TimerLink(Device, &this->TimerWheelUpper[Upper & (TIMER_WHEEL_UPPER_SLOTS - 1)]);
+}
+
+void MeshNetworkInternal::TimerSchedule(KnownDeviceStruct *Device, int64_t Deadline)
+{
+    //make sure the resend thread looks at the device by Deadline, a sooner deadline is kept
+    pthread_mutex_lock(&this->TimerLock);
+    if(Device->TimerPrev)
+    {
+        if(Device->TimerDeadline <= Deadline)
+        {
+            pthread_mutex_unlock(&this->TimerLock);
+            return;
+        }
+        this->TimerUnlink(Device);
+    }
+    else
+    {
+        //an empty wheel starts from now instead of catching up on the time it sat empty
+        if(!this->TimerCount)
+            this->TimerWheelTime = esp_timer_get_time() / 1000;
+        this->TimerCount++;
+    }
+
+    Device->TimerDeadline = Deadline;
+    this->TimerInsert(Device);
+    pthread_mutex_unlock(&this->TimerLock);
+
+    //the resend thread may be sleeping past it or already past the device, 0 while it is checking
+    if(!this->ResendWake || (Deadline < this->ResendWake))
+        xSemaphoreGive(this->TXSemaphore);
+}
+
+void MeshNetworkInternal::TimerCancel(KnownDeviceStruct *Device)
+{
+    pthread_mutex_lock(&this->TimerLock);
+    if(Device->TimerPrev)
+    {
+        this->TimerUnlink(Device);
+        this->TimerCount--;
+    }
+    pthread_mutex_unlock(&this->TimerLock);
+}
+
+void MeshNetworkInternal::TimerExpire(int64_t Now)
+{
+    KnownDeviceStruct **Slot;
+    KnownDeviceStruct *Device;
+    KnownDeviceStruct *NextDevice;
+    int64_t NowMS;
+
+    //move everything due up to Now to the expired list, each ms slot is only passed over once
+    NowMS = Now / 1000;
+    pthread_mutex_lock(&this->TimerLock);
+    while(this->TimerCount && (this->TimerWheelTime <= NowMS))
+    {
+        //start of the next upper slot, move it's devices down to where they belong now
+        if(!(this->TimerWheelTime & (TIMER_WHEEL_SLOTS - 1)))
+        {
+            Slot = &this->TimerWheelUpper[(this->TimerWheelTime >> TIMER_WHEEL_BITS) & (TIMER_WHEEL_UPPER_SLOTS - 1)];
+            Device = *Slot;
+            *Slot = 0;
+            while(Device)
+            {
+                NextDevice = Device->TimerNext;
+                this->TimerInsert(Device);
+                Device = NextDevice;
+            }
+        }
+
+        Slot = &this->TimerWheel[this->TimerWheelTime & (TIMER_WHEEL_SLOTS - 1)];
+        while(*Slot)
+        {
+            Device = *Slot;
+            this->TimerUnlink(Device);
+            this->TimerLink(Device, &this->TimerExpired);
+        }
+
+        this->TimerWheelTime++;
+    }
+    pthread_mutex_unlock(&this->TimerLock);
+}
+
+MeshNetworkInternal::KnownDeviceStruct *MeshNetworkInternal::TimerPop()
+{
+    KnownDeviceStruct *Device;
+
+    //take a due device off the expired list, it can be scheduled again while it is being handled
+    pthread_mutex_lock(&this->TimerLock);
+    Device = this->TimerExpired;
+    if(Device)
+    {
+        this->TimerUnlink(Device);
+        this->TimerCount--;
+    }
+    pthread_mutex_unlock(&this->TimerLock);
+
+    return Device;
+}
+
+int64_t MeshNetworkInternal::TimerNextDeadline()
+{
+    int64_t Next;
+    int64_t Upper;
+    int i;
+
+    //when the first slot with a device in it comes up or 0 if the wheel is empty, an upper slot
+    //comes up when it's devices need to be moved down
+    Next = 0;
+    pthread_mutex_lock(&this->TimerLock);
+    if(this->TimerExpired)
+        Next = this->TimerWheelTime * 1000LL;
+    else if(this->TimerCount)
+    {
+        for(i = 0; i < TIMER_WHEEL_SLOTS; i++)
+        {
+            if(this->TimerWheel[(this->TimerWheelTime + i) & (TIMER_WHEEL_SLOTS - 1)])
+            {
+                Next = (this->TimerWheelTime + i) * 1000LL;
+                break;
+            }
+        }
+
+        for(i = 1; !Next && (i < TIMER_WHEEL_UPPER_SLOTS); i++)
+        {
+            Upper = (this->TimerWheelTime >> TIMER_WHEEL_BITS) + i;
+            if(this->TimerWheelUpper[Upper & (TIMER_WHEEL_UPPER_SLOTS - 1)])
+                Next = (Upper << TIMER_WHEEL_BITS) * 1000LL;
+        }
+    }
+    pthread_mutex_unlock(&this->TimerLock);
+
+    return Next;
+}
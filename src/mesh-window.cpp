@@ -0,0 +1,917 @@
+#include <Arduino.h>
+#include "mesh_internal.h"
+#include "mesh.h"
+#include "debug.h"
+#include <pthread.h>
+#include <string.h>
+
+//send windows let several messages to a device wait on an ack at once. each message is encrypted from the
+//session LFSR permuted by it's ID so the receiver can decrypt them in any order, out of order messages are
+//held in WindowIn until the gap before them is filled. the receiver answers every message with a
+//MSG_MessageSAck that has the next ID it needs and a bit for each later message it is holding.
+//WindowLock is recursive so the send callbacks can be called in order while it is held and still call Write.
+//received messages are queued in order and handed to the app by the rx thread once it is released
+
+//move WindowBase past messages that were acked or given up on, WindowLock must be held
+void MeshNetworkInternal::WindowAdvanceBase(KnownDeviceStruct *Device)
+{
+    while((Device->WindowBase != Device->ID_Out) && !Device->WindowOut[Device->WindowBase % Device->Window].Data)
+        Device->WindowBase++;
+}
+
+int MeshNetworkInternal::WindowWrite(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle)
+{
+    uint8_t *Buffer;
+    int Ret;
+
+    pthread_mutex_lock(&this->WindowLock);
+
+    //small messages can be held to go out with later ones, anything else has to wait for what is held
+    Ret = 0;
+    if(this->CoalesceDelay && (Device->Features & FEATURE_COALESCE) && ((DataLen + sizeof(CoalesceHeaderStruct)) <= FRAME_DATA_SIZE))
+        Ret = this->CoalesceWrite(Device, Data, DataLen, Handle);
+    else if(Device->CoalesceData)
+        Ret = this->CoalesceFlush(Device);
+
+    if(Ret)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        if(Ret < 0)
+            return Ret;
+
+        //held, if we are in reset mode then tell the other side we want to reconnect
+        if(Device->ConnectState == ConnectStateEnum::CS_Reset)
+        {
+            this->Connect(Device->MAC);
+            return MeshWriteErrors::ResettingConnection;
+        }
+        return 0;
+    }
+
+    //if the window is full then error
+    this->WindowAdvanceBase(Device);
+    if((Device->ID_Out - Device->WindowBase) >= Device->Window)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::PreviousWriteNotComplete;
+    }
+
+    DEBUG_WRITE("Sending windowed data to ");
+    DEBUG_WRITEMAC(Device->MAC);
+    DEBUG_WRITE(", ID ");
+    DEBUG_WRITE(Device->ID_Out);
+    DEBUG_WRITE("\n");
+
+    //store it off in-case we need to re-transmit
+    Buffer = (uint8_t *)malloc(DataLen);
+    if(!Buffer)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return MeshWriteErrors::OutOfMemory;
+    }
+    memcpy(Buffer, Data, DataLen);
+
+    Ret = this->WindowAdd(Device, MSG_Message, Buffer, DataLen, Handle);
+    pthread_mutex_unlock(&this->WindowLock);
+    if((Ret == MeshWriteErrors::OutOfMemory) || (Ret == MeshWriteErrors::DataTooLarge))
+        return Ret;
+
+    //if we are in reset mode then tell the other side we want to reconnect
+    if(Device->ConnectState == ConnectStateEnum::CS_Reset)
+    {
+        this->Connect(Device->MAC);
+        return MeshWriteErrors::ResettingConnection;
+    }
+
+    return Ret;
+}
+
+int MeshNetworkInternal::WindowAdd(KnownDeviceStruct *Device, uint8_t Type, uint8_t *Data, unsigned short DataLen, unsigned int Handle)
+{
+    WindowSlotStruct *Slot;
+    int Ret;
+
+    //put a message in the next slot, the caller made sure there is room and WindowLock is held. Data
+    //belongs to the window after this and is freed if the message could not be queued
+    Slot = &Device->WindowOut[Device->ID_Out % Device->Window];
+    Slot->Data = Data;
+    Slot->Len = DataLen;
+    Slot->Check = 0;
+    Slot->FastResent = 0;
+    Slot->Resent = 1;
+    Slot->Type = Type;
+    Slot->Handle = Handle;
+    Slot->FirstSent = esp_timer_get_time();
+    Slot->ResendTime = this->ResendDeadline(Device, Slot->FirstSent, Slot->FirstSent);
+
+    //only send if connected, otherwise it goes out with the resends once the connection is back
+    Ret = 0;
+    if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+    {
+        Slot->Resent = 0;
+        Ret = this->WindowSend(Device, Device->ID_Out);
+        if((Ret == MeshWriteErrors::OutOfMemory) || (Ret == MeshWriteErrors::DataTooLarge))
+        {
+            free(Slot->Data);
+            Slot->Data = 0;
+            return Ret;
+        }
+    }
+    Device->ID_Out++;
+
+    //let the resend thread know there is a message waiting on an ack
+    if(this->BroadcastFlag)
+        this->TimerSchedule(Device, Slot->ResendTime);
+
+    return Ret;
+}
+
+void MeshNetworkInternal::WindowFill(KnownDeviceStruct *Device)
+{
+    FragmentOutStruct *Fragment;
+    FragmentHeaderStruct *Header;
+    uint8_t *Buffer;
+    unsigned int Offset;
+    unsigned short Len;
+    int Ret;
+
+    //move fragments of the message being sent into the window while there is room, WindowLock must be held
+    Fragment = Device->FragmentOut;
+    while(Fragment && (Fragment->Next < Fragment->Count))
+    {
+        this->WindowAdvanceBase(Device);
+        if((Device->ID_Out - Device->WindowBase) >= Device->Window)
+            break;
+
+        Offset = Fragment->Next * FRAGMENT_DATA_SIZE;
+        Len = Fragment->Len - Offset;
+        if(Len > FRAGMENT_DATA_SIZE)
+            Len = FRAGMENT_DATA_SIZE;
+
+        Buffer = (uint8_t *)malloc(sizeof(FragmentHeaderStruct) + Len);
+        if(!Buffer)
+            break;
+
+        Header = (FragmentHeaderStruct *)Buffer;
+        Header->MessageID = Fragment->MessageID;
+        Header->Len = Fragment->Len;
+        Header->Index = Fragment->Next;
+        Header->Count = Fragment->Count;
+        memcpy(&Buffer[sizeof(FragmentHeaderStruct)], &Fragment->Data[Offset], Len);
+
+        //if it couldn't be queued then try again on the next ack or resend check
+        Ret = this->WindowAdd(Device, MSG_Fragment, Buffer, sizeof(FragmentHeaderStruct) + Len, 0);
+        if((Ret == MeshWriteErrors::OutOfMemory) || (Ret == MeshWriteErrors::DataTooLarge))
+            break;
+
+        Fragment->Next++;
+    }
+}
+
+void MeshNetworkInternal::WindowSlotDone(KnownDeviceStruct *Device, WindowSlotStruct *Slot, int Succeeded)
+{
+    FragmentOutStruct *Fragment;
+    uint16_t MessageID;
+    uint8_t *Data;
+    unsigned int Handle;
+    unsigned int Count;
+    unsigned int ID;
+    unsigned int i;
+
+    //free a message that was acked or given up on and report it, WindowLock must be held. a fragmented
+    //message is only reported once all of it is acked and coalesced messages are reported for each one
+    //in it. the slot is freed first as a callback can fill it again
+    if(Slot->Type != MSG_Fragment)
+    {
+        Data = Slot->Data;
+        Slot->Data = 0;
+        if(Slot->Type == MSG_Coalesced)
+        {
+            Count = this->CoalescedCount(Data, Slot->Len);
+            for(i = 0; i < Count; i++)
+                this->SendDone(Device, this->CoalesceHandle(Data, i), Succeeded);
+        }
+        else
+            this->SendDone(Device, Slot->Handle, Succeeded);
+
+        free(Data);
+        return;
+    }
+
+    MessageID = ((FragmentHeaderStruct *)Slot->Data)->MessageID;
+    free(Slot->Data);
+    Slot->Data = 0;
+
+    //ignore what is left of a message that already failed
+    Fragment = Device->FragmentOut;
+    if(!Fragment || (Fragment->MessageID != MessageID))
+        return;
+
+    if(Succeeded)
+    {
+        Fragment->Acked++;
+        if(Fragment->Acked == Fragment->Count)
+        {
+            Handle = Fragment->Handle;
+            free(Fragment);
+            Device->FragmentOut = 0;
+            this->SendDone(Device, Handle, 1);
+        }
+        return;
+    }
+
+    //one fragment failed so the message can't be put back together, drop the rest of it
+    Handle = Fragment->Handle;
+    free(Fragment);
+    Device->FragmentOut = 0;
+    for(ID = Device->WindowBase; ID != Device->ID_Out; ID++)
+    {
+        Slot = &Device->WindowOut[ID % Device->Window];
+        if(Slot->Data && (Slot->Type == MSG_Fragment) && (((FragmentHeaderStruct *)Slot->Data)->MessageID == MessageID))
+        {
+            free(Slot->Data);
+            Slot->Data = 0;
+        }
+    }
+
+    this->SendDone(Device, Handle, 0);
+}
+
+int MeshNetworkInternal::WindowSend(KnownDeviceStruct *Device, unsigned int ID)
+{
+    WindowSlotStruct *Slot;
+    TXFrameStruct *Frame;
+    unsigned short EncLen;
+    int Ret;
+
+    //encrypt the message for it's ID straight into the frame, WindowLock must be held
+    Slot = &Device->WindowOut[ID % Device->Window];
+    Frame = this->GetTXFrame();
+    if(!Frame)
+        return MeshWriteErrors::OutOfMemory;
+
+    EncLen = this->EncryptWindowPacket(Device, ID, Slot->Data, Slot->Len, Frame);
+    if(!EncLen)
+    {
+        this->ReleaseTXFrame(Frame);
+        return MeshWriteErrors::DataTooLarge;
+    }
+
+    DEBUG_DUMPHEX("EncPacket:", Frame->Payload, EncLen);
+
+    Ret = this->SendFrame((MessageTypeEnum)Slot->Type, Device->MAC, Frame, EncLen);
+    this->ReleaseTXFrame(Frame);
+    return Ret;
+}
+
+int MeshNetworkInternal::WindowPending(KnownDeviceStruct *Device)
+{
+    int Ret;
+
+    //return how many messages are waiting on an ack
+    pthread_mutex_lock(&this->WindowLock);
+    Ret = 0;
+    if(Device->WindowOut)
+    {
+        this->WindowAdvanceBase(Device);
+        Ret = Device->ID_Out - Device->WindowBase;
+        if(Device->FragmentOut)
+            Ret++;
+        if(Device->CoalesceData)
+            Ret += Device->CoalesceCount;
+    }
+    pthread_mutex_unlock(&this->WindowLock);
+
+    return Ret;
+}
+
+//fill in a selective ack for what has been received, WindowLock must be held
+int MeshNetworkInternal::WindowBuildSAck(KnownDeviceStruct *Device, SAckStruct *SAck)
+{
+    unsigned int Count;
+
+    //messages held from ID_In on are about to be delivered so they count as received in order
+    SAck->ID = Device->ID_In;
+    while(((SAck->ID - Device->ID_In) < Device->Window) && Device->WindowIn[SAck->ID % Device->Window].Data)
+        SAck->ID++;
+
+    //bit n covers ID + 1 + n
+    SAck->Received = 0;
+    for(Count = 0; ((SAck->ID + 1 + Count) - Device->ID_In) < Device->Window; Count++)
+    {
+        if(Device->WindowIn[(SAck->ID + 1 + Count) % Device->Window].Data)
+            SAck->Received |= (1 << Count);
+    }
+
+    //return if there is a gap being waited on
+    return (SAck->Received != 0);
+}
+
+int MeshNetworkInternal::WindowQueueDeliver(KnownDeviceStruct *Device, WindowSlotStruct *Slot)
+{
+    WindowDeliverStruct *Entry;
+
+    //take a received message out of the window for the rx thread to deliver, WindowLock must be held
+    Entry = (WindowDeliverStruct *)malloc(sizeof(WindowDeliverStruct));
+    if(!Entry)
+        return -1;
+
+    Entry->Next = 0;
+    memcpy(Entry->MAC, Device->MAC, MAC_SIZE);
+    Entry->Data = Slot->Data;
+    Entry->Len = Slot->Len;
+    Entry->Type = Slot->Type;
+    Slot->Data = 0;
+
+    if(this->WindowDeliverTail)
+        this->WindowDeliverTail->Next = Entry;
+    else
+        this->WindowDeliverHead = Entry;
+    this->WindowDeliverTail = Entry;
+
+    //the resend thread can skip a gap, wake the rx thread to deliver what that let through
+    xSemaphoreGive(this->RXSemaphore);
+    return 0;
+}
+
+void MeshNetworkInternal::WindowDeliver(KnownDeviceStruct *Device)
+{
+    WindowSlotStruct *Slot;
+
+    //queue everything that is now in order, WindowLock must be held. if there is no memory it stays
+    //in the window and goes the next time something arrives
+    while(1)
+    {
+        Slot = &Device->WindowIn[Device->ID_In % Device->Window];
+        if(!Slot->Data || this->WindowQueueDeliver(Device, Slot))
+            break;
+
+        Device->ID_In++;
+        Device->WindowGapCheck = 0;
+    }
+}
+
+void MeshNetworkInternal::WindowSkipTo(KnownDeviceStruct *Device, unsigned int ID)
+{
+    WindowSlotStruct *Slot;
+
+    //move ID_In up to ID, anything held on the way is still delivered, WindowLock must be held
+    while(Device->ID_In != ID)
+    {
+        Slot = &Device->WindowIn[Device->ID_In % Device->Window];
+        if(Slot->Data && this->WindowQueueDeliver(Device, Slot))
+        {
+            free(Slot->Data);
+            Slot->Data = 0;
+        }
+        Device->ID_In++;
+    }
+
+    Device->WindowGapCheck = 0;
+    this->WindowDeliver(Device);
+}
+
+void MeshNetworkInternal::WindowDeliverQueued()
+{
+    WindowDeliverStruct *Entry;
+    KnownDeviceStruct *Device;
+
+    //only called from the rx thread without WindowLock so the app can write or block from the callback
+    while(this->WindowDeliverHead)
+    {
+        pthread_mutex_lock(&this->WindowLock);
+        Entry = this->WindowDeliverHead;
+        this->WindowDeliverHead = Entry->Next;
+        if(!this->WindowDeliverHead)
+            this->WindowDeliverTail = 0;
+        pthread_mutex_unlock(&this->WindowLock);
+
+        //the device may have gone away since, the rest of it's fragmented message won't show up
+        if(Entry->Type == MSG_Fragment)
+        {
+            Device = this->FindKnownDevice(Entry->MAC);
+            if(Device)
+                this->HandleFragment(Device, Entry->MAC, Entry->Data, Entry->Len, 0);
+        }
+        else if(Entry->Type == MSG_Coalesced)
+            this->CoalesceDeliver(Entry->MAC, Entry->Data, Entry->Len);
+        else if(this->ReceiveMessageCallback)
+            this->ReceiveMessageCallback(Entry->MAC, Entry->Data, Entry->Len);
+
+        free(Entry->Data);
+        free(Entry);
+    }
+}
+
+void MeshNetworkInternal::WindowReceive(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *Payload, unsigned short PayloadLen)
+{
+    WindowSlotStruct *Slot;
+    SAckStruct SAck;
+    uint8_t *DecryptedMessage;
+    unsigned short DecryptedMessageLen;
+    unsigned int ID;
+    int Gap;
+
+    if(PayloadLen < sizeof(PacketHeaderStruct))
+        return;
+
+    //only IDs from a window behind to a window ahead of what we expect are looked at
+    ID = ((PacketHeaderStruct *)Payload)->SequenceID;
+    pthread_mutex_lock(&this->WindowLock);
+    if(!Device->WindowIn || (((ID - Device->ID_In) >= Device->Window) && ((Device->ID_In - ID) > Device->Window)))
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return;
+    }
+
+    //decrypt even if it is a repeat so that only valid messages get acked
+    DecryptedMessage = this->DecryptWindowPacket(Device, Header, Payload, PayloadLen, &DecryptedMessageLen);
+
+    DEBUG_WRITE("Window message decrypt results: ID ");
+    DEBUG_WRITE(ID);
+    DEBUG_WRITE(", expected ");
+    DEBUG_WRITE(Device->ID_In);
+    DEBUG_WRITE(", DecryptedMessage ");
+    DEBUG_WRITEHEXVAL(DecryptedMessage, 8);
+    DEBUG_WRITE("\n");
+
+    if(!DecryptedMessage)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return;
+    }
+
+    //hold new messages, anything already delivered or held is just acked again
+    Slot = &Device->WindowIn[ID % Device->Window];
+    if(((ID - Device->ID_In) < Device->Window) && !Slot->Data)
+    {
+        Slot->Data = DecryptedMessage;
+        Slot->Len = DecryptedMessageLen;
+        Slot->Type = Header->Type;
+    }
+    else
+        free(DecryptedMessage);
+
+    //ack before handing data to the app so the sender can keep going, then deliver what is in order
+    Gap = this->WindowBuildSAck(Device, &SAck);
+    this->SendPayload(MSG_MessageSAck, Device->MAC, &SAck, sizeof(SAck));
+
+    //if there is a gap then have the resend thread watch it
+    if(Gap && this->BroadcastFlag)
+        this->TimerSchedule(Device, esp_timer_get_time());
+
+    this->WindowDeliver(Device);
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+void MeshNetworkInternal::WindowAck(KnownDeviceStruct *Device, const uint8_t *Payload, unsigned short PayloadLen)
+{
+    WindowSlotStruct *Slot;
+    SAckStruct SAck;
+    unsigned int ID;
+    unsigned int Highest;
+    unsigned int Base;
+    unsigned int End;
+    int64_t Now;
+    int64_t Sample;
+
+    if(PayloadLen < sizeof(SAckStruct))
+        return;
+
+    memcpy(&SAck, Payload, sizeof(SAck));
+    pthread_mutex_lock(&this->WindowLock);
+
+    //ignore acks for messages we haven't sent
+    if(!Device->WindowOut || ((SAck.ID - Device->WindowBase) > (Device->ID_Out - Device->WindowBase)))
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return;
+    }
+
+    //free everything before the ID and everything flagged after it, the newest message acked that was
+    //only sent once times the round trip. the range is fixed first as the app can write from the callbacks
+    Now = esp_timer_get_time();
+    Sample = -1;
+    Highest = SAck.ID;
+    Base = Device->WindowBase;
+    End = Device->ID_Out;
+    for(ID = Base; ID != End; ID++)
+    {
+        if((ID - Base) >= (SAck.ID - Base))
+        {
+            if((ID == SAck.ID) || ((ID - SAck.ID) > 32) || !((SAck.Received >> (ID - SAck.ID - 1)) & 1))
+                continue;
+            Highest = ID;
+        }
+
+        Slot = &Device->WindowOut[ID % Device->Window];
+        if(Slot->Data)
+        {
+            if(!Slot->Resent)
+                Sample = Now - Slot->FirstSent;
+            this->WindowSlotDone(Device, Slot, 1);
+        }
+    }
+
+    if(Sample >= 0)
+        this->UpdateRTT(Device, Sample);
+
+    //anything missing below a message that got through was most likely lost, send it again once
+    //without waiting on the resend thread
+    for(ID = SAck.ID; ID != Highest; ID++)
+    {
+        Slot = &Device->WindowOut[ID % Device->Window];
+        if(Slot->Data && !Slot->FastResent)
+        {
+            Slot->FastResent = 1;
+            Slot->Resent = 1;
+            Slot->ResendTime = this->ResendDeadline(Device, Slot->FirstSent, Now);
+            Device->PeerStats.FastRetransmits++;
+            this->WindowSend(Device, ID);
+        }
+    }
+
+    //more of a fragmented message can go out now, held messages go once everything was acked and
+    //then anything queued
+    this->WindowAdvanceBase(Device);
+    this->WindowFill(Device);
+    if(Device->CoalesceData && ((Device->ID_Out == Device->WindowBase) || (Device->CoalesceFlush <= Now)))
+        this->CoalesceFlush(Device);
+    this->AsyncDrain(Device);
+
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+int MeshNetworkInternal::WindowCheck(KnownDeviceStruct *Device, int64_t Now, int Tick, int64_t *NextResend)
+{
+    WindowSlotStruct *Slot;
+    SAckStruct SAck;
+    unsigned int ID;
+    int Pending;
+    int Failed;
+    int BackedOff;
+
+    //same timing as the single message resend in CheckResends but per message, returns if
+    //anything still needs watching and lowers NextResend to the next resend due
+    pthread_mutex_lock(&this->WindowLock);
+    if(!Device->WindowOut)
+    {
+        pthread_mutex_unlock(&this->WindowLock);
+        return 0;
+    }
+
+    Pending = 0;
+    Failed = 0;
+    BackedOff = 0;
+    this->WindowAdvanceBase(Device);
+    for(ID = Device->WindowBase; ID != Device->ID_Out; ID++)
+    {
+        Slot = &Device->WindowOut[ID % Device->Window];
+        if(!Slot->Data)
+            continue;
+
+        //set our flag so we can keep checking but only send if we are connected and not in reset
+        Pending = 1;
+        if(Device->ConnectState == ConnectStateEnum::CS_ResetConnecting)
+        {
+            if(Tick)
+                Slot->Check++;
+            if(Slot->Check >= 5)  //2.5 seconds due to 500ms delay
+                Failed = 1;
+        }
+        else if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+        {
+            if(Now >= Slot->ResendTime)
+            {
+                //if we have waited long enough then stop waiting
+                if((Now - Slot->FirstSent) >= (RESEND_GIVE_UP_MS * 1000LL))
+                {
+                    Device->PeerStats.Timeouts++;
+                    this->WindowSlotDone(Device, Slot, 0);
+                    continue;
+                }
+
+                DEBUG_WRITE((unsigned long) (esp_timer_get_time() / 1000ULL));
+                DEBUG_WRITE(": Message ");
+                DEBUG_WRITE(ID);
+                DEBUG_WRITE(" sent to ");
+                DEBUG_WRITEMAC(Device->MAC);
+                DEBUG_WRITE(" being resent, len ");
+                DEBUG_WRITE(Slot->Len);
+                DEBUG_WRITE("\n");
+
+                //the wait only doubles once however many messages ran out together
+                if(!BackedOff)
+                {
+                    BackedOff = 1;
+                    this->BackoffRTO(Device);
+                }
+
+                //resend, a later ack can fast resend it again
+                Slot->FastResent = 0;
+                Slot->Resent = 1;
+                Slot->ResendTime = this->ResendDeadline(Device, Slot->FirstSent, Now);
+                Device->PeerStats.Retransmits++;
+                this->WindowSend(Device, ID);
+            }
+
+            if(!*NextResend || (Slot->ResendTime < *NextResend))
+                *NextResend = Slot->ResendTime;
+        }
+    }
+
+    //taken too long reset connect state and give up on everything waiting on it
+    if(Failed)
+    {
+        Device->ConnectState = ConnectStateEnum::CS_Reset;
+        this->WindowFail(Device);
+    }
+
+    //anything that couldn't be queued before
+    this->WindowAdvanceBase(Device);
+    if(Device->ConnectState == ConnectStateEnum::CS_Connected)
+        this->WindowFill(Device);
+    if(Device->FragmentOut || Device->CoalesceData)
+        Pending = 1;
+
+    //if a message we are missing hasn't shown up then the sender gave up on it, skip to what we have
+    if(this->WindowBuildSAck(Device, &SAck))
+    {
+        Pending = 1;
+        if(Tick)
+            Device->WindowGapCheck++;
+        if(Device->WindowGapCheck >= WINDOW_GAP_TICKS)
+        {
+            DEBUG_WRITE("Skipping missing message ");
+            DEBUG_WRITE(Device->ID_In);
+            DEBUG_WRITE(" from ");
+            DEBUG_WRITEMAC(Device->MAC);
+            DEBUG_WRITE("\n");
+
+            //move up to the next message held
+            Device->ID_In++;
+            while(!Device->WindowIn[Device->ID_In % Device->Window].Data)
+                Device->ID_In++;
+            Device->WindowGapCheck = 0;
+
+            //let the sender know where we are now
+            this->WindowBuildSAck(Device, &SAck);
+            this->SendPayload(MSG_MessageSAck, Device->MAC, &SAck, sizeof(SAck));
+            this->WindowDeliver(Device);
+        }
+    }
+    else
+        Device->WindowGapCheck = 0;
+
+    pthread_mutex_unlock(&this->WindowLock);
+    return Pending;
+}
+
+void MeshNetworkInternal::WindowFail(KnownDeviceStruct *Device)
+{
+    WindowSlotStruct *Slot;
+    unsigned int Handle;
+    unsigned int ID;
+    unsigned int End;
+
+    //give up on everything waiting to go to the device, WindowLock must be held. the range is fixed
+    //first so anything written from the callbacks is kept
+    End = Device->ID_Out;
+    for(ID = Device->WindowBase; ID != End; ID++)
+    {
+        Slot = &Device->WindowOut[ID % Device->Window];
+        if(Slot->Data)
+            this->WindowSlotDone(Device, Slot, 0);
+    }
+
+    //what is left of a fragmented message that wasn't in the window yet
+    if(Device->FragmentOut)
+    {
+        Handle = Device->FragmentOut->Handle;
+        free(Device->FragmentOut);
+        Device->FragmentOut = 0;
+        this->SendDone(Device, Handle, 0);
+    }
+
+    this->CoalesceFail(Device);
+    this->WindowAdvanceBase(Device);
+}
+
+void MeshNetworkInternal::WindowResetIDs(KnownDeviceStruct *Device)
+{
+    WindowSlotStruct Pending[SEND_WINDOW_MAX];
+    unsigned int PendingCount;
+    unsigned int ID;
+    unsigned int i;
+
+    //a new connection numbers messages from 0 again, move anything still waiting on an ack to the
+    //start of the window so it is numbered from 0 as well until SetWindow picks it up
+    pthread_mutex_lock(&this->WindowLock);
+    PendingCount = 0;
+    if(Device->WindowOut)
+    {
+        for(ID = Device->WindowBase; ID != Device->ID_Out; ID++)
+        {
+            if(Device->WindowOut[ID % Device->Window].Data)
+                Pending[PendingCount++] = Device->WindowOut[ID % Device->Window];
+            Device->WindowOut[ID % Device->Window].Data = 0;
+        }
+
+        for(i = 0; i < PendingCount; i++)
+            Device->WindowOut[i] = Pending[i];
+    }
+
+    //nothing held for the old connection is still valid
+    if(Device->WindowIn)
+    {
+        for(i = 0; i < Device->Window; i++)
+        {
+            if(Device->WindowIn[i].Data)
+                free(Device->WindowIn[i].Data);
+            Device->WindowIn[i].Data = 0;
+        }
+    }
+
+    Device->ID_In = 0;
+    Device->ID_Out = PendingCount;
+    Device->WindowBase = 0;
+    Device->WindowGapCheck = 0;
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+void MeshNetworkInternal::SetWindow(KnownDeviceStruct *Device, uint8_t Window)
+{
+    WindowSlotStruct Pending[SEND_WINDOW_MAX];
+    unsigned int PendingCount;
+    unsigned int Handle;
+    unsigned int ID;
+    unsigned int i;
+    int64_t Now;
+
+    //called once a connection picks it's window after WindowResetIDs, messages still waiting from
+    //before are renumbered from WindowBase so they go out again on the new connection
+    pthread_mutex_lock(&this->WindowLock);
+    PendingCount = 0;
+    if(Device->LastOutMessage)
+    {
+        Pending[PendingCount].Data = Device->LastOutMessage;
+        Pending[PendingCount].Len = Device->LastOutMessageLen;
+        Pending[PendingCount].Type = MSG_Message;
+        Pending[PendingCount].Handle = Device->LastOutMessageHandle;
+        PendingCount++;
+        Device->LastOutMessage = 0;
+        Device->LastOutMessageLen = 0;
+        Device->LastOutMessageCheck = 0;
+    }
+
+    if(Device->WindowOut)
+    {
+        for(ID = Device->WindowBase; ID != Device->ID_Out; ID++)
+        {
+            if(Device->WindowOut[ID % Device->Window].Data)
+                Pending[PendingCount++] = Device->WindowOut[ID % Device->Window];
+            Device->WindowOut[ID % Device->Window].Data = 0;
+        }
+    }
+
+    //nothing held for the old connection is still valid
+    if(Device->WindowIn)
+    {
+        for(i = 0; i < Device->Window; i++)
+        {
+            if(Device->WindowIn[i].Data)
+                free(Device->WindowIn[i].Data);
+        }
+    }
+
+    //reallocate if the size changed
+    if(Device->Window != Window)
+    {
+        free(Device->WindowOut);
+        free(Device->WindowIn);
+        Device->WindowOut = 0;
+        Device->WindowIn = 0;
+        Device->Window = 0;
+        if(Window > 1)
+        {
+            Device->WindowOut = (WindowSlotStruct *)calloc(Window, sizeof(WindowSlotStruct));
+            Device->WindowIn = (WindowSlotStruct *)calloc(Window, sizeof(WindowSlotStruct));
+            Device->Window = Window;
+
+            //if no memory then stay one at a time, the side picking reports the window it ended up with
+            if(!Device->WindowOut || !Device->WindowIn)
+            {
+                free(Device->WindowOut);
+                free(Device->WindowIn);
+                Device->WindowOut = 0;
+                Device->WindowIn = 0;
+                Device->Window = 0;
+            }
+        }
+    }
+    else if(Device->WindowIn)
+        memset(Device->WindowIn, 0, Device->Window * sizeof(WindowSlotStruct));
+
+    Device->ID_Out = Device->WindowBase;
+    Device->WindowGapCheck = 0;
+
+    //put the waiting messages back, the first one goes in LastOutMessage if one at a time. fragments
+    //can't be sent one at a time. they go out on the next resend check and the wait for giving up starts over
+    Now = esp_timer_get_time();
+    for(i = 0; i < PendingCount; i++)
+    {
+        Pending[i].Check = 0;
+        Pending[i].FastResent = 0;
+        Pending[i].Resent = 1;
+        Pending[i].FirstSent = Now;
+        Pending[i].ResendTime = Now;
+        if(Device->Window && (i < Device->Window))
+        {
+            Device->WindowOut[Device->ID_Out % Device->Window] = Pending[i];
+            Device->ID_Out++;
+        }
+        else if(!Device->Window && !i && (Pending[i].Type == MSG_Message))
+        {
+            Device->LastOutMessage = Pending[i].Data;
+            Device->LastOutMessageLen = Pending[i].Len;
+            Device->LastOutMessageCheck = 0;
+            Device->LastOutMessageResent = 1;
+            Device->LastOutMessageSent = Now;
+            Device->LastOutMessageResend = Now;
+            Device->LastOutMessageHandle = Pending[i].Handle;
+        }
+        else
+            this->WindowSlotDone(Device, &Pending[i], 0);
+    }
+
+    if(Device->FragmentOut && !Device->Window)
+    {
+        Handle = Device->FragmentOut->Handle;
+        free(Device->FragmentOut);
+        Device->FragmentOut = 0;
+        this->SendDone(Device, Handle, 0);
+    }
+    else if(Device->FragmentOut)
+        this->WindowFill(Device);
+
+    //held messages can only go out if the device still splits them up
+    if(Device->CoalesceData && (!Device->Window || !(Device->Features & FEATURE_COALESCE)))
+        this->CoalesceFail(Device);
+
+    if((PendingCount || Device->FragmentOut) && this->BroadcastFlag)
+        this->TimerSchedule(Device, Now);
+
+    //a message being put back together won't be finished on the new connection
+    pthread_mutex_lock(&this->FragmentLock);
+    if(Device->FragmentIn)
+    {
+        free(Device->FragmentIn->Data);
+        free(Device->FragmentIn);
+        Device->FragmentIn = 0;
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
+
+    pthread_mutex_unlock(&this->WindowLock);
+}
+
+void MeshNetworkInternal::FreeWindow(KnownDeviceStruct *Device)
+{
+    unsigned int i;
+
+    //the device is going away, report everything still waiting to go to it as failed before freeing.
+    //it is already out of the device table so anything written from the callbacks doesn't land here
+    pthread_mutex_lock(&this->WindowLock);
+    if(Device->WindowOut)
+        this->WindowFail(Device);
+    else
+        this->CoalesceFail(Device);
+    this->AsyncFail(Device);
+
+    for(i = 0; i < Device->Window; i++)
+    {
+        if(Device->WindowOut && Device->WindowOut[i].Data)
+            free(Device->WindowOut[i].Data);
+        if(Device->WindowIn && Device->WindowIn[i].Data)
+            free(Device->WindowIn[i].Data);
+    }
+
+    free(Device->WindowOut);
+    free(Device->WindowIn);
+    free(Device->FragmentOut);
+    free(Device->CoalesceData);
+    Device->WindowOut = 0;
+    Device->WindowIn = 0;
+    Device->FragmentOut = 0;
+    Device->CoalesceData = 0;
+    Device->Window = 0;
+
+    pthread_mutex_lock(&this->FragmentLock);
+    if(Device->FragmentIn)
+    {
+        free(Device->FragmentIn->Data);
+        free(Device->FragmentIn);
+        Device->FragmentIn = 0;
+    }
+    pthread_mutex_unlock(&this->FragmentLock);
+    pthread_mutex_unlock(&this->WindowLock);
+}
@@ -3,6 +3,7 @@
 #include "mesh.h"
 #include <esp_wifi.h>
 #include <pthread.h>
+#include <esp_pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -25,8 +26,22 @@ MeshNetworkInternal::MeshNetworkInternal(MeshNetworkData *InitData, MeshInitErro
     this->Initialized = 0;
     this->PingData = 0;
     this->PingDataLen = 0;
-    this->MeshMessageBegin = 0;
-    this->MeshMessageTail = 0;
+    memset(this->RXQueues, 0, sizeof(this->RXQueues));
+    this->RXUnicastCredit = RX_UNICAST_WEIGHT;
+    this->RXProducerBusy = 0;
+    memset(this->RXDedup, 0, sizeof(this->RXDedup));
+    memset(this->SeenCache, 0, sizeof(this->SeenCache));
+    this->SeenCacheSwept = this->SeenCacheEpoch();
+    memset(&this->Stats, 0, sizeof(this->Stats));
+
+    //diffie hellman pool is empty until the thread fills it
+    pthread_mutex_init(&this->DHPoolLock, NULL);
+    pthread_cond_init(&this->DHPoolCond, NULL);
+    this->DHPoolCount = 0;
+    this->DHPoolDepth = 0;
+    this->DHPoolGeneration = 0;
+    this->DHPoolPaused = 0;
+    this->DHPoolBusy = 0;
     
     //check pointers passed in
     if(!Initialized)
@@ -50,6 +65,7 @@ MeshNetworkInternal::MeshNetworkInternal(MeshNetworkData *InitData, MeshInitErro
         *Initialized = MeshInitErrors::FailedToGetMac;
         return;
     }
+    this->BroadcastMACCRC = this->CalculateBroadcastMACCRC(this->MAC);
 
     //setup diffie hellman
     Ret = this->DHInit(InitData->DiffieHellman_P, InitData->DiffieHellman_G);
@@ -67,10 +83,130 @@ MeshNetworkInternal::MeshNetworkInternal(MeshNetworkData *InitData, MeshInitErro
         return;
     }
 
+    //setup the cipher suites
+    if((InitData->CipherSuite >= CipherSuiteCount) || (InitData->BroadcastCipherSuite >= CipherSuiteCount))
+    {
+        *Initialized = MeshInitErrors::InvalidCipherSuite;
+        return;
+    }
+    this->CipherSuites[CipherLFSR] = new LFSRCipherSuite(this);
+    this->CipherSuites[CipherChaCha20] = new ChaCha20CipherSuite(this);
+    this->CipherSuitePreferred = InitData->CipherSuite;
+    this->CipherSuiteBroadcast = InitData->BroadcastCipherSuite;
+    this->CipherSuiteStrict = InitData->StrictCipherSuite;
+    this->BatchMode = this->SelectBatchMode();
+
     //set default params
     memset(this->KnownDeviceTable, 0, sizeof(this->KnownDeviceTable));
     memset(this->UnknownDeviceTable, 0, sizeof(this->UnknownDeviceTable));
 
+    //fill the tx frame pool, if memory is short sending falls back to allocating frames
+    pthread_mutex_init(&this->TXFrameLock, NULL);
+    this->TXFramePool = 0;
+    for(Ret = 0; Ret < TX_FRAME_COUNT; Ret++)
+    {
+        TXFrameStruct *Frame = (TXFrameStruct *)malloc(sizeof(TXFrameStruct));
+        if(!Frame)
+            break;
+        Frame->Pooled = 1;
+        Frame->Next = this->TXFramePool;
+        this->TXFramePool = Frame;
+    }
+
+    //send window offered to devices that support it
+    pthread_mutexattr_t WindowLockAttr;
+    pthread_mutexattr_init(&WindowLockAttr);
+    pthread_mutexattr_settype(&WindowLockAttr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&this->WindowLock, &WindowLockAttr);
+    pthread_mutexattr_destroy(&WindowLockAttr);
+    this->WindowDeliverHead = 0;
+    this->WindowDeliverTail = 0;
+    this->SendWindow = InitData->SendWindow ? InitData->SendWindow : SEND_WINDOW_DEFAULT;
+    if(this->SendWindow > SEND_WINDOW_MAX)
+        this->SendWindow = SEND_WINDOW_MAX;
+    else if(this->SendWindow < 2)
+        this->SendWindow = 0;
+
+    //largest message, anything that fits in a frame is always allowed
+    pthread_mutex_init(&this->FragmentLock, NULL);
+    memset(this->BroadcastReassembly, 0, sizeof(this->BroadcastReassembly));
+    this->FragmentMsgID = esp_random();
+    this->MaxMessageSize = InitData->MaxMessageSize ? InitData->MaxMessageSize : MESSAGE_DEFAULT_MAX;
+    if(this->MaxMessageSize < FRAME_DATA_SIZE)
+        this->MaxMessageSize = FRAME_DATA_SIZE;
+
+    //holding small messages to send together is off unless asked for
+    this->CoalesceDelay = InitData->CoalesceDelay;
+
+    //messages WriteAsync can queue per device
+    this->AsyncQueueDepth = InitData->WriteQueueDepth ? InitData->WriteQueueDepth : ASYNC_QUEUE_DEFAULT;
+    this->AsyncHandle = 0;
+
+    //bounds for the resend timeout, the max can't be below the min
+    this->RTOMin = (InitData->RTOMin ? InitData->RTOMin : RTO_DEFAULT_MIN_MS) * 1000;
+    this->RTOMax = (InitData->RTOMax ? InitData->RTOMax : RTO_DEFAULT_MAX_MS) * 1000;
+    if(this->RTOMax < this->RTOMin)
+        this->RTOMax = this->RTOMin;
+    this->ResendWake = 0;
+
+    //nothing is waiting on the resend thread yet
+    pthread_mutex_init(&this->TimerLock, NULL);
+    memset(this->TimerWheel, 0, sizeof(this->TimerWheel));
+    memset(this->TimerWheelUpper, 0, sizeof(this->TimerWheelUpper));
+    this->TimerExpired = 0;
+    this->TimerWheelTime = 0;
+    this->TimerCount = 0;
+
+    //rebroadcast queue is empty
+    pthread_mutex_init(&this->RebroadcastLock, NULL);
+    this->RebroadcastCount = 0;
+    pthread_mutex_init(&this->BroadcastTXLock, NULL);
+    this->BroadcastTXHead = 0;
+    this->BroadcastTXTail = 0;
+    this->BroadcastTXTime = 0;
+
+    //received frames are copied into fixed rings so the wifi callback never allocates, this caps the
+    //memory and frames that can be waiting no matter how much arrives
+    if(InitData->RXDropPolicy >= RXDropPolicyCount)
+    {
+        *Initialized = MeshInitErrors::InvalidRXDropPolicy;
+        return;
+    }
+    this->RXDropPolicy = InitData->RXDropPolicy;
+    this->RXMaxAge = (InitData->RXMaxAge ? InitData->RXMaxAge : RX_DEFAULT_MAX_AGE_MS) * 1000LL;
+
+    this->RXQueues[RXClassControl].Slots = RX_CONTROL_SLOTS;
+    this->RXQueues[RXClassUnicast].Slots = RX_UNICAST_SLOTS;
+    this->RXQueues[RXClassBroadcast].Slots = RX_BROADCAST_SLOTS;
+    for(Ret = 0; Ret < RXClassCount; Ret++)
+    {
+        //round down to a power of 2
+        if(InitData->RXQueueFrames[Ret])
+        {
+            this->RXQueues[Ret].Slots = 1;
+            while(((this->RXQueues[Ret].Slots << 1) <= InitData->RXQueueFrames[Ret]) && (this->RXQueues[Ret].Slots < RX_MAX_SLOTS))
+                this->RXQueues[Ret].Slots <<= 1;
+        }
+
+        this->RXQueues[Ret].Ring = (RXSlotStruct *)malloc(sizeof(RXSlotStruct) * this->RXQueues[Ret].Slots);
+        if(!this->RXQueues[Ret].Ring)
+            break;
+    }
+    this->RXSemaphore = xSemaphoreCreateBinary();
+    this->TXSemaphore = xSemaphoreCreateBinary();
+    if((Ret != RXClassCount) || !this->RXSemaphore || !this->TXSemaphore)
+    {
+        //don't leak the rings that did get allocated
+        for(Ret = 0; Ret < RXClassCount; Ret++)
+        {
+            free(this->RXQueues[Ret].Ring);
+            this->RXQueues[Ret].Ring = 0;
+        }
+
+        *Initialized = MeshInitErrors::FailedMemoryInit;
+        return;
+    }
+
     //setup callbacks
     this->ReceiveMessageCallback = InitData->ReceiveMessageCallback;
     this->BroadcastMessageCallback = InitData->BroadcastMessageCallback;
@@ -78,9 +214,10 @@ MeshNetworkInternal::MeshNetworkInternal(MeshNetworkData *InitData, MeshInitErro
     this->SendFailedCallback = InitData->SendFailedCallback;
     this->PingCallback = InitData->PingCallback;
     this->SendMessageCallback = InitData->SendMessageCallback;
+    this->SendFrameCallback = InitData->SendFrameCallback;
+    this->WriteCompleteCallback = InitData->WriteCompleteCallback;
 
     //setup our global info
-    this->MessageWasSent = 0;
     this->BroadcastFlag = InitData->BroadcastFlag;
     _GlobalMesh = this;
 
@@ -119,6 +256,33 @@ MeshNetworkInternal::MeshNetworkInternal(MeshNetworkData *InitData, MeshInitErro
         return;
     }
 
+    //create the low priority thread that precomputes diffie hellman challenges
+    this->DHPoolDepth = InitData->DHPoolDepth ? InitData->DHPoolDepth : DH_POOL_DEFAULT_DEPTH;
+    if(this->DHPoolDepth > DH_POOL_MAX_DEPTH)
+        this->DHPoolDepth = DH_POOL_MAX_DEPTH;
+
+    //keep the priority to what FreeRTOS allows, if it still can't be set the pool runs at the default priority
+    esp_pthread_cfg_t PoolCfg = esp_pthread_get_default_config();
+    PoolCfg.prio = InitData->DHPoolPriority ? InitData->DHPoolPriority : DH_POOL_DEFAULT_PRIORITY;
+    if(PoolCfg.prio > (configMAX_PRIORITIES - 1))
+        PoolCfg.prio = configMAX_PRIORITIES - 1;
+    PoolCfg.thread_name = "mesh-dh";
+    if(esp_pthread_set_cfg(&PoolCfg) != ESP_OK)
+    {
+        PoolCfg = esp_pthread_get_default_config();
+        esp_pthread_set_cfg(&PoolCfg);
+    }
+    Ret = pthread_create(&this->DHPoolThreadID, NULL, Static_DHPoolThread, 0);
+    PoolCfg = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&PoolCfg);
+    if(Ret)
+    {
+        //failed
+        *Initialized = MeshInitErrors::FailedThreadInit;
+        _GlobalMesh = 0;
+        return;
+    }
+
     //done
     this->Initialized = 1;
     *Initialized = MeshInitErrors::MeshInitialized;
@@ -175,6 +339,7 @@ void MeshNetworkInternal::ReloadConnections()
     }
 
     this->BroadcastMsgID = this->prefs->getUInt("broadcastid", 0);
+    this->BroadcastMsgIDSaved = this->BroadcastMsgID;
     this->prefs->end();
 }
 
@@ -199,29 +364,61 @@ void MeshNetworkInternal::ProcessMessage(const uint8_t *Data, uint16_t Len)
 {
     size_t InLen;
     uint8_t *InData;
-    uint8_t *ProcessData;
 
     InData = base64_decode(Data, Len, &InLen);
     if(!InData)
         return;
 
-    //decode successful, add the ctrl header to the beginning to align everything
-    ProcessData = (uint8_t *)malloc(InLen + sizeof(wifi_pkt_rx_ctrl_t));
-    if(ProcessData)
-    {
-        memset(ProcessData, 0, sizeof(wifi_pkt_rx_ctrl_t));
-        memcpy(&ProcessData[sizeof(wifi_pkt_rx_ctrl_t)], InData, InLen);
-        ((wifi_pkt_rx_ctrl_t *)ProcessData)->sig_len = InLen + 4;
-
-        //call our internal function as if the data showed up normally
-        this->PromiscuousRX((void *)ProcessData, WIFI_PKT_MGMT);
-        free(ProcessData);
-    }
+    //decode successful, frames are never larger than a uint16_t
+    if(InLen <= 0xffff)
+        this->ProcessFrame(InData, InLen);
 
     free(InData);
 }
 
+void MeshNetworkInternal::ProcessFrame(const uint8_t *Data, uint16_t Len)
+{
+    //queue it as if the frame showed up normally, only one frame can be added at a time so wait for the
+    //wifi callback if it is adding one
+    while(__atomic_test_and_set(&this->RXProducerBusy, __ATOMIC_ACQUIRE))
+        yield();
+    this->AddRXFrame(Data, Len);
+    __atomic_clear(&this->RXProducerBusy, __ATOMIC_RELEASE);
+}
+
 bool MeshNetworkInternal::CanBroadcast()
 {
     return this->BroadcastFlag;
+}
+
+void MeshNetworkInternal::GetStats(MeshStats *Stats)
+{
+    unsigned int Tail;
+    int i;
+
+    *Stats = this->Stats;
+    for(i = 0; i < RXClassCount; i++)
+    {
+        //evicted frames the rx thread has not passed yet are not queued
+        Tail = __atomic_load_n(&this->RXQueues[i].Tail, __ATOMIC_RELAXED);
+        if((int)(__atomic_load_n(&this->RXQueues[i].Evicted, __ATOMIC_RELAXED) - Tail) > 0)
+            Tail = __atomic_load_n(&this->RXQueues[i].Evicted, __ATOMIC_RELAXED);
+        Stats->RXClassDepth[i] = __atomic_load_n(&this->RXQueues[i].Head, __ATOMIC_RELAXED) - Tail;
+    }
+}
+
+int MeshNetworkInternal::GetPeerStats(const uint8_t MAC[MAC_SIZE], MeshPeerStats *Stats)
+{
+    KnownDeviceStruct *Device;
+
+    Device = this->FindKnownDevice(MAC);
+    if(!Device)
+        return -1;
+
+    //the window lock keeps the counters from changing part way through
+    pthread_mutex_lock(&this->WindowLock);
+    *Stats = Device->PeerStats;
+    Stats->RTO = this->GetRTO(Device);
+    pthread_mutex_unlock(&this->WindowLock);
+    return 0;
 }
\ No newline at end of file
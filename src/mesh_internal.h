@@ -8,10 +8,121 @@
 #include <esp_wifi.h>
 #include <pthread.h>
 #include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 #define TABLE_SIZE 8
 #define TABLE_MASK (TABLE_SIZE - 1)
 #define MAX_PACKET_SIZE 1000
+#define TX_FRAME_COUNT 4
+
+//frames queued between the wifi callback and the rx thread per class when MeshNetworkData leaves it 0,
+//each must be a power of 2 no larger than RX_MAX_SLOTS
+#define RX_CONTROL_SLOTS 4
+#define RX_UNICAST_SLOTS 8
+#define RX_BROADCAST_SLOTS 16
+#define RX_MAX_SLOTS 64
+
+//default for MeshNetworkData::RXMaxAge, acks older than this have already been given up on
+#define RX_DEFAULT_MAX_AGE_MS 2000
+
+//control frames are always handled first, then this many unicast frames for each broadcast frame
+#define RX_UNICAST_WEIGHT 4
+
+//broadcasts waiting to be repeated, a repeat is cancelled if REBROADCAST_COPIES other copies are seen first
+//in the rx queue or the seen cache
+#define REBROADCAST_QUEUE_SIZE 16
+#define REBROADCAST_COPIES 3
+
+//how often connection timeouts and gaps in received messages are counted for a device while it has something
+//waiting, resends go out whenever they are due
+#define RESEND_INTERVAL_MS 500
+
+//devices waiting on the resend thread are kept in a timing wheel of TIMER_WHEEL_SLOTS 1ms slots, later
+//deadlines go in TIMER_WHEEL_UPPER_SLOTS slots of TIMER_WHEEL_SLOTS ms each and move down as they come up.
+//anything further out waits in the last upper slot and is put back when that comes up. both are powers of 2
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_UPPER_SLOTS 64
+
+//the wait for an ack before resending is worked out per device from the timed acks as SRTT + 4 * RTTVAR and
+//doubles each time it runs out. RTO_INITIAL_MS is used until an ack is timed and RTO_DEFAULT_* when
+//MeshNetworkData leaves RTOMin and RTOMax 0. a message is given up on RESEND_GIVE_UP_MS after it was first
+//sent however many resends that took
+#define RTO_INITIAL_MS 250
+#define RTO_DEFAULT_MIN_MS 20
+#define RTO_DEFAULT_MAX_MS 1000
+#define RESEND_GIVE_UP_MS 2500
+
+//index of queued rx messages used to count repeats, RX_DEDUP_SETS must be a power of 2
+#define RX_DEDUP_SETS 8
+#define RX_DEDUP_WAYS 4
+
+//broadcasts already handled, checked before queueing so relayed copies are dropped in the wifi callback.
+//a cuckoo filter of SEEN_CACHE_BUCKETS * SEEN_CACHE_WAYS fingerprints, entries expire after
+//SEEN_CACHE_EPOCHS epochs of about a second each. SEEN_CACHE_BUCKETS must be a power of 2
+#define SEEN_CACHE_BUCKETS 64
+#define SEEN_CACHE_WAYS 4
+#define SEEN_CACHE_EPOCHS 10
+#define SEEN_CACHE_KICKS 8
+
+//unicast messages that can be waiting on an ack per device when both sides support it, the max is the
+//bits in SAckStruct::Received. a gap in incoming messages is waited on for WINDOW_GAP_TICKS resend
+//checks before it is skipped, longer than the sender takes to give up on it
+#define SEND_WINDOW_DEFAULT 8
+#define SEND_WINDOW_MAX 32
+#define WINDOW_GAP_TICKS 7
+
+//messages too large for a frame are split into fragments, MESSAGE_DEFAULT_MAX is used when MeshNetworkData
+//leaves MaxMessageSize 0. up to FRAGMENT_REASSEMBLY_SLOTS fragmented broadcasts are put back together at
+//once, a fragmented message that gets nothing new for FRAGMENT_TIMEOUT_MS is discarded
+#define MESSAGE_DEFAULT_MAX 8192
+#define FRAGMENT_REASSEMBLY_SLOTS 4
+#define FRAGMENT_TIMEOUT_MS 5000
+#define FRAGMENT_BROADCAST_GAP_MS 1
+
+//messages WriteAsync holds per device when MeshNetworkData leaves WriteQueueDepth 0. queued messages wait up to
+//ASYNC_CONNECT_TICKS resend checks for a connection before they fail
+#define ASYNC_QUEUE_DEFAULT 16
+#define ASYNC_CONNECT_TICKS 5
+
+//most messages held to go out together, the handle for each is kept after the FRAME_DATA_SIZE bytes of
+//CoalesceData
+#define COALESCE_MAX_MESSAGES 32
+
+//CapabilityStruct::Features bits
+#define FEATURE_COALESCE 0x01                   //can split MSG_Coalesced frames
+
+//largest message that fits in one frame after the packet header and valid packet ID, and the part of
+//a fragment left after it's header. only usable inside MeshNetworkInternal
+#define FRAME_DATA_SIZE (field_sizeof(TXFrameStruct, Payload) - sizeof(PacketHeaderStruct) - sizeof(unsigned int))
+#define FRAGMENT_DATA_SIZE (FRAME_DATA_SIZE - sizeof(FragmentHeaderStruct))
+
+//precomputed diffie hellman challenges, the defaults are used when 0 is passed in during init
+#define DH_POOL_DEFAULT_DEPTH 4
+#define DH_POOL_MAX_DEPTH 16
+#define DH_POOL_DEFAULT_PRIORITY 1
+
+//bits of the private value handled per lookup in the fixed base table for DH_G, 0 disables the table
+//the table takes (64 / bits) * (2^bits - 1) * 8 bytes, 4 bits is 1920 bytes and 16 multiplies per challenge
+#ifndef DH_FIXED_BASE_BITS
+#define DH_FIXED_BASE_BITS 4
+#endif
+#if DH_FIXED_BASE_BITS > 8
+#error DH_FIXED_BASE_BITS can not be larger than 8
+#endif
+#define DH_FIXED_BASE_WINDOWS(bits) ((64 + (bits) - 1) / (bits))
+#define DH_FIXED_BASE_DIGITS(bits) ((1 << (bits)) - 1)
+
+//most independent streams EncryptBatch/DecryptBatch run side by side, x86 builds pick SSE2 or AVX2
+//lanes at runtime from what the cpu has and everything else interleaves scalar lanes
+#define LFSR_BATCH_LANES 8
+#define LFSR_BATCH_SCALAR 0
+#define LFSR_BATCH_SSE2 1
+#define LFSR_BATCH_AVX2 2
+#if defined(__x86_64__) || defined(__i386__)
+#define LFSR_BATCH_X86
+#endif
 
 #define field_sizeof(t, f) (sizeof(((t*)0)->f))
 
@@ -20,10 +131,21 @@
 #define CONNECTED_CMD 0x229c0985
 #define DISCONNECT_CMD 0x8f223a7b
 #define VALID_PACKET_ID 0x9056acd2
+#define CAPABILITY_CMD 0x5be3107d
+#define CAPABILITY_CHECK_CMD 0x6e41d8b3
+
+//highest packet version we send, version 2 adds a tag to the header that is checked before decrypting
+#define PACKET_VERSION 2
+
+//accept broadcasts without a tag from version 1 peers, build with MESH_NO_BROADCAST_V1_COMPAT to drop them before decrypting
+#ifndef MESH_NO_BROADCAST_V1_COMPAT
+#define MESH_BROADCAST_V1_COMPAT
+#endif
 
 void Promiscuous_RX(void *buf, wifi_promiscuous_pkt_type_t type);
 void *Static_ResendMessages(void *);
 void *Static_ProcessRXMessages(void *);
+void *Static_DHPoolThread(void *);
 
 typedef class MeshNetworkInternal : public MeshNetwork
 {
@@ -34,6 +156,9 @@ typedef class MeshNetworkInternal : public MeshNetwork
         //write data to a specific mac on the mesh network, returns the length written
         int Write(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen);
 
+        //queue data for a known device, returns a handle for WriteCompleteCallback
+        int WriteAsync(const uint8_t MAC[MAC_SIZE], const uint8_t *Data, unsigned short DataLen);
+
         //establish a connection a device, this only needs to be done once per device we talk to
         //ConnectedCallback will be triggered with the mac once a connection is established
         //or when a requested connection fails
@@ -74,12 +199,27 @@ typedef class MeshNetworkInternal : public MeshNetwork
 
         //Call this function if there is a chunk of data to process when not broadcasting itself
         void ProcessMessage(const uint8_t *Data, uint16_t Len);
+        void ProcessFrame(const uint8_t *Data, uint16_t Len);
 
         //set if broadcasting should be done
         void SetBroadcastFlag(bool BroadcastFlag);
 
         bool CanBroadcast();
 
+        //get a copy of the running counters
+        void GetStats(MeshStats *Stats);
+
+        //get a copy of the counters for a known device
+        int GetPeerStats(const uint8_t MAC[MAC_SIZE], MeshPeerStats *Stats);
+
+        //keep the diffie hellman challenge pool full
+        void DHPoolThread();
+
+#ifdef MESH_BENCHMARK
+        //run the on-device benchmarks and print the results
+        void Benchmark();
+#endif
+
     private:
         //we are using a similar but not identical header frame for 802.11
         //namely we removed the BSS ID and extended SequenceID to be 4 bytes
@@ -90,10 +230,21 @@ typedef class MeshNetworkInternal : public MeshNetwork
             uint8_t MAC_Reciever[6];
             uint8_t MAC_Sender[6];
             uint8_t Type;
-            uint8_t MAC_Unused[5];
+            uint8_t PacketVersion;              //0 for version 1 packets that have no tag
+            unsigned int PacketTag;             //see CalculatePacketTag
             uint16_t SequenceControl;
         } WifiHeaderStruct;
 
+        //buffer for an outgoing frame, payloads are built directly behind the header so the
+        //whole frame can be handed to the wifi without copying
+        typedef struct __attribute__((packed)) TXFrameStruct
+        {
+            struct TXFrameStruct *Next;         //next free frame in the pool
+            uint8_t Pooled;                     //frame belongs to the pool and is not freed
+            WifiHeaderStruct Header;
+            uint8_t Payload[MAX_PACKET_SIZE - sizeof(WifiHeaderStruct)];
+        } TXFrameStruct;
+
         //if this list is greater than 0x67 then modify PromiscuousRX action mask
         typedef enum MessageTypeEnum
         {
@@ -105,7 +256,10 @@ typedef class MeshNetworkInternal : public MeshNetwork
             MSG_Ping = 0x65,
             MSG_PingAck = 0x66,
             MSG_Disconnect = 0x67,
-            MSG_DisconnectAck = 0x68
+            MSG_DisconnectAck = 0x68,
+            MSG_MessageSAck = 0x69,
+            MSG_Fragment = 0x6a,
+            MSG_Coalesced = 0x6b
         } MessageTypeEnum;
 
         typedef enum ConnectStateEnum
@@ -116,6 +270,9 @@ typedef class MeshNetworkInternal : public MeshNetwork
             CS_ResetConnecting
         } ConnectStateEnum;
 
+    public:
+        //the LFSR types are public along with EncryptBatch/DecryptBatch so a gateway holding a lot of
+        //sessions can run them together
         typedef struct LFSRStruct
         {
             union {
@@ -129,6 +286,179 @@ typedef class MeshNetworkInternal : public MeshNetwork
             unsigned int LFSRRotMask;       //Mask for rotation LFSR
         } LFSRStruct;
 
+        //jump table to step an LFSR up to 16 bits at once, the next 16 bits generated are a linear
+        //function of the current value so each nibble of the LFSR has a table of what it contributes
+        typedef struct LFSRJumpStruct
+        {
+            unsigned int Mask;              //mask the table was built from
+            unsigned int Taps;              //decoded mask, bits of the LFSR xor'd together for a new bit
+            uint16_t XNOR;                  //bits generated from an LFSR of 0, covers the xnor flag
+            uint16_t Table[8][16];          //bits generated by each nibble of the LFSR
+        } LFSRJumpStruct;
+
+        //precomputed key schedule for the masks of an LFSRStruct, not part of LFSRStruct as
+        //LFSRStruct is sent during handshakes and stored in flash
+        typedef struct LFSRScheduleStruct
+        {
+            unsigned int Valid;             //set once the tables are built
+            LFSRJumpStruct LFSR;
+            LFSRJumpStruct LFSRRot;
+        } LFSRScheduleStruct;
+
+        //a single stream for EncryptBatch/DecryptBatch, each job has it's own LFSR and schedule
+        typedef struct LFSRBatchJobStruct
+        {
+            const uint8_t *InData;
+            uint8_t *OutData;
+            unsigned short DataLen;
+            LFSRStruct *LFSR;
+            const LFSRScheduleStruct *Schedule;     //jobs without a valid schedule run one at a time
+        } LFSRBatchJobStruct;
+
+        //encrypt or decrypt many independent streams at once, byte for byte the same as calling
+        //Encrypt/Decrypt on each job. jobs must not share an LFSR
+        void EncryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount);
+        void DecryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount);
+
+        //build the jump tables for the masks of an LFSR, Valid must be 0 on a new schedule
+        void BuildLFSRSchedule(LFSRScheduleStruct *Schedule, const LFSRStruct *LFSR);
+
+    private:
+
+        //state for one packet going through a cipher suite, the LFSR is carried between packets
+        //while the other suites start fresh from the key and sequence ID each packet
+        typedef struct CipherStateStruct
+        {
+            LFSRStruct *LFSR;                   //CipherLFSR stream, advanced as data is processed
+            const LFSRScheduleStruct *Schedule;
+            const unsigned int *Key;            //CipherChaCha20 256 bit key
+            unsigned int Nonce[3];              //sequence ID followed by the sender MAC for broadcasts
+            unsigned int Counter;               //next key stream block
+            unsigned int Block[16];             //current key stream block
+            uint8_t BlockUsed;                  //bytes of Block already used
+        } CipherStateStruct;
+
+        //interface each cipher suite provides, suites hold no per connection data so one
+        //instance is shared by every device using it
+        class CipherSuite
+        {
+            public:
+                CipherSuite(MeshNetworkInternal *Mesh) { this->Mesh = Mesh; }
+                virtual ~CipherSuite() {}
+                virtual const char *Name() = 0;
+
+                //setup the state for a new packet, called before Tag/Encrypt/Decrypt
+                virtual void Start(CipherStateStruct *State, unsigned int SequenceID) = 0;
+
+                //keyed value for the version 2 header, see CalculatePacketTag
+                virtual unsigned int Tag(CipherStateStruct *State, unsigned int SequenceID, unsigned short PacketLen) = 0;
+                virtual void Encrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen) = 0;
+
+                //if CRC is provided then it is updated with the decrypted data
+                virtual void Decrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen, uint8_t *CRC) = 0;
+
+            protected:
+                MeshNetworkInternal *Mesh;
+        };
+
+        class LFSRCipherSuite : public CipherSuite
+        {
+            public:
+                LFSRCipherSuite(MeshNetworkInternal *Mesh) : CipherSuite(Mesh) {}
+                const char *Name();
+                void Start(CipherStateStruct *State, unsigned int SequenceID);
+                unsigned int Tag(CipherStateStruct *State, unsigned int SequenceID, unsigned short PacketLen);
+                void Encrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen);
+                void Decrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen, uint8_t *CRC);
+        };
+
+        //RFC 7539 ChaCha20, block 0 of each packet is used for the tag and data starts at block 1
+        class ChaCha20CipherSuite : public CipherSuite
+        {
+            public:
+                ChaCha20CipherSuite(MeshNetworkInternal *Mesh) : CipherSuite(Mesh) {}
+                const char *Name();
+                void Start(CipherStateStruct *State, unsigned int SequenceID);
+                unsigned int Tag(CipherStateStruct *State, unsigned int SequenceID, unsigned short PacketLen);
+                void Encrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen);
+                void Decrypt(CipherStateStruct *State, const void *InData, void *OutData, unsigned short DataLen, uint8_t *CRC);
+                static void Block(const unsigned int Key[8], unsigned int Counter, const unsigned int Nonce[3], unsigned int Out[16]);
+        };
+
+        //a message in a send or receive window, Data is 0 if the slot is free
+        typedef struct WindowSlotStruct
+        {
+            uint8_t *Data;
+            unsigned short Len;
+            unsigned short Check;               //same as LastOutMessageCheck
+            uint8_t FastResent;                 //resent as a later message was acked, cleared by the timed resend
+            uint8_t Resent;                     //sent more than once so the ack can't be timed
+            int64_t FirstSent;                  //when it was first sent, it is given up on RESEND_GIVE_UP_MS later
+            int64_t ResendTime;                 //when it is sent again if not acked
+            uint8_t Type;                       //MSG_Message, MSG_Fragment or MSG_Coalesced
+            unsigned int Handle;                //WriteAsync handle, 0 if from Write. MSG_Coalesced keeps one per message after the data
+        } WindowSlotStruct;
+
+        //a message from a send window that is next in order, queued for the rx thread to hand to the app
+        typedef struct WindowDeliverStruct
+        {
+            struct WindowDeliverStruct *Next;
+            uint8_t MAC[MAC_SIZE];
+            uint8_t *Data;
+            unsigned short Len;
+            uint8_t Type;
+        } WindowDeliverStruct;
+
+        //MSG_Coalesced is several messages in one frame, each starts with this
+        typedef struct __attribute__((packed)) CoalesceHeaderStruct
+        {
+            uint16_t Len;
+        } CoalesceHeaderStruct;
+
+        //start of each fragment, fragments other than the last carry FRAGMENT_DATA_SIZE bytes
+        typedef struct __attribute__((packed)) FragmentHeaderStruct
+        {
+            uint16_t MessageID;
+            uint16_t Len;                       //length of the whole message
+            uint8_t Index;
+            uint8_t Count;
+        } FragmentHeaderStruct;
+
+        //a fragmented message being sent, fragments are put in the send window as it has room
+        typedef struct FragmentOutStruct
+        {
+            uint16_t MessageID;
+            uint16_t Len;
+            uint8_t Count;
+            uint8_t Next;                       //next fragment to put in the window
+            uint8_t Acked;
+            unsigned int Handle;                //WriteAsync handle, 0 if from Write
+            uint8_t Data[0];
+        } FragmentOutStruct;
+
+        //message queued by WriteAsync
+        typedef struct AsyncMessageStruct
+        {
+            unsigned int Handle;
+            unsigned short Len;
+            struct AsyncMessageStruct *Next;
+            uint8_t Data[0];
+        } AsyncMessageStruct;
+
+        //a fragmented message being put back together, Data is 0 if not in use
+        typedef struct ReassemblyStruct
+        {
+            uint8_t MAC[MAC_SIZE];
+            uint16_t MessageID;
+            uint16_t Len;
+            uint8_t Count;
+            uint8_t Received;
+            unsigned int FirstID;               //broadcast sequence ID of fragment 0, fragments use the IDs after it in order
+            unsigned int Have[8];               //bit per fragment index received
+            int64_t Updated;                    //when the last new fragment arrived
+            uint8_t *Data;
+        } ReassemblyStruct;
+
         //bit masks are in blocks of 5 bits allowing for up to 6 bits to be used
         //as part of the LFSR calculation, must be even
         typedef struct KnownDeviceStruct
@@ -138,16 +468,59 @@ typedef class MeshNetworkInternal : public MeshNetwork
             LFSRStruct LFSR_In;                 //LFSR for incoming data
             LFSRStruct LFSR_InPrev;             //previous LFSR for incoming data
             LFSRStruct LFSR_Out;                //LFSR for outgoing data
-            LFSRStruct LFSR_OutPrev;            //previous LFSR for outgoing data
+            LFSRStruct LFSR_OutPrev;            //LFSR the last message was encrypted from, kept to decrypt it again on a reset
+            LFSRScheduleStruct Schedule_In;     //key schedule for LFSR_In and LFSR_InPrev
+            LFSRScheduleStruct Schedule_Out;    //key schedule for LFSR_Out and LFSR_OutPrev
             unsigned int ID_In;                 //Incrementing ID for incoming
             unsigned int ID_Out;                //Incrementing ID for outgoing
             ConnectStateEnum ConnectState;      //indicate if we are connecting
-            uint8_t *LastOutMessage;            //last message sent encrypted
-            unsigned short LastOutMessageLen;   //length of last message sent
+            uint8_t Version;                    //packet version negotiated during the handshake, 0 if version 1
+            uint8_t CipherSuite;                //cipher suite negotiated during the handshake
+            uint8_t CipherSuites;               //bit per cipher suite the other side said it supports
+            unsigned int Key_In[8];             //key for incoming data if the cipher suite is not the LFSR
+            unsigned int Key_Out[8];            //key for outgoing data if the cipher suite is not the LFSR
+            uint8_t *LastOutMessage;            //last message if it still has to be encrypted for the connection, freed once it is
+            unsigned short LastOutMessageLen;   //length of LastOutMessage
+            TXFrameStruct *LastOutFrame;        //last message encrypted, resent as is until acked
+            unsigned short LastOutFrameLen;     //payload length of LastOutFrame
             unsigned short LastOutMessageCheck; //flag indicating how many times we've checked before sending the message
+            uint8_t LastOutMessageResent;       //sent more than once so the ack can't be timed
+            int64_t LastOutMessageSent;         //when the last message was first sent
+            int64_t LastOutMessageResend;       //when the last message is sent again if not acked
+            unsigned int LastOutMessageHandle;  //WriteAsync handle, 0 if from Write
+            MeshPeerStats PeerStats;            //round trip estimate, RTO in microseconds and resend counters
+            uint8_t Window;                     //messages that can be waiting on an ack, 0 for one at a time on chained LFSRs
+            unsigned int WindowBase;            //oldest outgoing ID that has not been acked
+            unsigned short WindowGapCheck;      //resend checks the oldest missing incoming message has been waited on
+            WindowSlotStruct *WindowOut;        //outgoing messages waiting on an ack by ID % Window
+            WindowSlotStruct *WindowIn;         //incoming messages held for in order delivery by ID % Window
+            uint16_t MaxMessage;                //largest message the device puts back together, 0 if it can't
+            FragmentOutStruct *FragmentOut;     //fragmented message being sent
+            ReassemblyStruct *FragmentIn;       //fragmented message being received
+            uint8_t Features;                   //FEATURE_ bits the device supports
+            uint8_t *CoalesceData;              //small messages held to be sent in one frame, FRAME_DATA_SIZE bytes then a handle per message
+            unsigned short CoalesceLen;
+            unsigned short CoalesceCount;
+            int64_t CoalesceFlush;              //when the held messages have to go out
+            int64_t TimerDeadline;              //when the resend thread looks at the device next
+            struct KnownDeviceStruct *TimerNext;
+            struct KnownDeviceStruct **TimerPrev;   //what points at this device in the timer wheel, 0 if not in it
+            int64_t TickTime;                   //when timeouts are counted next, 0 if nothing is waiting
+            AsyncMessageStruct *AsyncHead;      //messages from WriteAsync not handed to the send path yet
+            AsyncMessageStruct *AsyncTail;
+            unsigned short AsyncCount;
+            unsigned short AsyncCheck;          //resend checks the queue has waited on a connection
+            uint8_t AsyncDraining;              //AsyncDrain is running, a callback from it doesn't start another
             struct KnownDeviceStruct *Next;
         } KnownDeviceStruct;
 
+        //MSG_MessageSAck payload
+        typedef struct __attribute__((packed)) SAckStruct
+        {
+            unsigned int ID;                    //next ID expected, everything before it was received
+            unsigned int Received;              //bit n is set if ID + 1 + n was received
+        } SAckStruct;
+
         typedef struct __attribute__((packed)) PacketHeaderStruct
         {
             uint8_t InternalCRC;
@@ -158,6 +531,7 @@ typedef class MeshNetworkInternal : public MeshNetwork
         {
             uint8_t MAC[MAC_SIZE];
             unsigned int ID;
+            uint8_t MACCRC;                     //MAC part of the broadcast key, see PermuteBroadcastLFSR
             struct UnknownDeviceStruct *Next;
         } UnknownDeviceStruct;
 
@@ -182,16 +556,66 @@ typedef class MeshNetworkInternal : public MeshNetwork
             char Name[20];
         } ConnectedStruct;
 
-        typedef struct __attribute__((packed)) MeshMessageStruct
+        //appended to the handshake and connected messages to negotiate the packet version,
+        //version 1 peers ignore anything past the structures they expect
+        typedef struct __attribute__((packed)) CapabilityStruct
         {
-            MeshMessageStruct *next;
-            size_t Len;
-            size_t Count;
-            uint8_t Message[0];
-        } MeshMessageStruct;
+            unsigned int ID;                    //CAPABILITY_CMD
+            uint8_t Version;                    //highest packet version supported
+            uint8_t CipherSuites;               //bit per cipher suite supported, the connected reply only has the one picked
+            uint8_t Window;                     //send window supported, the connected reply has the one picked. 0 for one at a time
+            uint16_t MaxMessage;                //largest fragmented message accepted, 0 if fragments are not supported
+            uint8_t Features;                   //FEATURE_ bits
+        } CapabilityStruct;
+
+        //follows the capability reply in the connected message, encrypted with it. the handshake capabilities
+        //go out in the open so they are echoed back for the side that sent them to compare, a change to any
+        //encrypted byte before ID garbles ID as the LFSR takes in the decrypted data
+        typedef struct __attribute__((packed)) CapabilityCheckStruct
+        {
+            CapabilityStruct Peer;              //capabilities as they arrived in the handshake, zeroed if none came
+            uint8_t CipherSuites;               //bit per cipher suite the replying side supports
+            unsigned int ID;                    //CAPABILITY_CHECK_CMD
+        } CapabilityCheckStruct;
+
+        //a frame waiting for the rx thread, the ring is filled by the wifi callback and emptied by the
+        //rx thread without locks. Count is bumped by the callback for repeats until the rx thread takes
+        //the frame by setting RX_SLOT_TAKEN. the callback also sets RX_SLOT_TAKEN to evict a frame, the
+        //rx thread skips any slot it finds already taken
+        typedef struct RXSlotStruct
+        {
+            unsigned int Count;
+            uint16_t Len;
+            int64_t Queued;                     //esp_timer_get_time() when the frame was queued
+            uint8_t Message[MAX_PACKET_SIZE];
+        } RXSlotStruct;
+        #define RX_SLOT_TAKEN 0x80000000
+
+        //one ring per MeshRXClasses value
+        typedef struct RXQueueStruct
+        {
+            RXSlotStruct *Ring;
+            unsigned int Slots;                 //power of 2
+            unsigned int Head;                  //next position written, only changed by the wifi callback
+            unsigned int Tail;                  //next position read, only changed by the rx thread
+            unsigned int Evicted;               //oldest position not evicted, at or past Tail. only changed by the wifi callback
+        } RXQueueStruct;
+
+        //queued frame lookup by sender, type and the sequence ID from the packet header, only
+        //touched by the wifi callback. an entry is stale once the ring for Class has moved past Position
+        typedef struct RXDedupStruct
+        {
+            uint8_t MAC[MAC_SIZE];
+            uint8_t Type;
+            uint8_t Class;
+            uint8_t Valid;
+            unsigned int SequenceID;
+            unsigned int Position;              //ring position the frame was written to
+        } RXDedupStruct;
 
         //our mac for this device
         uint8_t MAC[MAC_SIZE];
+        uint8_t BroadcastMACCRC;
 
         //pointers to our entries, using a hash table to identify the entry
         UnknownDeviceStruct *UnknownDeviceTable[TABLE_SIZE];
@@ -202,49 +626,159 @@ typedef class MeshNetworkInternal : public MeshNetwork
         ConnectedCallbackFunc ConnectedCallback;
         SendFailedCallbackFunc SendFailedCallback;
         SendMessageFunc SendMessageCallback;
+        SendFrameFunc SendFrameCallback;
+        WriteCompleteCallbackFunc WriteCompleteCallback;
 
         //ping data
         uint8_t *PingData;
         uint16_t PingDataLen;
 
         //begin/tail pointers for stored messages to be processed
-        MeshMessageStruct *MeshMessageBegin;
-        MeshMessageStruct *MeshMessageTail;
+        RXQueueStruct RXQueues[RXClassCount];
+        unsigned int RXUnicastCredit;           //unicast frames left before a broadcast frame gets a turn
+        uint8_t RXDropPolicy;
+        int64_t RXMaxAge;                       //microseconds
+        int RXQueueEmpty(int Class);
+        uint8_t RXProducerBusy;                 //ProcessFrame and the wifi callback both add frames
+        SemaphoreHandle_t RXSemaphore;          //given when a frame is added to wake the rx thread
+        RXDedupStruct RXDedup[RX_DEDUP_SETS][RX_DEDUP_WAYS];
         pthread_t MessageRXThread;
 
+        //seen broadcast cache, each entry is a 22 bit fingerprint, 6 bit epoch and 4 bit count of copies
+        //seen since. only the rx thread adds entries, the wifi callback only bumps the count. the rx thread
+        //clears expired entries as the epoch moves so they can't look live again once the 6 bits wrap
+        #define SEEN_ENTRY(Fingerprint, Epoch, Copies) (((Fingerprint) << 10) | (((Epoch) & 0x3f) << 4) | (Copies))
+        #define SEEN_ENTRY_FINGERPRINT(Entry) ((Entry) >> 10)
+        #define SEEN_ENTRY_EPOCH(Entry) (((Entry) >> 4) & 0x3f)
+        #define SEEN_ENTRY_COPIES(Entry) ((Entry) & 0x0f)
+        unsigned int SeenCache[SEEN_CACHE_BUCKETS][SEEN_CACHE_WAYS];
+        volatile unsigned int SeenCacheSwept;   //epoch expired entries were last cleared in
+        unsigned int SeenCacheEpoch();
+        void SeenCacheSweep(unsigned int Epoch);
+        unsigned int *SeenCacheFind(const uint8_t *MAC, unsigned int SequenceID, unsigned int Epoch);
+        int SeenCacheCheck(const uint8_t *MAC, unsigned int SequenceID);
+        void SeenCacheAdd(const uint8_t *MAC, unsigned int SequenceID, unsigned int Copies);
+        unsigned int SeenCacheCopies(const uint8_t *MAC, unsigned int SequenceID);
+
         //LFSR for broadcast messages
         LFSRStruct LFSR_Broadcast;
+        LFSRScheduleStruct Schedule_Broadcast;
         unsigned int BroadcastMsgID;
+        unsigned int BroadcastMsgIDSaved;       //IDs up to this one are already stored so they are never reused
+        void ReserveBroadcastIDs(unsigned int Count);
 
         int Initialized;
         pthread_t MessageCheckThread;
-        int MessageWasSent;                 //flag to indicate that a message was sent so our checking function will process through possible connections
         int BroadcastFlag;
 
         //internal functions
         void HandleRXMessage(uint8_t *Data, size_t Len, size_t Count);
+        void AddRXFrame(const uint8_t *Payload, uint16_t PayloadLen);
         
         //init
         int SetBroadcastLFSR(unsigned int BroadcastLFSR[2], uint8_t Mask1[3], uint8_t Mask2[3]);
         int DHInit(unsigned long long P, unsigned long long G);
 
         //enryption
-        void Encrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR);
-        void Decrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR);
-        uint8_t *EncryptPacket(KnownDeviceStruct *Device, const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen);
-        uint8_t *DecryptPacket(KnownDeviceStruct *Device, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen, unsigned int *DoAck);
-        uint8_t *EncryptBroadcastPacket(const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen);
-        uint8_t *DecryptBroadcastPacket(UnknownDeviceStruct *Device, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen);
-        uint8_t *EncryptPacketCommon(unsigned int SequenceID, LFSRStruct *LFSR, const uint8_t *InData, unsigned short DataLen, unsigned short *OutPacketLen);
-        uint8_t *DecryptPacketCommon(unsigned int SequenceID, LFSRStruct *LFSR, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen);
+        //if a schedule is provided that matches the LFSR masks then the jump tables are used
+        void Encrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule = 0);
+        void Decrypt(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule = 0);
+        void DecryptCRC(const void *InData, void *OutData, unsigned short DataLen, LFSRStruct *LFSR, uint8_t *CRC, const LFSRScheduleStruct *Schedule = 0);
+        //encrypt functions write the packet into the payload of the frame along with the version and tag
+        //in it's header and return the packet length, 0 on failure
+        unsigned short EncryptPacket(KnownDeviceStruct *Device, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame);
+        uint8_t *DecryptPacket(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen, unsigned int *DoAck);
+        unsigned short EncryptBroadcastPacket(const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame);
+        unsigned short EncryptBroadcastPacket(unsigned int SequenceID, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame);
+        uint8_t *DecryptBroadcastPacket(UnknownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen);
+        unsigned short EncryptPacketCommon(unsigned int SequenceID, uint8_t Suite, CipherStateStruct *State, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame, uint8_t Version);
+        uint8_t *DecryptPacketCommon(unsigned int SequenceID, uint8_t Suite, CipherStateStruct *State, const WifiHeaderStruct *Header, uint8_t Version, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen);
+        unsigned int CalculatePacketTag(const LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, unsigned int SequenceID, unsigned short PacketLen);
+
+        //cipher suites
+        CipherSuite *CipherSuites[CipherSuiteCount];
+        uint8_t CipherSuitePreferred;               //suite asked for when connecting
+        uint8_t CipherSuiteBroadcast;
+        uint8_t CipherSuiteStrict;                  //refuse the LFSR if both sides have ChaCha20
+        unsigned int Key_Broadcast[8];
+        void InitCipherState(CipherStateStruct *State, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, const unsigned int *Key);
+        void SetSessionKeys(KnownDeviceStruct *Device);
+        void ReadCapabilities(KnownDeviceStruct *Device, const uint8_t *Data, int DataLen, int Reply);
+        void WriteCapabilities(KnownDeviceStruct *Device, uint8_t *Data, int Reply);
+        int CheckCapabilities(KnownDeviceStruct *Device, const uint8_t *Data, int DataLen);
+        int CipherSuiteAllowed(KnownDeviceStruct *Device);
+
+        //send windows, each message is keyed from the session and it's ID so they can be decrypted in any order
+        uint8_t SendWindow;                         //window offered when connecting, 0 if one at a time
+        pthread_mutex_t WindowLock;                 //recursive, held while the send callbacks are called so messages stay in order
+        WindowDeliverStruct *volatile WindowDeliverHead;    //messages received in order, only the rx thread calls the app with them
+        WindowDeliverStruct *WindowDeliverTail;
+        unsigned short EncryptWindowPacket(KnownDeviceStruct *Device, unsigned int ID, const uint8_t *InData, unsigned short DataLen, TXFrameStruct *Frame);
+        uint8_t *DecryptWindowPacket(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *InPacket, unsigned short PacketLen, unsigned short *OutDataLen);
+        void WindowResetIDs(KnownDeviceStruct *Device);
+        void SetWindow(KnownDeviceStruct *Device, uint8_t Window);
+        void FreeWindow(KnownDeviceStruct *Device);
+        int WindowWrite(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle);
+        int WindowSend(KnownDeviceStruct *Device, unsigned int ID);
+        int WindowPending(KnownDeviceStruct *Device);
+        void WindowReceive(KnownDeviceStruct *Device, const WifiHeaderStruct *Header, const uint8_t *Payload, unsigned short PayloadLen);
+        void WindowDeliver(KnownDeviceStruct *Device);
+        int WindowQueueDeliver(KnownDeviceStruct *Device, WindowSlotStruct *Slot);
+        void WindowSkipTo(KnownDeviceStruct *Device, unsigned int ID);
+        void WindowDeliverQueued();
+        void WindowAdvanceBase(KnownDeviceStruct *Device);
+        int WindowBuildSAck(KnownDeviceStruct *Device, SAckStruct *SAck);
+        void WindowAck(KnownDeviceStruct *Device, const uint8_t *Payload, unsigned short PayloadLen);
+        int WindowCheck(KnownDeviceStruct *Device, int64_t Now, int Tick, int64_t *NextResend);
+        void WindowFill(KnownDeviceStruct *Device);
+        int WindowAdd(KnownDeviceStruct *Device, uint8_t Type, uint8_t *Data, unsigned short DataLen, unsigned int Handle);
+        void WindowSlotDone(KnownDeviceStruct *Device, WindowSlotStruct *Slot, int Succeeded);
+        void WindowFail(KnownDeviceStruct *Device);
+
+        //fragmenting, unicast fragments go through the send window and are received in order
+        uint16_t MaxMessageSize;
+        uint16_t FragmentMsgID;
+        pthread_mutex_t FragmentLock;
+        ReassemblyStruct BroadcastReassembly[FRAGMENT_REASSEMBLY_SLOTS];
+        int WriteFragments(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle);
+        int WriteBroadcastFragments(const uint8_t *Data, unsigned short DataLen);
+        void HandleFragment(KnownDeviceStruct *Device, const uint8_t *MAC, const uint8_t *Data, unsigned short DataLen, unsigned int SequenceID);
+        int BroadcastFragmentMissing(const uint8_t *MAC, unsigned int SequenceID);
+        int64_t ExpireFragments(int64_t Now);
+
+        //small messages to a device held and sent together in one window slot, WindowLock must be held
+        uint16_t CoalesceDelay;
+        int CoalesceWrite(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle);
+        int CoalesceFlush(KnownDeviceStruct *Device);
+        unsigned int CoalescedCount(const uint8_t *Data, unsigned short DataLen);
+        void CoalesceDeliver(const uint8_t *MAC, const uint8_t *Data, unsigned short DataLen);
+        unsigned int CoalesceHandle(const uint8_t *Data, unsigned int Index);
+        void CoalesceFail(KnownDeviceStruct *Device);
+
+        //WriteAsync queues messages per device and hands them to the send path as it has room, every message
+        //sent is reported through SendDone with it's handle
+        uint8_t AsyncQueueDepth;
+        unsigned int AsyncHandle;               //last handle given out
+        int WriteDevice(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen, unsigned int Handle);
+        void AsyncDrain(KnownDeviceStruct *Device);
+        void AsyncFail(KnownDeviceStruct *Device);
+        void SendDone(KnownDeviceStruct *Device, unsigned int Handle, int Succeeded);
 
         //lfsr and crc
         unsigned int CreateLFSRMask();
-        void PermuteBroadcastLFSR(const uint8_t *MAC, unsigned int ID, LFSRStruct *LFSR);
+        uint8_t CalculateBroadcastMACCRC(const uint8_t *MAC);
+        void PermuteBroadcastLFSR(uint8_t MACCRC, unsigned int ID, LFSRStruct *LFSR);
+        void PermuteSessionLFSR(const LFSRStruct *Base, const LFSRScheduleStruct *Schedule, unsigned int ID, LFSRStruct *LFSR);
         void CalculateLFSR(LFSRStruct *LFSR);
+        static void CalculateLFSR(LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule);
         unsigned int RotateLFSR(unsigned int LFSR, unsigned int Mask, unsigned int Count);
+        static unsigned int JumpLFSR(unsigned int LFSR, const LFSRJumpStruct *Jump, unsigned int Count);
+        unsigned int DecodeLFSRMask(unsigned int Mask, unsigned int *XNOR);
+        void BuildLFSRJump(LFSRJumpStruct *Jump, unsigned int Mask);
+        const LFSRScheduleStruct *CheckLFSRSchedule(const LFSRScheduleStruct *Schedule, const LFSRStruct *LFSR);
         uint8_t CalculateCRC(const void *Data, unsigned int DataLen);
         uint8_t CalculateCRC(const void *Data, unsigned int DataLen, uint8_t StartCRC);
+        static const uint8_t CRCTable[4][256];
 
         //device tracking
         UnknownDeviceStruct *FindUnknownDevice(const uint8_t *HeaderData);
@@ -263,12 +797,120 @@ typedef class MeshNetworkInternal : public MeshNetwork
         void DHMul64(unsigned long long a, unsigned long long b, unsigned long long *ret);
         unsigned long long DHMod128(unsigned long long a[2], unsigned long long b);
         unsigned long long DHPowMod(unsigned long long g, unsigned long long priv);
+        unsigned long long DHPowModLegacy(unsigned long long g, unsigned long long priv);
+        unsigned long long DHMontMul(unsigned long long a, unsigned long long b);
         unsigned long long DHCreateChallenge(unsigned long long *challenge);
+        unsigned long long DHCreatePriv(unsigned long long *challenge);
+        void DHPoolPause(int Pause);
+        void DHBuildFixedBase(unsigned long long *Table, unsigned int Bits);
+        unsigned long long DHPowFixedBase(const unsigned long long *Table, unsigned int Bits, unsigned long long pr);
         unsigned long long DHFinishChallenge(unsigned long long priv, unsigned long long challenge);
         unsigned long long DH_P, DH_G;
+        unsigned long long DH_PInv, DH_R1, DH_R2;   //montgomery constants for DH_P
+#if DH_FIXED_BASE_BITS
+        unsigned long long DH_GTable[DH_FIXED_BASE_WINDOWS(DH_FIXED_BASE_BITS) * DH_FIXED_BASE_DIGITS(DH_FIXED_BASE_BITS)];
+#endif
+
+        //pool of private values and their challenges calculated ahead of time
+        typedef struct DHPoolEntryStruct
+        {
+            unsigned long long Priv;
+            unsigned long long Challenge;
+        } DHPoolEntryStruct;
+
+        DHPoolEntryStruct DHPool[DH_POOL_MAX_DEPTH];
+        unsigned int DHPoolCount;
+        unsigned int DHPoolDepth;
+        unsigned int DHPoolGeneration;              //changes when DH_P or DH_G change so stale entries are dropped
+        unsigned int DHPoolPaused;                  //set while DH_P and DH_G are being swapped out from under the pool thread
+        unsigned int DHPoolBusy;                    //set while the pool thread is calculating a challenge
+        pthread_mutex_t DHPoolLock;
+        pthread_cond_t DHPoolCond;
+        pthread_t DHPoolThreadID;
+
+        //running counters
+        MeshStats Stats;
 
         //payload handling code
         int SendPayload(MessageTypeEnum MsgType, const uint8_t *MAC, const void *InData, unsigned short DataLen);
+        int SendFrame(MessageTypeEnum MsgType, const uint8_t *MAC, TXFrameStruct *Frame, unsigned short DataLen);
+
+        //pool of tx frames so sending doesn't hit the heap
+        TXFrameStruct *GetTXFrame();
+        void ReleaseTXFrame(TXFrameStruct *Frame);
+        TXFrameStruct *TXFramePool;
+        pthread_mutex_t TXFrameLock;
+
+        //broadcasts to repeat after a random delay, a min heap on FireTime drained by the resend thread
+        typedef struct RebroadcastStruct
+        {
+            int64_t FireTime;
+            uint8_t MAC[MAC_SIZE];
+            unsigned int SequenceID;
+            unsigned int Count;                 //copies seen before it was handled, later ones are in the seen cache
+            size_t Len;
+            uint8_t Data[0];                    //whole 802.11 frame as received
+        } RebroadcastStruct;
+
+        RebroadcastStruct *RebroadcastQueue[REBROADCAST_QUEUE_SIZE];
+        unsigned int RebroadcastCount;
+        pthread_mutex_t RebroadcastLock;
+        SemaphoreHandle_t TXSemaphore;          //wakes the resend thread early when a sooner rebroadcast is queued
+        void ScheduleRebroadcast(const uint8_t *Data, size_t DataLen, const uint8_t *MAC, unsigned int SequenceID, size_t Count);
+        int64_t RunRebroadcasts(int64_t Now);
+
+        //our broadcasts waiting to go out, a fragmented broadcast is sent by the resend thread FRAGMENT_BROADCAST_GAP_MS
+        //between fragments with broadcast IDs FirstID onwards. broadcasts written while one is going out are
+        //encrypted and wait behind it so receivers see the IDs in order
+        typedef struct BroadcastTXStruct
+        {
+            struct BroadcastTXStruct *Next;
+            TXFrameStruct *Frame;               //encrypted frame if not fragmented
+            unsigned short FrameLen;
+            unsigned int FirstID;
+            uint16_t Len;                       //length of the fragmented message
+            uint8_t Count;                      //fragments, 0 if not fragmented
+            uint8_t Sent;
+            uint8_t Data[0];                    //each fragment with it's header, FRAME_DATA_SIZE apart
+        } BroadcastTXStruct;
+
+        BroadcastTXStruct *BroadcastTXHead;
+        BroadcastTXStruct *BroadcastTXTail;
+        int64_t BroadcastTXTime;                //when the next fragment can go
+        pthread_mutex_t BroadcastTXLock;        //also keeps broadcast IDs in the order frames are sent
+        int64_t RunBroadcastTX(int64_t Now);
+        int64_t CheckResends(int64_t Now);
+        int64_t CheckDevice(KnownDeviceStruct *Device, int64_t Now);
+
+        //the one message at a time waiting on an ack, see mesh-handle-tx.cpp
+        int LastOutEncrypt(KnownDeviceStruct *Device, const uint8_t *Data, unsigned short DataLen);
+        void LastOutDecrypt(KnownDeviceStruct *Device);
+        void LastOutFree(KnownDeviceStruct *Device);
+
+        //devices by when the resend thread has to look at them, see mesh-timer.cpp
+        KnownDeviceStruct *TimerWheel[TIMER_WHEEL_SLOTS];
+        KnownDeviceStruct *TimerWheelUpper[TIMER_WHEEL_UPPER_SLOTS];
+        KnownDeviceStruct *TimerExpired;        //due devices not handled yet
+        int64_t TimerWheelTime;                 //ms of the next slot to expire
+        unsigned int TimerCount;                //devices in the wheel or expired
+        pthread_mutex_t TimerLock;
+        void TimerSchedule(KnownDeviceStruct *Device, int64_t Deadline);
+        void TimerCancel(KnownDeviceStruct *Device);
+        void TimerLink(KnownDeviceStruct *Device, KnownDeviceStruct **Slot);
+        void TimerUnlink(KnownDeviceStruct *Device);
+        void TimerInsert(KnownDeviceStruct *Device);
+        void TimerExpire(int64_t Now);
+        KnownDeviceStruct *TimerPop();
+        int64_t TimerNextDeadline();
+
+        //adaptive resend timing from how long acks take
+        unsigned int RTOMin;                    //microseconds
+        unsigned int RTOMax;
+        volatile int64_t ResendWake;            //when the resend thread is going to wake up, 0 while it is checking. only a hint
+        unsigned int GetRTO(KnownDeviceStruct *Device);
+        void UpdateRTT(KnownDeviceStruct *Device, int64_t Sample);
+        void BackoffRTO(KnownDeviceStruct *Device);
+        int64_t ResendDeadline(KnownDeviceStruct *Device, int64_t FirstSent, int64_t Now);
 
         typedef struct __attribute__((packed)) PrefConnStruct
         {
@@ -281,8 +923,60 @@ typedef class MeshNetworkInternal : public MeshNetwork
         uint8_t FindPrefID(const uint8_t *MAC, uint8_t *DeviceCount);
         void DeletePref(const uint8_t *MAC);
 
+        //lane code the batch functions use, see LFSR_BATCH_SCALAR
+        uint8_t BatchMode;
+        uint8_t SelectBatchMode();
+        void CryptBatch(LFSRBatchJobStruct *Jobs, unsigned int JobCount, int DecryptFlag);
+        void CryptLanes(LFSRBatchJobStruct **Lanes, unsigned int LaneCount, int DecryptFlag);
+        static void CryptLaneByte(const uint8_t **InData, uint8_t **OutData, LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule, int DecryptFlag);
+#ifdef LFSR_BATCH_X86
+        void CryptLanesSSE2(const uint8_t **InData, uint8_t **OutData, unsigned int DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct **Schedule, int DecryptFlag);
+        void CryptLanesAVX2(const uint8_t **InData, uint8_t **OutData, unsigned int DataLen, LFSRStruct *LFSR, const LFSRScheduleStruct **Schedule, int DecryptFlag);
+#endif
+
+#ifdef MESH_BENCHMARK
+        void BenchmarkCRC();
+        void BenchmarkLFSR();
+        void BenchmarkBatch();
+        void BenchmarkBroadcast();
+        void BenchmarkDH();
+        void BenchmarkCipherSuites();
+        void BenchmarkWindowReset();
+#endif
+
 } MeshNetworkInternal;
 
 extern MeshNetworkInternal *_GlobalMesh;
 
+//jump an LFSR forward Count bits (1 to 16) with a jump table, same result as RotateLFSR
+//inline as this runs twice for every byte encrypted or decrypted
+inline unsigned int MeshNetworkInternal::JumpLFSR(unsigned int LFSR, const LFSRJumpStruct *Jump, unsigned int Count)
+{
+    unsigned int NewBits;
+
+    //the next 16 bits that will shift in, the lowest bit is the first one generated
+    NewBits = Jump->XNOR ^
+              Jump->Table[0][LFSR & 0xf] ^ Jump->Table[1][(LFSR >> 4) & 0xf] ^
+              Jump->Table[2][(LFSR >> 8) & 0xf] ^ Jump->Table[3][(LFSR >> 12) & 0xf] ^
+              Jump->Table[4][(LFSR >> 16) & 0xf] ^ Jump->Table[5][(LFSR >> 20) & 0xf] ^
+              Jump->Table[6][(LFSR >> 24) & 0xf] ^ Jump->Table[7][LFSR >> 28];
+
+    LFSR = (LFSR >> Count) | ((NewBits & ((1 << Count) - 1)) << (32 - Count));
+
+    //if our final value is 0 or 0xffffffff then change the value to 1
+    if(!LFSR || (LFSR == 0xffffffff))
+        LFSR = 1;
+
+    return LFSR;
+}
+
+//same as CalculateLFSR without a schedule but each rotation is a single jump
+inline void MeshNetworkInternal::CalculateLFSR(LFSRStruct *LFSR, const LFSRScheduleStruct *Schedule)
+{
+    unsigned int LFSRRot = LFSR->LFSRRot;
+
+    LFSR->LFSRRot = JumpLFSR(LFSRRot, &Schedule->LFSRRot, ((LFSRRot >> 7) & 0xf) + 1);
+    LFSR->LFSR = JumpLFSR(LFSR->LFSR, &Schedule->LFSR, (LFSRRot & 0xf) + 1);
+}
+
 #endif
\ No newline at end of file
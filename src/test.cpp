@@ -109,6 +109,13 @@ void SendToDeviceFailed(const uint8_t *MAC)
     Serial.print("\n");
 }
 
+void WriteComplete(const uint8_t *MAC, unsigned int Handle, int Succeeded)
+{
+    Serial.printf("Queued message %u to ", Handle);
+    SerialPrintMAC(MAC);
+    Serial.print(Succeeded ? " was received\n" : " failed\n");
+}
+
 void SendMessage(const uint8_t *Data, unsigned int Len)
 {
     Serial.printf("Request to send %d bytes of data\n", Len);
@@ -153,7 +160,14 @@ void setup()
     MeshInitData.ReceiveMessageCallback = MessageReceived;
     MeshInitData.BroadcastMessageCallback = BroadcastMessageReceived;
     MeshInitData.SendMessageCallback = SendMessage;
+    MeshInitData.SendFrameCallback = 0;
+    MeshInitData.WriteCompleteCallback = WriteComplete;
+    MeshInitData.WriteQueueDepth = 0;
     MeshInitData.BroadcastFlag = false;
+    MeshInitData.DHPoolDepth = 0;
+    MeshInitData.DHPoolPriority = 0;
+    MeshInitData.CipherSuite = MeshNetwork::CipherChaCha20;
+    MeshInitData.BroadcastCipherSuite = MeshNetwork::CipherLFSR;
 
     Mesh = NewMeshNetwork(&MeshInitData, &MeshInitialized);
     if(!Mesh || (MeshInitialized != MeshNetwork::MeshInitErrors::MeshInitialized))
@@ -204,6 +218,11 @@ void PrintMenu()
         "7. Do Receive Message Call\n"
         "8. Turn on Broadcast Flag\n"
         "9. Turn off Broadcast Flag\n"
+        "a. Queue message to connected device\n"
+        "s. Show stats\n"
+#ifdef MESH_BENCHMARK
+        "b. Run benchmarks\n"
+#endif
     );
 }
 
@@ -276,6 +295,64 @@ void loop()
             Mesh->SetBroadcastFlag(false);
             break;
 
+        case 0x61:
+        {
+            //queue message to connected device
+            int Handle;
+            DeviceID = GetOtherDevice();
+
+            Serial.println("Message?");
+            SerialCmd = GetSerialData();
+
+            Handle = Mesh->WriteAsync(DeviceMacs[DeviceID], (uint8_t *)SerialCmd, strlen(SerialCmd) + 1);
+            if(Handle < 0)
+                Serial.printf("Failed to queue message: %d\n", Handle);
+            else
+                Serial.printf("Queued message %d\n", Handle);
+            break;
+        }
+
+        case 0x73:
+        {
+            MeshNetwork::MeshStats Stats;
+            Mesh->GetStats(&Stats);
+            Serial.printf("DH pool hits %u, misses %u\n", Stats.DHPoolHits, Stats.DHPoolMisses);
+            Serial.printf("RX frames %u, repeats %u, seen %u, queue full %u, dropped oldest %u, expired %u, too large %u, busy %u\n", Stats.RXFrames,
+                          Stats.RXRepeats, Stats.RXSeen, Stats.RXQueueFull, Stats.RXDroppedOldest, Stats.RXExpired, Stats.RXTooLarge, Stats.RXBusy);
+            Serial.printf("Rebroadcasts: %u sent, %u cancelled, %u dropped\n", Stats.RebroadcastsSent, Stats.RebroadcastsCancelled, Stats.RebroadcastsDropped);
+            Serial.printf("Fragmented: %u sent, %u received, %u timed out, %u fragments dropped\n", Stats.FragmentedSent, Stats.Reassembled,
+                          Stats.ReassemblyTimeouts, Stats.ReassemblyDropped);
+            Serial.printf("Coalesced: %u frames, %u messages\n", Stats.CoalescedFrames, Stats.CoalescedMessages);
+            for(int i = 0; i < MeshNetwork::RXClassCount; i++)
+                Serial.printf("RX class %d: frames %u, queued %u, max queued %u, avg wait %uus, max wait %uus\n", i, Stats.RXClassFrames[i],
+                              Stats.RXClassDepth[i], Stats.RXClassMaxDepth[i],
+                              Stats.RXClassFrames[i] ? (unsigned int)(Stats.RXClassWait[i] / Stats.RXClassFrames[i]) : 0, Stats.RXClassMaxWait[i]);
+            Serial.print("RX latency:");
+            for(int i = 0; i < MESH_RX_LATENCY_BUCKETS; i++)
+                Serial.printf(" <%uus %u", 64 << i, Stats.RXLatency[i]);
+            Serial.print("\n");
+
+            //resend timing for each connected device
+            uint8_t PeerMACs[MAC_SIZE * 8];
+            MeshNetwork::MeshPeerStats PeerStats;
+            int PeerCount = Mesh->GetConnectedDevices(PeerMACs, sizeof(PeerMACs));
+            for(int i = 0; i < PeerCount; i++)
+            {
+                if(Mesh->GetPeerStats(&PeerMACs[i * MAC_SIZE], &PeerStats))
+                    continue;
+                SerialPrintMAC(&PeerMACs[i * MAC_SIZE]);
+                Serial.printf(": srtt %uus, rttvar %uus, rto %uus, resent %u, fast resent %u, timed out %u\n", PeerStats.SRTT, PeerStats.RTTVar,
+                              PeerStats.RTO, PeerStats.Retransmits, PeerStats.FastRetransmits, PeerStats.Timeouts);
+            }
+            break;
+        }
+
+#ifdef MESH_BENCHMARK
+        case 0x62:
+            MeshBenchmark();
+            break;
+#endif
+
         default:
             Serial.println("Unknown command");
     };